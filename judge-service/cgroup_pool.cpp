@@ -0,0 +1,332 @@
+#include "cgroup_pool.h"
+
+#include <linux/sched.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace
+{
+    bool write_file(const std::string &path, const std::string &value)
+    {
+        int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            return false;
+        }
+        ssize_t written = write(fd, value.data(), value.size());
+        close(fd);
+        return written == static_cast<ssize_t>(value.size());
+    }
+
+    std::string read_file(const std::string &path)
+    {
+        std::ifstream file(path);
+        std::stringstream contents;
+        contents << file.rdbuf();
+        return contents.str();
+    }
+
+    bool has_token(const std::string &list, const std::string &token)
+    {
+        std::istringstream words(list);
+        std::string word;
+        while (words >> word)
+        {
+            if (word == token)
+                return true;
+        }
+        return false;
+    }
+
+    // A "key value" line of a flat-keyed file such as memory.events
+    unsigned long read_key(const std::string &path, const std::string &key)
+    {
+        std::ifstream file(path);
+        std::string name;
+        unsigned long value;
+        while (file >> name >> value)
+        {
+            if (name == key)
+                return value;
+        }
+        return 0;
+    }
+
+    std::string own_cgroup()
+    {
+        // The v2 hierarchy is the "0::" line
+        std::ifstream file("/proc/self/cgroup");
+        std::string line;
+        while (std::getline(file, line))
+        {
+            if (line.rfind("0::", 0) == 0)
+            {
+                std::string path = "/sys/fs/cgroup" + line.substr(3);
+                while (path.size() > 1 && path.back() == '/')
+                    path.pop_back();
+                return path;
+            }
+        }
+        return "";
+    }
+
+    bool make_dir(const std::string &path)
+    {
+        return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+    }
+}
+
+pid_t fork_into_cgroup(int cgroup_fd)
+{
+    if (cgroup_fd == -1)
+    {
+        return fork();
+    }
+
+    struct clone_args args;
+    memset(&args, 0, sizeof(args));
+    args.flags = CLONE_INTO_CGROUP;
+    args.exit_signal = SIGCHLD;
+    args.cgroup = static_cast<uint64_t>(cgroup_fd);
+    return static_cast<pid_t>(syscall(SYS_clone3, &args, sizeof(args)));
+}
+
+CgroupPool::Slot::Slot(std::string path, int dir_fd) : path_(std::move(path)), dir_fd_(dir_fd)
+{
+    // Reading memory.peak through a descriptor that was written to reports
+    // the peak since that write (Linux 6.12); older kernels only have the
+    // lifetime peak, which is useless for a reused slot
+    peak_fd_ = open((path_ + "/memory.peak").c_str(), O_RDWR | O_CLOEXEC);
+    if (peak_fd_ == -1)
+    {
+        peak_fd_ = open((path_ + "/memory.peak").c_str(), O_RDONLY | O_CLOEXEC);
+        peak_resettable_ = false;
+    }
+}
+
+CgroupPool::Slot::~Slot()
+{
+    if (peak_fd_ != -1)
+    {
+        close(peak_fd_);
+    }
+    close(dir_fd_);
+    rmdir(path_.c_str());
+}
+
+void CgroupPool::Slot::reset_usage()
+{
+    if (peak_fd_ != -1 && peak_resettable_ && write(peak_fd_, "reset", 5) != 5)
+    {
+        peak_resettable_ = false;
+    }
+    oom_kills_at_start_ = read_key(path_ + "/memory.events", "oom_kill");
+}
+
+CgroupPool::Usage CgroupPool::Slot::usage() const
+{
+    Usage usage;
+    if (peak_fd_ != -1 && peak_resettable_)
+    {
+        char buffer[32];
+        ssize_t count = pread(peak_fd_, buffer, sizeof(buffer) - 1, 0);
+        if (count > 0)
+        {
+            buffer[count] = '\0';
+            usage.peak_memory_kb = std::strtoull(buffer, nullptr, 10) / 1024;
+        }
+    }
+    usage.oom_killed = read_key(path_ + "/memory.events", "oom_kill") > oom_kills_at_start_;
+    return usage;
+}
+
+std::shared_ptr<CgroupPool> CgroupPool::create(const std::string &root, size_t initial_slots)
+{
+    std::string base = root;
+    if (base.empty())
+    {
+        base = own_cgroup();
+        // An earlier judge in this container already moved itself down
+        if (base.size() > 11 && base.compare(base.size() - 11, 11, "/supervisor") == 0)
+        {
+            base.erase(base.size() - 11);
+        }
+    }
+    if (base.empty())
+    {
+        throw std::runtime_error("not in a cgroup v2 hierarchy");
+    }
+
+    std::string controllers = read_file(base + "/cgroup.controllers");
+    if (!has_token(controllers, "memory") || !has_token(controllers, "pids"))
+    {
+        throw std::runtime_error("memory and pids controllers not available in " + base);
+    }
+    bool has_cpu = has_token(controllers, "cpu");
+    std::string enable = has_cpu ? "+memory +pids +cpu" : "+memory +pids";
+
+    // Controllers can only be enabled for children once root itself holds
+    // no processes. New ones may be forked while we move, so go round a few
+    // times.
+    std::string supervisor = base + "/supervisor";
+    if (!make_dir(supervisor))
+    {
+        throw std::runtime_error("cannot create " + supervisor + ": " + strerror(errno));
+    }
+    for (int attempt = 0; attempt < 10; attempt++)
+    {
+        std::istringstream procs(read_file(base + "/cgroup.procs"));
+        std::string pid;
+        bool moved = false;
+        while (procs >> pid)
+        {
+            write_file(supervisor + "/cgroup.procs", pid);
+            moved = true;
+        }
+        if (!moved)
+            break;
+    }
+    if (!write_file(base + "/cgroup.subtree_control", enable))
+    {
+        throw std::runtime_error("cannot enable controllers in " + base + ": " + strerror(errno));
+    }
+
+    std::string sandbox_dir = base + "/sandbox";
+    if (!make_dir(sandbox_dir) || !write_file(sandbox_dir + "/cgroup.subtree_control", enable))
+    {
+        throw std::runtime_error("cannot set up " + sandbox_dir + ": " + strerror(errno));
+    }
+
+    std::shared_ptr<CgroupPool> pool(new CgroupPool(sandbox_dir, has_cpu));
+    for (size_t i = 0; i < std::max<size_t>(initial_slots, 1); i++)
+    {
+        std::unique_ptr<Slot> slot = pool->make_slot(pool->next_slot_++);
+        if (!slot)
+        {
+            throw std::runtime_error("cannot create cgroups under " + sandbox_dir + ": " + strerror(errno));
+        }
+        pool->free_.push_back(std::move(slot));
+    }
+
+    // Runs are started straight inside their slot, so that has to work
+    pid_t probe = fork_into_cgroup(pool->free_.back()->fd());
+    if (probe == 0)
+    {
+        _exit(0);
+    }
+    if (probe == -1)
+    {
+        throw std::runtime_error(std::string("clone3 with CLONE_INTO_CGROUP failed: ") + strerror(errno));
+    }
+    waitpid(probe, nullptr, 0);
+
+    return pool;
+}
+
+CgroupPool::CgroupPool(std::string sandbox_dir, bool has_cpu)
+    : sandbox_dir_(std::move(sandbox_dir)), has_cpu_(has_cpu)
+{
+}
+
+CgroupPool::~CgroupPool() = default;
+
+std::unique_ptr<CgroupPool::Slot> CgroupPool::make_slot(size_t index)
+{
+    // A slot left by an earlier judge is adopted as it is
+    std::string path = sandbox_dir_ + "/" + std::to_string(index);
+    if (!make_dir(path))
+    {
+        return nullptr;
+    }
+    write_file(path + "/cgroup.kill", "1");
+
+    int dir_fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+    {
+        rmdir(path.c_str());
+        return nullptr;
+    }
+
+    // Swap would let a program past memory.max without ever being OOM killed.
+    // Missing when the kernel has no swap accounting, which is as good.
+    write_file(path + "/memory.swap.max", "0");
+
+    return std::unique_ptr<Slot>(new Slot(path, dir_fd));
+}
+
+bool CgroupPool::prepare(Slot &slot, const Limits &limits)
+{
+    // Most acquires ask for what the slot already has; skip the writes then
+    if (!slot.limits_applied_ || !(slot.applied_ == limits))
+    {
+        slot.limits_applied_ = false;
+        std::string memory = limits.memory_bytes ? std::to_string(limits.memory_bytes) : "max";
+        std::string pids = limits.max_pids ? std::to_string(limits.max_pids) : "max";
+        if (!write_file(slot.path_ + "/memory.max", memory) || !write_file(slot.path_ + "/pids.max", pids))
+        {
+            return false;
+        }
+        if (has_cpu_)
+        {
+            std::string quota = limits.cpu_cores ? std::to_string(limits.cpu_cores * 100000UL) : "max";
+            if (!write_file(slot.path_ + "/cpu.max", quota + " 100000"))
+            {
+                return false;
+            }
+        }
+        slot.applied_ = limits;
+        slot.limits_applied_ = true;
+    }
+
+    slot.reset_usage();
+    return true;
+}
+
+CgroupPool::Lease CgroupPool::acquire(const Limits &limits)
+{
+    std::unique_ptr<Slot> slot;
+    size_t index = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!free_.empty())
+        {
+            slot = std::move(free_.back());
+            free_.pop_back();
+        }
+        else
+        {
+            index = next_slot_++;
+        }
+    }
+
+    if (!slot)
+    {
+        slot = make_slot(index);
+    }
+    if (!slot || !prepare(*slot, limits))
+    {
+        return nullptr;
+    }
+    return Lease(slot.release(), [this](Slot *released)
+                 { release(released); });
+}
+
+void CgroupPool::release(Slot *slot)
+{
+    // Runs are normally reaped by now; this only catches strays
+    write_file(slot->path_ + "/cgroup.kill", "1");
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.emplace_back(slot);
+}
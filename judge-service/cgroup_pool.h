@@ -0,0 +1,112 @@
+#ifndef CGROUP_POOL_H
+#define CGROUP_POOL_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+// Reusable cgroup v2 leaves for sandboxed programs. The slots are created
+// once, up front, and handed out again after each run instead of paying
+// for mkdir/rmdir per test; the pool only grows if every slot is busy.
+//
+// The pool owns a delegated subtree:
+//   <root>/supervisor   the judge itself (v2 forbids processes in a cgroup
+//                       that has controllers enabled for its children)
+//   <root>/sandbox/N    one slot per concurrently running program
+class CgroupPool
+{
+public:
+    struct Limits
+    {
+        size_t memory_bytes = 0; // memory.max, swap disabled; 0 leaves it unlimited
+        size_t max_pids = 0;     // pids.max, counting threads; 0 leaves it unlimited
+        unsigned cpu_cores = 0;  // cpu.max bandwidth; 0 leaves it unlimited
+
+        bool operator==(const Limits &other) const
+        {
+            return memory_bytes == other.memory_bytes && max_pids == other.max_pids && cpu_cores == other.cpu_cores;
+        }
+    };
+
+    struct Usage
+    {
+        size_t peak_memory_kb = 0; // 0 if the kernel can't report it
+        bool oom_killed = false;
+    };
+
+    class Slot
+    {
+    public:
+        ~Slot();
+
+        Slot(const Slot &) = delete;
+        Slot &operator=(const Slot &) = delete;
+
+        // Directory fd for CLONE_INTO_CGROUP
+        int fd() const { return dir_fd_; }
+
+        // Starts usage() afresh. Called on acquire, and again just before a
+        // program starts so the setup that preceded it isn't counted.
+        void reset_usage();
+
+        // Memory used since the last reset. Call once the program has been
+        // reaped.
+        Usage usage() const;
+
+    private:
+        friend class CgroupPool;
+
+        Slot(std::string path, int dir_fd);
+
+        std::string path_;
+        int dir_fd_;
+        int peak_fd_ = -1;
+        bool peak_resettable_ = true;
+        Limits applied_;
+        bool limits_applied_ = false;
+        unsigned long oom_kills_at_start_ = 0;
+    };
+
+    // The slot returns to the pool when the last copy is dropped; anything
+    // still running in it is killed then.
+    using Lease = std::shared_ptr<Slot>;
+
+    // Sets up the subtree under root (default: the judge's own cgroup) and
+    // moves the processes in root into the supervisor leaf. Throws
+    // std::runtime_error if cgroup v2 with the memory and pids controllers,
+    // or clone3() with CLONE_INTO_CGROUP, isn't available there.
+    static std::shared_ptr<CgroupPool> create(const std::string &root, size_t initial_slots);
+
+    ~CgroupPool();
+
+    CgroupPool(const CgroupPool &) = delete;
+    CgroupPool &operator=(const CgroupPool &) = delete;
+
+    // Never blocks: creates a new slot if none is free. Returns nullptr if
+    // that fails. Must not outlive the pool.
+    Lease acquire(const Limits &limits);
+
+private:
+    CgroupPool(std::string sandbox_dir, bool has_cpu);
+
+    std::unique_ptr<Slot> make_slot(size_t index);
+    bool prepare(Slot &slot, const Limits &limits);
+    void release(Slot *slot);
+
+    const std::string sandbox_dir_;
+    const bool has_cpu_;
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Slot>> free_;
+    size_t next_slot_ = 0;
+};
+
+// fork() that starts the child in the cgroup behind cgroup_fd, so it never
+// runs outside its limits; -1 for cgroup_fd is a plain fork(). Only
+// async-signal-safe, so it can be used from processes forked by the judge.
+pid_t fork_into_cgroup(int cgroup_fd);
+
+#endif // CGROUP_POOL_H
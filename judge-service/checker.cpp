@@ -0,0 +1,539 @@
+#include "checker.h"
+#include "comparator.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string_view>
+#include <unordered_map>
+
+namespace
+{
+    inline bool is_space(char c)
+    {
+        return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f';
+    }
+
+    void rtrim(std::string_view &line)
+    {
+        while (!line.empty() && is_space(line.back()))
+        {
+            line.remove_suffix(1);
+        }
+    }
+
+    class ComparatorSession : public CheckSession
+    {
+    public:
+        ComparatorSession(std::string_view expected, CompareMode mode) : comparator_(expected, mode) {}
+
+        bool feed(const char *data, size_t size) override { return comparator_.feed(data, size); }
+
+        CheckResult finish() override
+        {
+            return comparator_.finish() ? CheckResult::Accepted : CheckResult::WrongAnswer;
+        }
+
+    private:
+        StreamingComparator comparator_;
+    };
+
+    // Splits output into whitespace-separated tokens as it streams and pairs
+    // each with the next expected token. Only the token currently being read
+    // is buffered, and it may not grow much past the one it is compared to.
+    class TokenSession : public CheckSession
+    {
+    public:
+        explicit TokenSession(std::string_view expected) : expected_(expected) {}
+
+        bool feed(const char *data, size_t size) override
+        {
+            size_t i = 0;
+            while (!failed_ && i < size)
+            {
+                if (is_space(data[i]))
+                {
+                    if (in_token_)
+                    {
+                        end_token();
+                    }
+                    i++;
+                    continue;
+                }
+
+                if (!in_token_)
+                {
+                    begin_token();
+                    if (failed_)
+                        break;
+                }
+
+                size_t start = i;
+                while (i < size && !is_space(data[i]))
+                {
+                    i++;
+                }
+                token_.append(data + start, i - start);
+                if (token_.size() > max_token_size(current_))
+                {
+                    failed_ = true;
+                }
+            }
+            return !failed_;
+        }
+
+        CheckResult finish() override
+        {
+            if (in_token_ && !failed_)
+            {
+                end_token();
+            }
+            if (failed_)
+            {
+                return CheckResult::WrongAnswer;
+            }
+
+            // Any expected token left over means the output was short
+            while (pos_ < expected_.size() && is_space(expected_[pos_]))
+            {
+                pos_++;
+            }
+            return pos_ == expected_.size() ? CheckResult::Accepted : CheckResult::WrongAnswer;
+        }
+
+    protected:
+        virtual bool tokens_match(std::string_view output, std::string_view expected) const = 0;
+
+        virtual size_t max_token_size(std::string_view expected) const { return expected.size(); }
+
+    private:
+        void begin_token()
+        {
+            while (pos_ < expected_.size() && is_space(expected_[pos_]))
+            {
+                pos_++;
+            }
+            if (pos_ == expected_.size())
+            {
+                // More tokens than the answer has
+                failed_ = true;
+                return;
+            }
+
+            size_t end = pos_;
+            while (end < expected_.size() && !is_space(expected_[end]))
+            {
+                end++;
+            }
+            current_ = expected_.substr(pos_, end - pos_);
+            pos_ = end;
+            in_token_ = true;
+        }
+
+        void end_token()
+        {
+            failed_ = !tokens_match(token_, current_);
+            token_.clear();
+            in_token_ = false;
+        }
+
+        std::string_view expected_;
+        size_t pos_ = 0;
+        std::string_view current_;
+        std::string token_;
+        bool in_token_ = false;
+        bool failed_ = false;
+    };
+
+    class NocaseSession : public TokenSession
+    {
+    public:
+        using TokenSession::TokenSession;
+
+    protected:
+        bool tokens_match(std::string_view output, std::string_view expected) const override
+        {
+            return output.size() == expected.size() &&
+                   std::equal(output.begin(), output.end(), expected.begin(), [](char a, char b)
+                              { return std::tolower(static_cast<unsigned char>(a)) ==
+                                       std::tolower(static_cast<unsigned char>(b)); });
+        }
+    };
+
+    class FloatSession : public TokenSession
+    {
+    public:
+        FloatSession(std::string_view expected, double epsilon) : TokenSession(expected), epsilon_(epsilon) {}
+
+    protected:
+        bool tokens_match(std::string_view output, std::string_view expected) const override
+        {
+            double want;
+            if (!parse_number(expected, want))
+            {
+                // Words in a numeric answer still have to match exactly
+                return output == expected;
+            }
+
+            double got;
+            if (!parse_number(output, got))
+            {
+                return false;
+            }
+            if (std::isnan(want) || std::isinf(want))
+            {
+                return std::isnan(want) ? std::isnan(got) : got == want;
+            }
+
+            double diff = std::fabs(got - want);
+            return diff <= epsilon_ || diff <= epsilon_ * std::fabs(want);
+        }
+
+        // Leave room for extra digits of precision
+        size_t max_token_size(std::string_view expected) const override { return expected.size() + 256; }
+
+    private:
+        static bool parse_number(std::string_view token, double &value)
+        {
+            std::string text(token);
+            char *end = nullptr;
+            value = std::strtod(text.c_str(), &end);
+            return !text.empty() && end == text.c_str() + text.size();
+        }
+
+        double epsilon_;
+    };
+
+    // Expected lines are counted up front; each output line must use up one
+    // of them, so an extra or wrong line fails as soon as it ends.
+    class UnorderedLinesSession : public CheckSession
+    {
+    public:
+        explicit UnorderedLinesSession(std::string_view expected)
+        {
+            size_t start = 0;
+            while (start < expected.size())
+            {
+                size_t end = expected.find('\n', start);
+                if (end == std::string_view::npos)
+                {
+                    end = expected.size();
+                }
+                std::string_view line = expected.substr(start, end - start);
+                rtrim(line);
+                if (!line.empty())
+                {
+                    remaining_[line]++;
+                    unmatched_++;
+                    longest_ = std::max(longest_, line.size());
+                }
+                start = end + 1;
+            }
+        }
+
+        bool feed(const char *data, size_t size) override
+        {
+            size_t i = 0;
+            while (!failed_ && i < size)
+            {
+                const char *newline = static_cast<const char *>(std::memchr(data + i, '\n', size - i));
+                size_t end = newline ? static_cast<size_t>(newline - data) : size;
+                line_.append(data + i, end - i);
+                i = end;
+
+                if (line_.size() > longest_)
+                {
+                    // Only trailing whitespace could still make this line match
+                    std::string_view trimmed(line_);
+                    rtrim(trimmed);
+                    if (trimmed.size() > longest_)
+                    {
+                        failed_ = true;
+                        break;
+                    }
+                    line_.resize(trimmed.size());
+                }
+
+                if (newline)
+                {
+                    end_line();
+                    i++;
+                }
+            }
+            return !failed_;
+        }
+
+        CheckResult finish() override
+        {
+            if (!failed_)
+            {
+                end_line();
+            }
+            return !failed_ && unmatched_ == 0 ? CheckResult::Accepted : CheckResult::WrongAnswer;
+        }
+
+    private:
+        void end_line()
+        {
+            std::string_view line(line_);
+            rtrim(line);
+            if (!line.empty())
+            {
+                auto it = remaining_.find(line);
+                if (it == remaining_.end() || it->second == 0)
+                {
+                    failed_ = true;
+                }
+                else
+                {
+                    it->second--;
+                    unmatched_--;
+                }
+            }
+            line_.clear();
+        }
+
+        std::unordered_map<std::string_view, size_t> remaining_;
+        size_t unmatched_ = 0;
+        size_t longest_ = 0;
+        std::string line_;
+        bool failed_ = false;
+    };
+
+    class ComparatorChecker : public Checker
+    {
+    public:
+        explicit ComparatorChecker(CompareMode mode) : mode_(mode) {}
+
+        std::unique_ptr<CheckSession> start(const TestCase &test_case) const override
+        {
+            return std::make_unique<ComparatorSession>(test_case.expected_output, mode_);
+        }
+
+    private:
+        CompareMode mode_;
+    };
+
+    class NocaseChecker : public Checker
+    {
+    public:
+        std::unique_ptr<CheckSession> start(const TestCase &test_case) const override
+        {
+            return std::make_unique<NocaseSession>(test_case.expected_output);
+        }
+    };
+
+    class FloatChecker : public Checker
+    {
+    public:
+        explicit FloatChecker(double epsilon) : epsilon_(epsilon) {}
+
+        std::unique_ptr<CheckSession> start(const TestCase &test_case) const override
+        {
+            return std::make_unique<FloatSession>(test_case.expected_output, epsilon_);
+        }
+
+    private:
+        double epsilon_;
+    };
+
+    class UnorderedLinesChecker : public Checker
+    {
+    public:
+        std::unique_ptr<CheckSession> start(const TestCase &test_case) const override
+        {
+            return std::make_unique<UnorderedLinesSession>(test_case.expected_output);
+        }
+    };
+
+    class CustomChecker : public Checker
+    {
+    public:
+        CustomChecker(CompileCache::Lease binary, SecureSandbox &sandbox)
+            : binary_(std::move(binary)), sandbox_(sandbox) {}
+
+        std::unique_ptr<CheckSession> start(const TestCase &test_case) const override;
+
+        CheckResult run(const TestCase &test_case, int output_fd) const;
+
+    private:
+        CompileCache::Lease binary_;
+        SecureSandbox &sandbox_;
+    };
+
+    // Output is spooled to a memfd while the program runs; the checker only
+    // starts once it has exited.
+    class CustomSession : public CheckSession
+    {
+    public:
+        CustomSession(const CustomChecker &checker, const TestCase &test_case)
+            : checker_(checker), test_case_(test_case)
+        {
+            output_fd_ = memfd_create("checker_output", MFD_CLOEXEC);
+        }
+
+        ~CustomSession() override
+        {
+            if (output_fd_ != -1)
+                close(output_fd_);
+        }
+
+        bool feed(const char *data, size_t size) override
+        {
+            size_t written = 0;
+            while (output_fd_ != -1 && !write_failed_ && written < size)
+            {
+                ssize_t n = write(output_fd_, data + written, size - written);
+                if (n == -1)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    write_failed_ = true;
+                    break;
+                }
+                written += static_cast<size_t>(n);
+            }
+
+            // A spooling failure is ours, not the program's; let it finish
+            return true;
+        }
+
+        CheckResult finish() override
+        {
+            if (output_fd_ == -1 || write_failed_)
+            {
+                std::cerr << "Checker error: cannot spool program output" << std::endl;
+                return CheckResult::Failed;
+            }
+            return checker_.run(test_case_, output_fd_);
+        }
+
+    private:
+        const CustomChecker &checker_;
+        const TestCase &test_case_;
+        int output_fd_ = -1;
+        bool write_failed_ = false;
+    };
+
+    std::unique_ptr<CheckSession> CustomChecker::start(const TestCase &test_case) const
+    {
+        return std::make_unique<CustomSession>(*this, test_case);
+    }
+
+    CheckResult CustomChecker::run(const TestCase &test_case, int output_fd) const
+    {
+        std::shared_ptr<const InputFile> answer;
+        try
+        {
+            answer = InputFile::create(test_case.expected_output);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Checker error: " << e.what() << std::endl;
+            return CheckResult::Failed;
+        }
+
+        int input_fd = test_case.input->open_reader();
+        int answer_fd = answer->open_reader();
+        if (input_fd == -1 || answer_fd == -1)
+        {
+            if (input_fd != -1)
+                close(input_fd);
+            if (answer_fd != -1)
+                close(answer_fd);
+            return CheckResult::Failed;
+        }
+
+        // The sandbox copies the files into the checker's /tmp, so it sees
+        // nothing of any other run
+        SecureSandbox::SandboxResult result =
+            sandbox_.execute({binary_->path, "/tmp/input", "/tmp/output", "/tmp/answer"}, *test_case.input,
+                             {{"input", input_fd}, {"output", output_fd}, {"answer", answer_fd}});
+        close(input_fd);
+        close(answer_fd);
+
+        if (result.setup_failed)
+        {
+            std::cerr << "Checker error: could not be started" << std::endl;
+        }
+        else if (result.timeout || result.memory_exceeded)
+        {
+            std::cerr << "Checker error: killed past its " << (result.timeout ? "time" : "memory") << " limit"
+                      << std::endl;
+        }
+        else if (result.signal_killed)
+        {
+            std::cerr << "Checker error: killed by signal " << result.signal << std::endl;
+        }
+        else
+        {
+            switch (result.exit_code)
+            {
+            case 0:
+                return CheckResult::Accepted;
+            case 1: // wrong answer
+            case 2: // presentation error
+                return CheckResult::WrongAnswer;
+            }
+            std::cerr << "Checker error: exited with status " << result.exit_code << std::endl;
+        }
+        return CheckResult::Failed;
+    }
+}
+
+std::shared_ptr<const Checker> make_builtin_checker(const std::string &spec)
+{
+    if (spec == "exact" || spec == "lines" || spec == "tokens")
+    {
+        return std::make_shared<ComparatorChecker>(parse_compare_mode(spec));
+    }
+    if (spec == "nocase")
+    {
+        return std::make_shared<NocaseChecker>();
+    }
+    if (spec == "unordered")
+    {
+        return std::make_shared<UnorderedLinesChecker>();
+    }
+    if (spec == "float")
+    {
+        return std::make_shared<FloatChecker>(1e-6);
+    }
+    if (spec.compare(0, 6, "float:") == 0)
+    {
+        const char *text = spec.c_str() + 6;
+        char *end = nullptr;
+        double epsilon = std::strtod(text, &end);
+        if (end == text || *end != '\0' || !(epsilon >= 0))
+        {
+            return nullptr;
+        }
+        return std::make_shared<FloatChecker>(epsilon);
+    }
+    return nullptr;
+}
+
+SecureSandbox::SandboxConfig custom_checker_sandbox(SecureSandbox::SandboxConfig sandbox)
+{
+    sandbox.language = nullptr;
+    sandbox.syscalls = SyscallProfile::Checker;
+    sandbox.time_limit_ms = 10000;
+    sandbox.wall_time_limit_ms = 20000; // killed past this even if not computing
+    sandbox.memory_limit_mb = 512;
+    sandbox.output_limit_bytes = 1024 * 1024;
+    sandbox.process_limit = 1;
+    sandbox.prefork_count = 1;
+    sandbox.writable_paths.clear();
+    return sandbox;
+}
+
+std::shared_ptr<const Checker> make_custom_checker(CompileCache::Lease binary, SecureSandbox &sandbox)
+{
+    return std::make_shared<CustomChecker>(std::move(binary), sandbox);
+}
@@ -0,0 +1,67 @@
+#ifndef CHECKER_H
+#define CHECKER_H
+
+#include <memory>
+#include <string>
+
+#include "compile_cache.h"
+#include "sandbox.h"
+#include "test_case_cache.h"
+
+enum class CheckResult
+{
+    Accepted,
+    WrongAnswer,
+    Failed, // the checker itself broke; not the submission's fault
+};
+
+// State for checking one run. The sandbox feeds it stdout as it is read, so
+// checking overlaps with the run instead of being a second pass afterwards.
+class CheckSession
+{
+public:
+    virtual ~CheckSession() = default;
+
+    // Returns false once the output can no longer be accepted, so the run
+    // can be stopped early.
+    virtual bool feed(const char *data, size_t size) = 0;
+
+    // Call once the program has exited normally.
+    virtual CheckResult finish() = 0;
+};
+
+// Decides whether a program's output answers a test case. A checker is
+// immutable and shared by concurrent runs; per-run state lives in the
+// session it starts.
+class Checker
+{
+public:
+    virtual ~Checker() = default;
+
+    // test_case and the checker must outlive the session.
+    virtual std::unique_ptr<CheckSession> start(const TestCase &test_case) const = 0;
+};
+
+// Built-in checkers, by spec:
+//   exact, lines, tokens   the StreamingComparator modes
+//   nocase                 tokens, compared ignoring ASCII case
+//   float[:eps]            tokens; numbers match within eps, absolute or
+//                          relative (default 1e-6), other tokens exactly
+//   unordered              the same non-blank lines in any order, ignoring
+//                          trailing whitespace
+// Returns nullptr for an unknown spec.
+std::shared_ptr<const Checker> make_builtin_checker(const std::string &spec);
+
+// The sandbox custom checkers run in, made from sandbox, the one tests run
+// in: the checker's own syscalls and more room than a submission gets. It
+// needs the sandbox's root, where each run's /tmp is its own.
+SecureSandbox::SandboxConfig custom_checker_sandbox(SecureSandbox::SandboxConfig sandbox);
+
+// Runs a compiled checker in sandbox once the output is complete, testlib
+// style: `checker input output answer`, the three copied into the run's
+// /tmp. Exit status 0 accepts, 1 and 2 reject and anything else counts as a
+// checker failure. The lease keeps the binary from being evicted for as
+// long as the checker exists; the sandbox must outlive it too.
+std::shared_ptr<const Checker> make_custom_checker(CompileCache::Lease binary, SecureSandbox &sandbox);
+
+#endif // CHECKER_H
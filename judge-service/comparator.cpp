@@ -0,0 +1,307 @@
+#include "comparator.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    inline bool is_space(char c)
+    {
+        return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f';
+    }
+
+    inline bool is_line_space(char c)
+    {
+        return c == ' ' || c == '\r' || c == '\t' || c == '\v' || c == '\f';
+    }
+
+    // Length of the common prefix of a and b, 16 bytes at a time where SSE2
+    // is available. Matching output is the common case, so this is where
+    // almost all bytes are consumed.
+    size_t common_prefix(const char *a, const char *b, size_t n)
+    {
+        size_t i = 0;
+#ifdef __SSE2__
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+            __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+            unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)));
+            if (mask != 0xFFFF)
+            {
+                return i + __builtin_ctz(~mask);
+            }
+        }
+#endif
+        while (i < n && a[i] == b[i])
+        {
+            i++;
+        }
+        return i;
+    }
+}
+
+CompareMode parse_compare_mode(const std::string &name)
+{
+    if (name == "lines")
+        return CompareMode::Lines;
+    if (name == "tokens")
+        return CompareMode::Tokens;
+    return CompareMode::Exact;
+}
+
+StreamingComparator::StreamingComparator(std::string_view expected, CompareMode mode)
+    : expected_(expected), mode_(mode)
+{
+    if (mode_ == CompareMode::Exact)
+    {
+        // Trailing whitespace never matters, so drop it from the expected side
+        // once and let the output have any amount of it
+        size_t end = expected_.size();
+        while (end > 0 && is_space(expected_[end - 1]))
+        {
+            end--;
+        }
+        expected_ = expected_.substr(0, end);
+    }
+}
+
+bool StreamingComparator::feed(const char *data, size_t size)
+{
+    if (mismatch_ || finished_)
+    {
+        return !mismatch_;
+    }
+
+    switch (mode_)
+    {
+    case CompareMode::Exact:
+        feed_exact(data, size);
+        break;
+    case CompareMode::Lines:
+        feed_lines(data, size);
+        break;
+    case CompareMode::Tokens:
+        feed_tokens(data, size);
+        break;
+    }
+    return !mismatch_;
+}
+
+size_t StreamingComparator::feed_exact(const char *data, size_t size)
+{
+    size_t i = 0;
+    if (pos_ < expected_.size())
+    {
+        size_t n = std::min(size, expected_.size() - pos_);
+        size_t same = common_prefix(data, expected_.data() + pos_, n);
+        pos_ += same;
+        i = same;
+        if (same < n)
+        {
+            mismatch_ = true;
+            return i;
+        }
+    }
+
+    // Past the end of the answer only trailing whitespace is allowed
+    for (; i < size; i++)
+    {
+        if (!is_space(data[i]))
+        {
+            mismatch_ = true;
+            return i;
+        }
+    }
+    return i;
+}
+
+size_t StreamingComparator::feed_lines(const char *data, size_t size)
+{
+    size_t i = 0;
+    while (i < size)
+    {
+        // Identical bytes leave the state unchanged wherever they fall, so
+        // skip over them in bulk
+        if (pending_ws_.empty() && !expected_done_)
+        {
+            size_t n = std::min(size - i, expected_.size() - pos_);
+            size_t same = common_prefix(data + i, expected_.data() + pos_, n);
+            i += same;
+            pos_ += same;
+            if (i == size)
+            {
+                break;
+            }
+        }
+
+        char c = data[i++];
+        if (c == '\n')
+        {
+            pending_ws_.clear();
+            if (expected_done_)
+            {
+                continue;
+            }
+            skip_expected(false);
+            if (pos_ == expected_.size())
+            {
+                expected_done_ = true;
+                continue;
+            }
+            if (expected_[pos_] != '\n')
+            {
+                mismatch_ = true;
+                return i;
+            }
+            pos_++;
+        }
+        else if (is_line_space(c))
+        {
+            pending_ws_ += c;
+        }
+        else
+        {
+            if (expected_done_)
+            {
+                mismatch_ = true;
+                return i;
+            }
+
+            // Whitespace followed by more content on the line must match exactly
+            if (!pending_ws_.empty())
+            {
+                if (expected_.substr(pos_, pending_ws_.size()) != pending_ws_)
+                {
+                    mismatch_ = true;
+                    return i;
+                }
+                pos_ += pending_ws_.size();
+                pending_ws_.clear();
+            }
+
+            if (pos_ >= expected_.size() || expected_[pos_] != c)
+            {
+                mismatch_ = true;
+                return i;
+            }
+            pos_++;
+        }
+    }
+    return i;
+}
+
+size_t StreamingComparator::feed_tokens(const char *data, size_t size)
+{
+    size_t i = 0;
+    while (i < size)
+    {
+        size_t n = std::min(size - i, expected_.size() - pos_);
+        size_t same = common_prefix(data + i, expected_.data() + pos_, n);
+        if (same > 0)
+        {
+            i += same;
+            pos_ += same;
+            in_token_ = !is_space(data[i - 1]);
+            if (i == size)
+            {
+                break;
+            }
+        }
+
+        char c = data[i++];
+        if (is_space(c))
+        {
+            if (in_token_)
+            {
+                // The output token ended; the expected one must end here too
+                if (!at_expected_token_end())
+                {
+                    mismatch_ = true;
+                    return i;
+                }
+                in_token_ = false;
+            }
+            continue;
+        }
+
+        if (!in_token_)
+        {
+            skip_expected(true);
+            if (pos_ == expected_.size())
+            {
+                mismatch_ = true;
+                return i;
+            }
+            in_token_ = true;
+        }
+
+        if (pos_ >= expected_.size() || expected_[pos_] != c)
+        {
+            mismatch_ = true;
+            return i;
+        }
+        pos_++;
+    }
+    return i;
+}
+
+bool StreamingComparator::at_expected_token_end() const
+{
+    return pos_ == expected_.size() || is_space(expected_[pos_]);
+}
+
+void StreamingComparator::skip_expected(bool include_newlines)
+{
+    while (pos_ < expected_.size() &&
+           (include_newlines ? is_space(expected_[pos_]) : is_line_space(expected_[pos_])))
+    {
+        pos_++;
+    }
+}
+
+bool StreamingComparator::finish()
+{
+    if (mismatch_ || finished_)
+    {
+        return !mismatch_;
+    }
+    finished_ = true;
+
+    switch (mode_)
+    {
+    case CompareMode::Exact:
+        mismatch_ = pos_ != expected_.size();
+        break;
+    case CompareMode::Lines:
+        // The last output line ends here; what remains of the answer may
+        // only be the rest of that line's whitespace and blank lines
+        if (!expected_done_)
+        {
+            skip_expected(true);
+            mismatch_ = pos_ != expected_.size();
+        }
+        break;
+    case CompareMode::Tokens:
+        if (in_token_ && !at_expected_token_end())
+        {
+            mismatch_ = true;
+            break;
+        }
+        skip_expected(true);
+        mismatch_ = pos_ != expected_.size();
+        break;
+    }
+    return !mismatch_;
+}
+
+bool outputs_match(std::string_view actual, std::string_view expected, CompareMode mode)
+{
+    StreamingComparator comparator(expected, mode);
+    comparator.feed(actual.data(), actual.size());
+    return comparator.finish();
+}
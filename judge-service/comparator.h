@@ -0,0 +1,59 @@
+#ifndef COMPARATOR_H
+#define COMPARATOR_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+enum class CompareMode
+{
+    Exact,  // byte-for-byte, ignoring trailing whitespace at the very end
+    Lines,  // line by line, ignoring trailing whitespace on each line and trailing blank lines
+    Tokens, // whitespace-separated tokens must match; amount and kind of whitespace is ignored
+};
+
+// Parses "exact", "lines" or "tokens"; anything else is Exact.
+CompareMode parse_compare_mode(const std::string &name);
+
+// Checks program output against the expected answer incrementally, as it
+// comes off the pipe, without buffering it. feed() returns false as soon as
+// the output can no longer match, so the caller can kill the program.
+class StreamingComparator
+{
+public:
+    // expected must outlive the comparator.
+    StreamingComparator(std::string_view expected, CompareMode mode);
+
+    bool feed(const char *data, size_t size);
+
+    // Call once the output has ended. Returns true if it matched.
+    bool finish();
+
+    bool mismatched() const { return mismatch_; }
+
+private:
+    size_t feed_exact(const char *data, size_t size);
+    size_t feed_lines(const char *data, size_t size);
+    size_t feed_tokens(const char *data, size_t size);
+    bool at_expected_token_end() const;
+    void skip_expected(bool include_newlines);
+
+    std::string_view expected_;
+    CompareMode mode_;
+    size_t pos_ = 0; // next unmatched byte of expected_
+    bool mismatch_ = false;
+    bool finished_ = false;
+
+    // Lines: trailing whitespace seen on the current output line that only
+    // counts if more content follows on that line
+    std::string pending_ws_;
+    // Lines: expected_ ran out on a line break; only blank lines may follow
+    bool expected_done_ = false;
+    // Tokens: currently inside an output token
+    bool in_token_ = false;
+};
+
+// One-shot comparison of a complete output.
+bool outputs_match(std::string_view actual, std::string_view expected, CompareMode mode);
+
+#endif // COMPARATOR_H
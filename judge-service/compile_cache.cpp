@@ -0,0 +1,358 @@
+#include "compile_cache.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    bool read_file(const std::string &path, std::string &contents)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+        {
+            return false;
+        }
+        contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        return in.good() || in.eof();
+    }
+
+    bool write_file(const std::string &path, const std::string &contents)
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            return false;
+        }
+        out.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+        out.close();
+        return out.good();
+    }
+
+    constexpr size_t kSignatureSize = 32; // HMAC-SHA256
+
+    bool is_key(const std::string &name)
+    {
+        return name.size() == 64 && std::all_of(name.begin(), name.end(), [](char c)
+                                                 { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'); });
+    }
+}
+
+CompileCache::CompileCache(const std::string &directory, size_t max_bytes, std::unique_ptr<RemoteStore> remote,
+                           std::string remote_secret)
+    : directory_(directory), max_bytes_(max_bytes), remote_(std::move(remote)),
+      remote_secret_(std::move(remote_secret))
+{
+    if (remote_ && remote_secret_.empty())
+    {
+        throw std::invalid_argument("Compile cache: a remote tier needs a secret to sign binaries with");
+    }
+    load_existing();
+}
+
+std::string CompileCache::make_key(const std::string &source, const std::string &compiler,
+                                   const std::vector<std::string> &flags)
+{
+    std::ostringstream identity;
+    identity << compiler << '\0';
+
+    struct stat st;
+    if (stat(compiler.c_str(), &st) == 0)
+    {
+        identity << st.st_size << ':' << st.st_mtime;
+    }
+    identity << '\0';
+
+    for (const auto &flag : flags)
+    {
+        identity << flag << '\0';
+    }
+    std::string header = identity.str();
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+    EVP_DigestUpdate(ctx, header.data(), header.size());
+    EVP_DigestUpdate(ctx, source.data(), source.size());
+    EVP_DigestFinal_ex(ctx, digest, &digest_len);
+    EVP_MD_CTX_free(ctx);
+
+    static const char hex[] = "0123456789abcdef";
+    std::string key;
+    key.reserve(digest_len * 2);
+    for (unsigned int i = 0; i < digest_len; i++)
+    {
+        key += hex[digest[i] >> 4];
+        key += hex[digest[i] & 0xf];
+    }
+    return key;
+}
+
+CompileCache::Lease CompileCache::acquire(const std::string &key, const CompileFn &compile)
+{
+    std::promise<bool> promise;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true)
+        {
+            if (Lease hit = lookup_locked(key))
+            {
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return hit;
+            }
+
+            auto pending = in_flight_.find(key);
+            if (pending == in_flight_.end())
+            {
+                break;
+            }
+
+            // Someone else is already producing this binary. If their
+            // compile threw, it says nothing about the source.
+            std::shared_future<bool> result = pending->second;
+            lock.unlock();
+            bool failed = false;
+            try
+            {
+                failed = !result.get();
+            }
+            catch (...)
+            {
+            }
+            lock.lock();
+            if (failed)
+            {
+                return nullptr;
+            }
+        }
+        in_flight_[key] = promise.get_future().share();
+    }
+
+    std::string final_path = directory_ + "/" + key;
+    std::string temp_path;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        temp_path = final_path + ".tmp" + std::to_string(temp_counter_++);
+    }
+
+    bool ok = false;
+    bool compiled = false;
+    try
+    {
+        std::string blob;
+        if (remote_ && remote_->fetch(key, blob) && unpack_remote(key, blob))
+        {
+            ok = write_file(temp_path, blob);
+        }
+        if (ok)
+        {
+            remote_hits_.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            compiles_.fetch_add(1, std::memory_order_relaxed);
+            ok = compiled = compile(temp_path);
+        }
+        ok = ok && publish(temp_path, final_path);
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        in_flight_.erase(key);
+        promise.set_exception(std::current_exception());
+        std::remove(temp_path.c_str());
+        throw;
+    }
+
+    if (!ok)
+    {
+        std::remove(temp_path.c_str());
+    }
+
+    std::string blob;
+    if (ok && compiled && remote_ && read_file(final_path, blob))
+    {
+        std::string signature = sign(key, blob);
+        if (!signature.empty())
+        {
+            remote_->store(key, signature + blob);
+        }
+    }
+
+    Lease lease;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (ok)
+        {
+            std::error_code ec;
+            size_t size = fs::file_size(final_path, ec);
+            lease = insert_locked(key, final_path, ec ? 0 : size);
+        }
+        in_flight_.erase(key);
+    }
+    promise.set_value(ok);
+    return lease;
+}
+
+CompileCache::Stats CompileCache::stats() const
+{
+    Stats stats;
+    stats.hits = hits_.load(std::memory_order_relaxed);
+    stats.remote_hits = remote_hits_.load(std::memory_order_relaxed);
+    stats.compiles = compiles_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+bool CompileCache::publish(const std::string &temp_path, const std::string &final_path)
+{
+    // Submissions run as an unprivileged user, so the binary must be
+    // world-executable. rename() makes it visible atomically.
+    return chmod(temp_path.c_str(), 0755) == 0 && std::rename(temp_path.c_str(), final_path.c_str()) == 0;
+}
+
+std::string CompileCache::sign(const std::string &key, const std::string &binary) const
+{
+    // The key is signed too, so a genuine binary can't be replayed under
+    // another source's key
+    std::string message = key;
+    message += '\0';
+    message += binary;
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int mac_len = 0;
+    if (!HMAC(EVP_sha256(), remote_secret_.data(), static_cast<int>(remote_secret_.size()),
+              reinterpret_cast<const unsigned char *>(message.data()), message.size(), mac, &mac_len) ||
+        mac_len != kSignatureSize)
+    {
+        return "";
+    }
+    return std::string(reinterpret_cast<const char *>(mac), mac_len);
+}
+
+bool CompileCache::unpack_remote(const std::string &key, std::string &blob) const
+{
+    // The signature, then the binary
+    if (blob.size() > kSignatureSize)
+    {
+        std::string binary = blob.substr(kSignatureSize);
+        std::string expected = sign(key, binary);
+        if (expected.size() == kSignatureSize && CRYPTO_memcmp(expected.data(), blob.data(), kSignatureSize) == 0)
+        {
+            blob = std::move(binary);
+            return true;
+        }
+    }
+    std::cerr << "Compile cache: remote binary for " << key << " failed its signature check" << std::endl;
+    return false;
+}
+
+CompileCache::Lease CompileCache::lookup_locked(const std::string &key)
+{
+    auto it = entries_.find(key);
+    if (it == entries_.end())
+    {
+        return nullptr;
+    }
+
+    lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+
+    // Keep mtime in LRU order so it survives a restart
+    utimensat(AT_FDCWD, it->second.binary->path.c_str(), nullptr, 0);
+    return it->second.binary;
+}
+
+CompileCache::Lease CompileCache::insert_locked(const std::string &key, const std::string &path, size_t size)
+{
+    auto existing = entries_.find(key);
+    if (existing != entries_.end())
+    {
+        total_bytes_ -= existing->second.binary->size;
+        lru_.erase(existing->second.lru_position);
+        entries_.erase(existing);
+    }
+
+    lru_.push_front(key);
+    Entry entry{std::make_shared<CachedBinary>(CachedBinary{key, path, size}), lru_.begin()};
+    Lease lease = entry.binary;
+    entries_.emplace(key, std::move(entry));
+    total_bytes_ += size;
+
+    evict_locked();
+    return lease;
+}
+
+void CompileCache::evict_locked()
+{
+    auto it = lru_.end();
+    while (total_bytes_ > max_bytes_ && it != lru_.begin())
+    {
+        --it;
+        auto entry = entries_.find(*it);
+
+        // Still leased by a running judge
+        if (entry->second.binary.use_count() > 1)
+        {
+            continue;
+        }
+
+        std::remove(entry->second.binary->path.c_str());
+        total_bytes_ -= entry->second.binary->size;
+        entries_.erase(entry);
+        it = lru_.erase(it);
+    }
+}
+
+void CompileCache::load_existing()
+{
+    std::error_code ec;
+    fs::create_directories(directory_, ec);
+    if (ec)
+    {
+        std::cerr << "Compile cache: cannot create " << directory_ << ": " << ec.message() << std::endl;
+        return;
+    }
+    fs::permissions(directory_, fs::perms::owner_all | fs::perms::group_read | fs::perms::group_exec |
+                                    fs::perms::others_read | fs::perms::others_exec,
+                    ec);
+
+    struct Found
+    {
+        fs::file_time_type mtime;
+        std::string key;
+        size_t size;
+    };
+    std::vector<Found> found;
+
+    for (const auto &file : fs::directory_iterator(directory_, ec))
+    {
+        std::string name = file.path().filename().string();
+        if (!is_key(name))
+        {
+            // Leftover from a compile that was interrupted
+            fs::remove(file.path(), ec);
+            continue;
+        }
+        found.push_back({file.last_write_time(ec), name, static_cast<size_t>(file.file_size(ec))});
+    }
+
+    std::sort(found.begin(), found.end(), [](const Found &a, const Found &b)
+              { return a.mtime < b.mtime; });
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &f : found)
+    {
+        insert_locked(f.key, directory_ + "/" + f.key, f.size);
+    }
+}
@@ -0,0 +1,112 @@
+#ifndef COMPILE_CACHE_H
+#define COMPILE_CACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Content-addressed store of compiled executables on local disk, keyed by a
+// hash of source, compiler and flags. Least recently used binaries are
+// evicted once the directory grows past its size cap.
+class CompileCache
+{
+public:
+    // Optional shared tier (e.g. Redis) consulted on a local miss and filled
+    // after every successful compile. Implementations must be thread-safe.
+    // Blobs are signed by the cache, so the store itself need not be
+    // trusted: anyone who can write it but lacks the secret can't get a
+    // binary run.
+    class RemoteStore
+    {
+    public:
+        virtual ~RemoteStore() = default;
+        virtual bool fetch(const std::string &key, std::string &blob) = 0;
+        virtual void store(const std::string &key, const std::string &blob) = 0;
+    };
+
+    struct CachedBinary
+    {
+        std::string key;
+        std::string path;
+        size_t size;
+    };
+
+    // A binary is never evicted while a lease on it is alive.
+    using Lease = std::shared_ptr<const CachedBinary>;
+
+    // Counts since startup
+    struct Stats
+    {
+        uint64_t hits = 0;        // found on local disk
+        uint64_t remote_hits = 0; // fetched from the remote tier
+        uint64_t compiles = 0;    // built here, successfully or not
+    };
+
+    // Compiles into output_path and returns true on success, false if the
+    // source doesn't compile. Throws if it couldn't be compiled at all.
+    using CompileFn = std::function<bool(const std::string &output_path)>;
+
+    // Blobs in remote carry an HMAC-SHA256 under remote_secret over their
+    // key and binary; one that fails it is a miss. Throws
+    // std::invalid_argument if there is a remote but no secret.
+    CompileCache(const std::string &directory, size_t max_bytes, std::unique_ptr<RemoteStore> remote = nullptr,
+                 std::string remote_secret = "");
+
+    CompileCache(const CompileCache &) = delete;
+    CompileCache &operator=(const CompileCache &) = delete;
+
+    // The compiler binary's size and mtime are part of the key, so upgrading
+    // the toolchain invalidates old entries.
+    static std::string make_key(const std::string &source, const std::string &compiler,
+                                const std::vector<std::string> &flags);
+
+    // Returns the cached binary for key, fetching it from the remote tier or
+    // running compile on a miss. Concurrent misses on the same key compile
+    // once. Returns nullptr if compilation failed. If compile throws, so
+    // does this, and those waiting on it try again themselves.
+    Lease acquire(const std::string &key, const CompileFn &compile);
+
+    Stats stats() const;
+
+private:
+    struct Entry
+    {
+        std::shared_ptr<CachedBinary> binary;
+        std::list<std::string>::iterator lru_position;
+    };
+
+    Lease lookup_locked(const std::string &key);
+    Lease insert_locked(const std::string &key, const std::string &path, size_t size);
+    void evict_locked();
+    bool publish(const std::string &temp_path, const std::string &final_path);
+    std::string sign(const std::string &key, const std::string &binary) const;
+    bool unpack_remote(const std::string &key, std::string &blob) const;
+    void load_existing();
+
+    const std::string directory_;
+    const size_t max_bytes_;
+    std::unique_ptr<RemoteStore> remote_;
+    const std::string remote_secret_;
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_;
+    std::list<std::string> lru_; // most recently used first
+    size_t total_bytes_ = 0;
+    std::map<std::string, std::shared_future<bool>> in_flight_;
+    unsigned long temp_counter_ = 0;
+
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> remote_hits_{0};
+    std::atomic<uint64_t> compiles_{0};
+};
+
+#endif // COMPILE_CACHE_H
@@ -0,0 +1,314 @@
+#include "compile_server.h"
+#include "compile_cache.h"
+
+#include <pwd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    bool write_source(const std::string &path, const std::string &source)
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            return false;
+        }
+        out.write(source.data(), static_cast<std::streamsize>(source.size()));
+        out.close();
+        return out.good();
+    }
+
+    // The compiler runs as the sandbox user and owns what it wrote. A copy
+    // owned by us is what gets kept, so no later run can modify it.
+    bool take_output(const std::string &from, const std::string &to)
+    {
+        std::error_code ec;
+        fs::copy_file(from, to, fs::copy_options::overwrite_existing, ec);
+        return !ec;
+    }
+}
+
+CompileServer::CompileServer(Config config)
+    : config_(std::move(config)), pch_dir_(config_.work_dir + "/pch"), no_input_(InputFile::create(""))
+{
+    if (!config_.sandbox.user.empty())
+    {
+        struct passwd *pw = getpwnam(config_.sandbox.user.c_str());
+        if (pw)
+        {
+            run_uid_ = pw->pw_uid;
+            run_gid_ = pw->pw_gid;
+        }
+    }
+
+    // Leftovers of an earlier run were built by a compiler that may since
+    // have changed
+    std::error_code ec;
+    fs::remove_all(pch_dir_, ec);
+    fs::remove_all(config_.work_dir + "/jobs", ec);
+    fs::create_directories(pch_dir_, ec);
+    fs::create_directories(config_.work_dir + "/jobs", ec);
+    if (ec)
+    {
+        throw std::runtime_error("Cannot set up compile directory " + config_.work_dir + ": " + ec.message());
+    }
+
+    size_t slots = std::max<size_t>(config_.slots, 1);
+    for (size_t i = 0; i < slots; i++)
+    {
+        sandboxes_.push_back(std::make_unique<SecureSandbox>(config_.sandbox));
+        free_slots_.push_back(i);
+    }
+
+    warm_up_thread_ = std::thread([this]
+                                  { warm_up(); });
+}
+
+CompileServer::~CompileServer()
+{
+    warm_up_thread_.join();
+}
+
+std::string CompileServer::make_job_dir()
+{
+    std::string dir = config_.work_dir + "/jobs/" + std::to_string(next_job_++);
+    if (mkdir(dir.c_str(), 0700) != 0)
+    {
+        return "";
+    }
+    // Only the compiler may write here
+    if (run_uid_ != static_cast<uid_t>(-1) && chown(dir.c_str(), run_uid_, run_gid_) != 0)
+    {
+        rmdir(dir.c_str());
+        return "";
+    }
+    return dir;
+}
+
+CompileServer::Result CompileServer::run(const std::vector<std::string> &args, const std::string &dir)
+{
+    // Compiler temporaries go in the job directory and are removed with it
+    std::vector<std::string> env = config_.sandbox.environment;
+    env.push_back("TMPDIR=" + dir);
+
+    size_t slot;
+    {
+        std::unique_lock<std::mutex> lock(slots_mutex_);
+        slot_free_.wait(lock, [this]
+                        { return !free_slots_.empty(); });
+        slot = free_slots_.back();
+        free_slots_.pop_back();
+    }
+
+    SecureSandbox::SandboxResult sandbox_result = sandboxes_[slot]->execute(args, env, *no_input_);
+
+    {
+        std::lock_guard<std::mutex> lock(slots_mutex_);
+        free_slots_.push_back(slot);
+    }
+    slot_free_.notify_one();
+
+    Result result;
+    result.setup_failed = sandbox_result.setup_failed;
+    result.ok = !sandbox_result.setup_failed && sandbox_result.exit_code == 0 && !sandbox_result.signal_killed &&
+                !sandbox_result.timeout && !sandbox_result.memory_exceeded;
+    result.diagnostics = std::move(sandbox_result.error);
+    result.time = sandbox_result.setup_time + sandbox_result.wall_time;
+    return result;
+}
+
+SecureSandbox::SandboxConfig CompileServer::compile_sandbox(SecureSandbox::SandboxConfig sandbox,
+                                                            const std::string &work_dir)
+{
+    sandbox.read_only_paths = {work_dir};
+    sandbox.writable_paths = {work_dir + "/jobs"};
+    sandbox.time_limit_ms = 10000;
+    sandbox.wall_time_limit_ms = 30000;
+    sandbox.memory_limit_mb = 1024;
+    sandbox.output_limit_bytes = 1024 * 1024;
+    sandbox.process_limit = 32;
+    sandbox.prefork_count = 1;
+    sandbox.syscalls = SyscallProfile::Compiler;
+    return sandbox;
+}
+
+std::string CompileServer::cache_key(const LanguageProfile &language, const std::string &source)
+{
+    // The first step's compiler also stands in for its version; the name
+    // keeps languages that happen to share a command line apart
+    std::vector<std::string> flags{language.name};
+    for (const auto &step : language.compile_steps)
+    {
+        flags.insert(flags.end(), step.begin(), step.end());
+        flags.push_back("");
+    }
+    return CompileCache::make_key(source, language.compile_steps.at(0).at(0), flags);
+}
+
+CompileServer::Result CompileServer::compile(const LanguageProfile &language, const std::string &source,
+                                             const std::string &output_path)
+{
+    std::string dir = make_job_dir();
+    if (dir.empty())
+    {
+        return {false, true, "Cannot stage the source", {}};
+    }
+    std::error_code ec;
+    std::string source_path = dir + "/" + language.source_file;
+    if (!write_source(source_path, source))
+    {
+        fs::remove_all(dir, ec);
+        return {false, true, "Cannot stage the source", {}};
+    }
+
+    Placeholders values{{"{src}", source_path},
+                        {"{dir}", dir},
+                        {"{out}", dir + "/main"},
+                        {"{pch}", pch_ready_.load() ? "-I" + pch_dir_ : ""}};
+    Result result{true, false, "", {}};
+    for (const auto &step : language.compile_steps)
+    {
+        Result step_result = run(expand_command(step, values), dir);
+        result.time += step_result.time;
+        if (!step_result.ok)
+        {
+            result.ok = false;
+            result.setup_failed = step_result.setup_failed;
+            result.diagnostics = std::move(step_result.diagnostics);
+            break;
+        }
+    }
+    if (result.ok && !take_output(dir + "/main", output_path))
+    {
+        result.ok = false;
+        result.setup_failed = true;
+    }
+    fs::remove_all(dir, ec);
+    return result;
+}
+
+void CompileServer::warm_up()
+{
+    build_precompiled_headers();
+
+    // Pull every compiler, assembler, linker and header into the page
+    // cache so the first submission doesn't pay for reading them from disk
+    for (const auto &language : config_.languages)
+    {
+        if (!language->prepare_steps.empty())
+        {
+            prepare_runtime(*language);
+        }
+        else if (!language->warm_up_source.empty())
+        {
+            std::string warm_output = config_.work_dir + "/jobs/warm";
+            compile(*language, language->warm_up_source, warm_output);
+            std::remove(warm_output.c_str());
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(warm_mutex_);
+        warm_ = true;
+    }
+    warm_cv_.notify_all();
+}
+
+void CompileServer::wait_until_warm()
+{
+    std::unique_lock<std::mutex> lock(warm_mutex_);
+    warm_cv_.wait(lock, [this]
+                  { return warm_; });
+}
+
+void CompileServer::build_precompiled_headers()
+{
+    auto started = std::chrono::steady_clock::now();
+    size_t built = 0;
+    for (const auto &header : config_.precompiled_headers)
+    {
+        std::string dir = make_job_dir();
+        std::error_code ec;
+        if (dir.empty() || !write_source(dir + "/pch.h", "#include <" + header + ">\n"))
+        {
+            fs::remove_all(dir, ec);
+            continue;
+        }
+
+        // Built with exactly the flags submissions are compiled with, or
+        // g++ would refuse to use it
+        std::vector<std::string> args{config_.compiler};
+        args.insert(args.end(), config_.flags.begin(), config_.flags.end());
+        args.insert(args.end(), {"-x", "c++-header", dir + "/pch.h", "-o", dir + "/pch.h.gch"});
+        Result result = run(args, dir);
+
+        // Published in one rename, so no compile ever sees half of it
+        std::string target = pch_dir_ + "/" + header + ".gch";
+        fs::create_directories(fs::path(target).parent_path(), ec);
+        if (result.ok && take_output(dir + "/pch.h.gch", target + ".tmp") &&
+            std::rename((target + ".tmp").c_str(), target.c_str()) == 0)
+        {
+            built++;
+        }
+        else
+        {
+            std::cerr << "Compile server: could not precompile <" << header << ">: "
+                      << result.diagnostics.substr(0, 512) << std::endl;
+        }
+        fs::remove_all(dir, ec);
+    }
+
+    if (built > 0)
+    {
+        pch_ready_ = true;
+        std::cout << "Compile server: precompiled " << built << " headers in "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started)
+                         .count()
+                  << " ms" << std::endl;
+    }
+}
+
+void CompileServer::prepare_runtime(const LanguageProfile &language)
+{
+    auto started = std::chrono::steady_clock::now();
+    std::string dir = make_job_dir();
+    if (dir.empty())
+    {
+        return;
+    }
+
+    Result result = compile(language, language.warm_up_source, dir + "/warm");
+    Placeholders values{{"{bin}", dir + "/warm"}, {"{dir}", dir}, {"{out}", dir + "/prepared"}};
+    for (size_t i = 0; result.ok && i < language.prepare_steps.size(); i++)
+    {
+        result = run(expand_command(language.prepare_steps[i], values), dir);
+    }
+
+    // Published in one rename, like the precompiled headers
+    std::error_code ec;
+    const std::string &target = language.prepared_path;
+    fs::create_directories(fs::path(target).parent_path(), ec);
+    if (result.ok && take_output(dir + "/prepared", target + ".tmp") &&
+        std::rename((target + ".tmp").c_str(), target.c_str()) == 0)
+    {
+        std::cout << "Compile server: prepared the " << language.name << " runtime in "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started)
+                         .count()
+                  << " ms" << std::endl;
+    }
+    else
+    {
+        std::cerr << "Compile server: could not prepare the " << language.name
+                  << " runtime: " << result.diagnostics.substr(0, 512) << std::endl;
+    }
+    fs::remove_all(dir, ec);
+}
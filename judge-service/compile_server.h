@@ -0,0 +1,110 @@
+#ifndef COMPILE_SERVER_H
+#define COMPILE_SERVER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "sandbox.h"
+
+// Compiles submissions in a fixed set of long-lived compile sandboxes, so a
+// compile neither builds a sandbox of its own nor waits for process
+// isolation to be set up, and at most `slots` compilers run at once.
+//
+// Commonly included headers are precompiled once at startup. They are found
+// on an extra include path as <header>.gch, which g++ only uses when the
+// header is the first thing a source includes with matching flags and
+// macros; anything else compiles exactly as it would without them. After
+// that every language's warm-up source is compiled and its runtime
+// prepared, e.g. the JVM's class data archive.
+class CompileServer
+{
+public:
+    struct Config
+    {
+        std::string compiler = "/usr/bin/g++";
+        std::vector<std::string> flags{"-std=c++17", "-O2"};
+        // Holds sources, outputs and the precompiled headers
+        std::string work_dir = "/tmp/codejudge-compile";
+        std::vector<std::string> precompiled_headers{"bits/stdc++.h"};
+        size_t slots = 2;
+        SecureSandbox::SandboxConfig sandbox;
+        // Warmed up and prepared at startup
+        std::vector<std::shared_ptr<const LanguageProfile>> languages;
+    };
+
+    struct Result
+    {
+        bool ok = false;
+        // The compiler never ran or its output couldn't be kept, e.g. the
+        // sandbox had no zygote or cgroup slot. Says nothing about the
+        // source.
+        bool setup_failed = false;
+        std::string diagnostics; // head of the compiler's stderr
+        std::chrono::microseconds time{0};
+    };
+
+    // Starts building the precompiled headers in the background; compiles
+    // use them once they are ready. Throws std::runtime_error if the work
+    // directory can't be set up.
+    explicit CompileServer(Config config);
+    ~CompileServer();
+
+    CompileServer(const CompileServer &) = delete;
+    CompileServer &operator=(const CompileServer &) = delete;
+
+    // The sandbox for compiles in work_dir, made from sandbox, the one
+    // tests run in. A compiler needs far more room than a submission and
+    // runs several processes, javac many threads.
+    static SecureSandbox::SandboxConfig compile_sandbox(SecureSandbox::SandboxConfig sandbox,
+                                                        const std::string &work_dir);
+
+    // Compile cache key of source built as language; covers the compilers
+    // and every flag
+    static std::string cache_key(const LanguageProfile &language, const std::string &source);
+
+    // Builds source into the artifact language runs at output_path.
+    // Thread-safe; blocks while every slot is busy.
+    Result compile(const LanguageProfile &language, const std::string &source, const std::string &output_path);
+
+    // Blocks until the precompiled headers are built and every runtime is
+    // prepared, for callers that time compiles
+    void wait_until_warm();
+
+private:
+    // Runs the compiler with args on the next free slot, keeping its
+    // temporary files in the job directory dir
+    Result run(const std::vector<std::string> &args, const std::string &dir);
+    void warm_up();
+    void build_precompiled_headers();
+    void prepare_runtime(const LanguageProfile &language);
+    std::string make_job_dir();
+
+    const Config config_;
+    const std::string pch_dir_;
+    uid_t run_uid_ = static_cast<uid_t>(-1);
+    gid_t run_gid_ = static_cast<gid_t>(-1);
+
+    std::vector<std::unique_ptr<SecureSandbox>> sandboxes_;
+    std::mutex slots_mutex_;
+    std::condition_variable slot_free_;
+    std::vector<size_t> free_slots_;
+
+    std::shared_ptr<const InputFile> no_input_;
+    std::atomic<bool> pch_ready_{false};
+    std::mutex warm_mutex_;
+    std::condition_variable warm_cv_;
+    bool warm_ = false;
+    std::atomic<unsigned long> next_job_{0};
+    std::thread warm_up_thread_;
+};
+
+#endif // COMPILE_SERVER_H
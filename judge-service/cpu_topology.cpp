@@ -0,0 +1,140 @@
+#include "cpu_topology.h"
+
+#include <sched.h>
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    // A sysfs list such as "0-3,8,10-11"
+    std::vector<int> parse_cpu_list(const std::string &list)
+    {
+        std::vector<int> cpus;
+        std::istringstream ranges(list);
+        std::string range;
+        while (std::getline(ranges, range, ','))
+        {
+            size_t dash = range.find('-');
+            try
+            {
+                int first = std::stoi(range.substr(0, dash));
+                int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                for (int cpu = first; cpu <= last; cpu++)
+                    cpus.push_back(cpu);
+            }
+            catch (const std::exception &)
+            {
+            }
+        }
+        return cpus;
+    }
+
+    std::string read_line(const std::string &path)
+    {
+        std::ifstream file(path);
+        std::string line;
+        std::getline(file, line);
+        return line;
+    }
+
+    // Hardware threads sharing cpu's core, cpu itself if not known
+    std::vector<int> core_siblings(int cpu)
+    {
+        std::string topology = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        std::vector<int> siblings = parse_cpu_list(read_line(topology + "core_cpus_list"));
+        if (siblings.empty())
+            siblings = parse_cpu_list(read_line(topology + "thread_siblings_list"));
+        if (siblings.empty())
+            siblings = {cpu};
+        return siblings;
+    }
+
+    // The cpuN directory links to its node as nodeM
+    int cpu_node(int cpu)
+    {
+        std::error_code ec;
+        for (const auto &entry : fs::directory_iterator("/sys/devices/system/cpu/cpu" + std::to_string(cpu), ec))
+        {
+            std::string name = entry.path().filename().string();
+            if (name.size() > 4 && name.compare(0, 4, "node") == 0 &&
+                std::all_of(name.begin() + 4, name.end(), ::isdigit))
+            {
+                return std::stoi(name.substr(4));
+            }
+        }
+        return -1;
+    }
+}
+
+std::vector<CpuCore> allowed_cores()
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    {
+        return {};
+    }
+
+    // Keyed by the core's first hardware thread. Siblings outside our
+    // affinity mask are not ours to use.
+    std::map<int, CpuCore> cores;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        std::vector<int> siblings = core_siblings(cpu);
+        int first = *std::min_element(siblings.begin(), siblings.end());
+        CpuCore &core = cores[first];
+        if (core.cpus.empty())
+            core.node = cpu_node(cpu);
+        core.cpus.push_back(cpu);
+    }
+
+    std::vector<CpuCore> result;
+    for (auto &entry : cores)
+        result.push_back(std::move(entry.second));
+    std::stable_sort(result.begin(), result.end(), [](const CpuCore &a, const CpuCore &b)
+                     { return a.node < b.node; });
+    return result;
+}
+
+bool pin_current_thread(const std::vector<CpuCore> &cores)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const auto &core : cores)
+    {
+        for (int cpu : core.cpus)
+            CPU_SET(cpu, &set);
+    }
+    return CPU_COUNT(&set) > 0 && sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+std::string cpu_list(const std::vector<CpuCore> &cores)
+{
+    std::vector<int> cpus;
+    for (const auto &core : cores)
+        cpus.insert(cpus.end(), core.cpus.begin(), core.cpus.end());
+    std::sort(cpus.begin(), cpus.end());
+
+    std::string list;
+    for (size_t i = 0; i < cpus.size();)
+    {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+            j++;
+        if (!list.empty())
+            list += ",";
+        list += std::to_string(cpus[i]);
+        if (j > i)
+            list += "-" + std::to_string(cpus[j]);
+        i = j + 1;
+    }
+    return list;
+}
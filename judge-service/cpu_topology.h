@@ -0,0 +1,27 @@
+#ifndef CPU_TOPOLOGY_H
+#define CPU_TOPOLOGY_H
+
+#include <string>
+#include <vector>
+
+// One physical core: its hardware threads and the NUMA node they sit on
+struct CpuCore
+{
+    std::vector<int> cpus;
+    int node = -1; // -1 if the kernel doesn't say
+};
+
+// The physical cores this process may run on, ordered by node. The
+// hardware threads of a core stay together, so a core handed to one run
+// shares nothing with another through SMT. Empty if sysfs can't be read.
+std::vector<CpuCore> allowed_cores();
+
+// Restricts the calling thread, and every thread and process it starts
+// from then on, to the hardware threads of cores. Returns false if the
+// kernel refuses.
+bool pin_current_thread(const std::vector<CpuCore> &cores);
+
+// The cores' hardware threads as a list like "0-3,8", for logs
+std::string cpu_list(const std::vector<CpuCore> &cores);
+
+#endif // CPU_TOPOLOGY_H
@@ -0,0 +1,56 @@
+#include "input_file.h"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+std::shared_ptr<const InputFile> InputFile::create(std::string_view data)
+{
+    int fd = memfd_create("testcase_input", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1)
+    {
+        throw std::runtime_error(std::string("memfd_create failed: ") + strerror(errno));
+    }
+
+    size_t written = 0;
+    while (written < data.size())
+    {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            int saved = errno;
+            close(fd);
+            throw std::runtime_error(std::string("Failed to write test input: ") + strerror(saved));
+        }
+        written += static_cast<size_t>(n);
+    }
+
+    // Sealed so no run can ever alter the input seen by another
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+    {
+        int saved = errno;
+        close(fd);
+        throw std::runtime_error(std::string("Failed to seal test input: ") + strerror(saved));
+    }
+
+    return std::shared_ptr<const InputFile>(new InputFile(fd, data.size()));
+}
+
+InputFile::~InputFile()
+{
+    close(fd_);
+}
+
+int InputFile::open_reader() const
+{
+    // dup() would share the offset; reopening through /proc gives a fresh
+    // open file description on the same memfd
+    std::string path = "/proc/self/fd/" + std::to_string(fd_);
+    return open(path.c_str(), O_RDONLY | O_CLOEXEC);
+}
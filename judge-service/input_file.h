@@ -0,0 +1,36 @@
+#ifndef INPUT_FILE_H
+#define INPUT_FILE_H
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+
+// A test input held in a sealed memfd. The contents live once in the page
+// cache and are handed to sandboxed programs directly as stdin, so there is
+// no pipe to feed and any number of parallel runs can share one copy.
+class InputFile
+{
+public:
+    // Throws std::runtime_error if the memfd cannot be created or sealed.
+    static std::shared_ptr<const InputFile> create(std::string_view data);
+
+    ~InputFile();
+
+    InputFile(const InputFile &) = delete;
+    InputFile &operator=(const InputFile &) = delete;
+
+    size_t size() const { return size_; }
+
+    // Opens a new read-only descriptor with its own file offset, so parallel
+    // readers don't move each other's position. The caller owns the result;
+    // returns -1 on failure.
+    int open_reader() const;
+
+private:
+    InputFile(int fd, size_t size) : fd_(fd), size_(size) {}
+
+    int fd_;
+    size_t size_;
+};
+
+#endif // INPUT_FILE_H
@@ -0,0 +1,451 @@
+// Benchmark for the judging pipeline that needs no Postgres or Redis.
+// Compiles and runs a corpus of synthetic submissions through the same
+// CompileServer, CompileCache, RunPool, SecureSandbox and checkers as the
+// service, and reports per-stage latency percentiles and throughput at each
+// worker count. Compiles are timed once the precompiled headers are built.
+//
+//   judge-bench [--workers 1,2,4] [--submissions 40] [--tests 5]
+//               [--programs hello,sum,spin,memhog,output,forkbomb]
+//               [--run-slots N] [--compile-slots N] [--prefork N]
+//               [--time-limit-ms 1000] [--memory-limit-mb 256]
+//               [--reuse-binaries] [--no-cgroups]
+//
+// Needs the same privileges as the judge (root, or the capabilities the
+// sandbox uses).
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "cgroup_pool.h"
+#include "checker.h"
+#include "compile_cache.h"
+#include "compile_server.h"
+#include "input_file.h"
+#include "language.h"
+#include "run_pool.h"
+#include "sandbox.h"
+#include "test_case_cache.h"
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Program
+    {
+        std::string name;
+        std::string source;
+        std::string input;
+        std::string expected_output;
+        bool drain = false; // accept any output, so only the output limit stops it
+    };
+
+    // Swallows output, for programs that exist to hit the output limit
+    class DrainChecker : public Checker
+    {
+        class Session : public CheckSession
+        {
+        public:
+            bool feed(const char *, size_t) override { return true; }
+            CheckResult finish() override { return CheckResult::Accepted; }
+        };
+
+    public:
+        std::unique_ptr<CheckSession> start(const TestCase &) const override { return std::make_unique<Session>(); }
+    };
+
+    // One of each way a submission typically ends
+    std::vector<Program> corpus()
+    {
+        return {
+            {"hello",
+             "#include <cstdio>\n"
+             "int main() { std::puts(\"Hello, World!\"); }\n",
+             "", "Hello, World!\n"},
+            {"sum",
+             "#include <iostream>\n"
+             "int main() { long a, s = 0; while (std::cin >> a) s += a; std::cout << s << '\\n'; }\n",
+             "1 2 3 4 5 6 7 8 9 10\n", "55\n"},
+            {"spin",
+             "int main() { volatile unsigned long x = 0; for (;;) x++; }\n",
+             "", ""},
+            {"memhog",
+             "#include <cstdlib>\n"
+             "#include <cstring>\n"
+             "int main() { for (;;) { char *p = (char *)std::malloc(16 << 20); if (!p) return 1; "
+             "std::memset(p, 1, 16 << 20); } }\n",
+             "", ""},
+            {"output",
+             "#include <cstdio>\n"
+             "#include <cstring>\n"
+             "int main() { static char line[4096]; std::memset(line, 'x', sizeof(line) - 1); "
+             "for (;;) std::puts(line); }\n",
+             "", "", true},
+            {"forkbomb",
+             "#include <unistd.h>\n"
+             "int main() { for (;;) fork(); }\n",
+             "", ""},
+        };
+    }
+
+    struct Options
+    {
+        std::vector<size_t> workers{1, 2, 4};
+        size_t submissions = 40;
+        size_t tests = 5;
+        std::vector<std::string> programs;
+        size_t run_slots = std::max(1u, std::thread::hardware_concurrency());
+        size_t compile_slots = std::min<size_t>(4, std::max(1u, std::thread::hardware_concurrency()));
+        size_t prefork = 2;
+        long time_limit_ms = 1000;
+        size_t memory_limit_mb = 256;
+        bool reuse_binaries = false;
+        bool cgroups = true;
+    };
+
+    std::vector<std::string> split(const std::string &list)
+    {
+        std::vector<std::string> parts;
+        std::istringstream in(list);
+        std::string part;
+        while (std::getline(in, part, ','))
+        {
+            if (!part.empty())
+                parts.push_back(part);
+        }
+        return parts;
+    }
+
+    Options parse_options(int argc, char **argv)
+    {
+        Options options;
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            auto value = [&]() -> std::string
+            {
+                if (i + 1 >= argc)
+                    throw std::runtime_error(arg + " needs a value");
+                return argv[++i];
+            };
+
+            if (arg == "--workers")
+            {
+                options.workers.clear();
+                for (const auto &count : split(value()))
+                    options.workers.push_back(std::max<size_t>(std::stoul(count), 1));
+            }
+            else if (arg == "--submissions")
+                options.submissions = std::stoul(value());
+            else if (arg == "--tests")
+                options.tests = std::max<size_t>(std::stoul(value()), 1);
+            else if (arg == "--programs")
+                options.programs = split(value());
+            else if (arg == "--run-slots")
+                options.run_slots = std::max<size_t>(std::stoul(value()), 1);
+            else if (arg == "--compile-slots")
+                options.compile_slots = std::max<size_t>(std::stoul(value()), 1);
+            else if (arg == "--prefork")
+                options.prefork = std::stoul(value());
+            else if (arg == "--time-limit-ms")
+                options.time_limit_ms = std::stol(value());
+            else if (arg == "--memory-limit-mb")
+                options.memory_limit_mb = std::stoul(value());
+            else if (arg == "--reuse-binaries")
+                options.reuse_binaries = true;
+            else if (arg == "--no-cgroups")
+                options.cgroups = false;
+            else
+                throw std::runtime_error("Unknown option " + arg);
+        }
+        return options;
+    }
+
+    // Same order of precedence as the service
+    std::string verdict_of(const SecureSandbox::SandboxResult &result, CheckSession &check)
+    {
+        if (result.setup_failed)
+            return "Judge Error";
+        if (result.output_rejected)
+            return "Wrong Answer";
+        if (result.timeout)
+            return "Time Limit Exceeded";
+        if (result.memory_exceeded)
+            return "Memory Limit Exceeded";
+        if (result.output_limit_exceeded)
+            return "Output Limit Exceeded";
+        if (result.signal_killed || result.exit_code != 0)
+            return "Runtime Error";
+        switch (check.finish())
+        {
+        case CheckResult::Accepted:
+            return "Accepted";
+        case CheckResult::WrongAnswer:
+            return "Wrong Answer";
+        default:
+            return "Judge Error";
+        }
+    }
+
+    // Latencies in microseconds, per stage
+    struct Samples
+    {
+        std::map<std::string, std::vector<double>> stages;
+        std::map<std::string, size_t> verdicts;
+
+        void add(const std::string &stage, std::chrono::microseconds value)
+        {
+            stages[stage].push_back(static_cast<double>(value.count()));
+        }
+
+        void merge(const Samples &other)
+        {
+            for (const auto &[stage, values] : other.stages)
+                stages[stage].insert(stages[stage].end(), values.begin(), values.end());
+            for (const auto &[verdict, count] : other.verdicts)
+                verdicts[verdict] += count;
+        }
+    };
+
+    double percentile(std::vector<double> &sorted, double p)
+    {
+        if (sorted.empty())
+            return 0;
+        size_t rank = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+        return sorted[std::min(rank, sorted.size() - 1)];
+    }
+
+    std::string format_us(double us)
+    {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(us < 10000 ? 0 : 1);
+        if (us < 10000)
+            out << us << "us";
+        else
+            out << us / 1000 << "ms";
+        return out.str();
+    }
+
+    void report(size_t workers, size_t submissions, std::chrono::duration<double> elapsed, Samples &samples)
+    {
+        std::cout << "\n== " << workers << " worker" << (workers == 1 ? "" : "s") << ": " << submissions
+                  << " submissions in " << std::fixed << std::setprecision(2) << elapsed.count() << "s, "
+                  << submissions / elapsed.count() << " submissions/s\n";
+        std::cout << std::left << std::setw(16) << "stage" << std::right << std::setw(8) << "count"
+                  << std::setw(11) << "p50" << std::setw(11) << "p90" << std::setw(11) << "p99" << std::setw(11)
+                  << "max" << "\n";
+        for (const char *stage : {"compile", "sandbox_setup", "run", "check", "submission"})
+        {
+            auto it = samples.stages.find(stage);
+            if (it == samples.stages.end())
+                continue;
+            std::vector<double> &values = it->second;
+            std::sort(values.begin(), values.end());
+            std::cout << std::left << std::setw(16) << stage << std::right << std::setw(8) << values.size()
+                      << std::setw(11) << format_us(percentile(values, 0.5)) << std::setw(11)
+                      << format_us(percentile(values, 0.9)) << std::setw(11) << format_us(percentile(values, 0.99))
+                      << std::setw(11) << format_us(values.back()) << "\n";
+        }
+        std::cout << "verdicts:";
+        for (const auto &[verdict, count] : samples.verdicts)
+            std::cout << " " << verdict << "=" << count;
+        std::cout << std::endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    try
+    {
+        Options options = parse_options(argc, argv);
+        std::signal(SIGPIPE, SIG_IGN);
+
+        std::vector<Program> programs;
+        for (auto &program : corpus())
+        {
+            if (options.programs.empty() ||
+                std::find(options.programs.begin(), options.programs.end(), program.name) != options.programs.end())
+                programs.push_back(std::move(program));
+        }
+        if (programs.empty())
+        {
+            throw std::runtime_error("No programs selected");
+        }
+
+        SecureSandbox::SandboxConfig config;
+        config.memory_limit_mb = options.memory_limit_mb;
+        config.time_limit_ms = options.time_limit_ms;
+        config.user = "nobody";
+        config.prefork_count = options.prefork;
+        if (options.cgroups)
+        {
+            try
+            {
+                config.cgroups = CgroupPool::create("", options.run_slots * (options.prefork + 1) +
+                                                            options.compile_slots * 2);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "cgroup v2 unavailable, limiting memory with RLIMIT_AS: " << e.what() << std::endl;
+            }
+        }
+
+        std::vector<std::unique_ptr<SecureSandbox>> sandboxes;
+        for (size_t i = 0; i < options.run_slots; i++)
+            sandboxes.push_back(std::make_unique<SecureSandbox>(config));
+        RunPool run_pool(options.run_slots);
+
+        std::string bench_dir = std::filesystem::temp_directory_path() /
+                                ("judge-bench-" + std::to_string(getpid()));
+        std::filesystem::create_directories(bench_dir);
+        auto compile_cache = std::make_unique<CompileCache>(bench_dir + "/binaries", size_t(1) << 30);
+
+        // Compile sandboxes set up as the service sets them up
+        CompileServer::Config compile_config;
+        compile_config.work_dir = bench_dir + "/compile";
+        compile_config.slots = options.compile_slots;
+        std::shared_ptr<const LanguageProfile> cpp;
+        for (auto &language : builtin_languages(compile_config.compiler, compile_config.flags,
+                                                compile_config.precompiled_headers, compile_config.work_dir + "/runtime"))
+        {
+            if (language->name == "cpp")
+                cpp = language;
+        }
+        compile_config.languages = {cpp};
+        compile_config.sandbox = CompileServer::compile_sandbox(config, compile_config.work_dir);
+        auto compile_server = std::make_unique<CompileServer>(compile_config);
+        std::shared_ptr<const Checker> exact = make_builtin_checker("exact");
+        std::shared_ptr<const Checker> drain = std::make_shared<DrainChecker>();
+
+        // Every submission of a program shares one test set, as a hot
+        // problem's submissions share a cached one
+        std::vector<TestSet> test_sets;
+        for (const auto &program : programs)
+        {
+            std::shared_ptr<const InputFile> input = InputFile::create(program.input);
+            TestSet tests;
+            // Expected outputs are views of the programs, which outlive the sets
+            for (size_t i = 0; i < options.tests; i++)
+                tests.push_back({static_cast<int>(i), input, program.expected_output, nullptr});
+            test_sets.push_back(std::move(tests));
+        }
+
+        compile_server->wait_until_warm();
+
+        std::cout << "Corpus:";
+        for (const auto &program : programs)
+            std::cout << " " << program.name;
+        std::cout << "; " << options.tests << " tests each, " << options.run_slots << " run slots, prefork "
+                  << options.prefork << ", " << options.compile_slots << " compile slots, "
+                  << (config.cgroups ? "cgroups" : "no cgroups") << ", "
+                  << (options.reuse_binaries ? "binaries reused" : "every submission compiled") << std::endl;
+
+        unsigned long round = 0;
+        for (size_t workers : options.workers)
+        {
+            round++;
+            std::atomic<size_t> next{0};
+            std::vector<Samples> per_worker(workers);
+            auto started = Clock::now();
+
+            std::vector<std::thread> threads;
+            for (size_t w = 0; w < workers; w++)
+            {
+                threads.emplace_back([&, w]
+                                     {
+                    Samples &samples = per_worker[w];
+                    for (size_t n = next++; n < options.submissions; n = next++)
+                    {
+                        const Program &program = programs[n % programs.size()];
+                        const TestSet &tests = test_sets[n % programs.size()];
+                        const Checker &checker = program.drain ? *drain : *exact;
+                        auto submission_started = Clock::now();
+
+                        // A unique comment makes each a distinct cache key
+                        std::string source = program.source;
+                        if (!options.reuse_binaries)
+                            source += "// " + std::to_string(round) + "." + std::to_string(n) + "\n";
+                        auto compile_started = Clock::now();
+                        bool compile_ran = true;
+                        CompileCache::Lease binary = compile_cache->acquire(
+                            CompileServer::cache_key(*cpp, source), [&](const std::string &output_path)
+                            {
+                                CompileServer::Result result = compile_server->compile(*cpp, source, output_path);
+                                compile_ran = !result.setup_failed;
+                                return result.ok;
+                            });
+                        samples.add("compile", std::chrono::duration_cast<std::chrono::microseconds>(
+                                                   Clock::now() - compile_started));
+                        if (!binary)
+                        {
+                            samples.verdicts[compile_ran ? "Compilation Error" : "Judge Error"]++;
+                            continue;
+                        }
+
+                        std::vector<std::string> verdicts(tests.size());
+                        std::vector<SecureSandbox::SandboxResult> results(tests.size());
+                        std::vector<std::chrono::microseconds> check_times(tests.size());
+                        size_t failed = run_pool.run_until_failure(
+                            tests.size(), [&](size_t index, size_t slot, CancellationToken &cancel)
+                            {
+                                std::unique_ptr<CheckSession> check = checker.start(tests[index]);
+                                results[index] = sandboxes[slot]->execute(binary->path, *tests[index].input, &cancel,
+                                                                          [&](const char *data, size_t size)
+                                                                          { return check->feed(data, size); });
+                                auto check_started = Clock::now();
+                                verdicts[index] = verdict_of(results[index], *check);
+                                check_times[index] = std::chrono::duration_cast<std::chrono::microseconds>(
+                                    Clock::now() - check_started);
+                                return verdicts[index] == "Accepted";
+                            });
+
+                        for (size_t i = 0; i < tests.size(); i++)
+                        {
+                            if (verdicts[i].empty() || results[i].cancelled)
+                                continue;
+                            samples.add("sandbox_setup", results[i].setup_time);
+                            samples.add("run", results[i].wall_time);
+                            samples.add("check", check_times[i]);
+                        }
+                        samples.verdicts[failed < verdicts.size() ? verdicts[failed] : "Accepted"]++;
+                        samples.add("submission", std::chrono::duration_cast<std::chrono::microseconds>(
+                                                      Clock::now() - submission_started));
+                    } });
+            }
+            for (auto &thread : threads)
+                thread.join();
+
+            std::chrono::duration<double> elapsed = Clock::now() - started;
+            Samples samples;
+            for (const auto &worker : per_worker)
+                samples.merge(worker);
+            report(workers, options.submissions, elapsed, samples);
+        }
+
+        compile_server.reset();
+        compile_cache.reset();
+        std::filesystem::remove_all(bench_dir);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "judge-bench: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,885 @@
+// Behaviour checks for the parts of judge-core that need no sandbox
+// privileges, database or Redis: comparators and built-in checkers, the run
+// pool, the scheduler, test history, the test case and compile caches, and
+// test packs. Prints each test as it passes and exits non-zero if any check
+// failed.
+//
+//   judge-core-tests
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "checker.h"
+#include "comparator.h"
+#include "compile_cache.h"
+#include "input_file.h"
+#include "run_pool.h"
+#include "scheduler.h"
+#include "test_case_cache.h"
+#include "test_history.h"
+#include "test_pack_store.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    // Checks also fail on run slot threads
+    std::atomic<int> failed_checks{0};
+
+    void expect(bool condition, const char *text, int line)
+    {
+        if (!condition)
+        {
+            std::cerr << "  line " << line << ": expected " << text << std::endl;
+            failed_checks++;
+        }
+    }
+
+#define EXPECT(condition) expect((condition), #condition, __LINE__)
+
+    // A fresh directory under the system's temp dir, removed with the object
+    class TempDir
+    {
+    public:
+        TempDir()
+        {
+            std::string pattern = (fs::temp_directory_path() / "judge-core-tests-XXXXXX").string();
+            if (!mkdtemp(pattern.data()))
+            {
+                throw std::runtime_error("cannot create a temp directory");
+            }
+            path_ = pattern;
+        }
+
+        ~TempDir()
+        {
+            std::error_code ec;
+            fs::remove_all(path_, ec);
+        }
+
+        const std::string &path() const { return path_; }
+
+    private:
+        std::string path_;
+    };
+
+    std::string read_all(const InputFile &input)
+    {
+        int fd = input.open_reader();
+        std::string contents;
+        char buffer[4096];
+        ssize_t n;
+        while (fd != -1 && (n = read(fd, buffer, sizeof(buffer))) > 0)
+        {
+            contents.append(buffer, static_cast<size_t>(n));
+        }
+        if (fd != -1)
+            close(fd);
+        return contents;
+    }
+
+    // Expected outputs live in the set's arena, as they do when loaded from
+    // the database
+    TestSet make_set(const std::vector<std::pair<std::string, std::string>> &cases, int first_id = 1)
+    {
+        TestSet tests;
+        OutputArena arena;
+        for (size_t i = 0; i < cases.size(); i++)
+        {
+            TestCase test_case{first_id + static_cast<int>(i), InputFile::create(cases[i].first), {}, nullptr};
+            arena.add(test_case, cases[i].second.data(), cases[i].second.size());
+            tests.push_back(std::move(test_case));
+        }
+        return tests;
+    }
+
+    // Feeds output a byte at a time, the worst split a pipe could make
+    CheckResult check(const Checker &checker, const std::string &output, const std::string &expected)
+    {
+        TestCase test_case{1, nullptr, expected, nullptr};
+        std::unique_ptr<CheckSession> session = checker.start(test_case);
+        for (char c : output)
+        {
+            if (!session->feed(&c, 1))
+            {
+                return CheckResult::WrongAnswer;
+            }
+        }
+        return session->finish();
+    }
+
+    bool accepts(const std::string &spec, const std::string &output, const std::string &expected)
+    {
+        return check(*make_builtin_checker(spec), output, expected) == CheckResult::Accepted;
+    }
+
+    void test_comparator_modes()
+    {
+        EXPECT(parse_compare_mode("exact") == CompareMode::Exact);
+        EXPECT(parse_compare_mode("lines") == CompareMode::Lines);
+        EXPECT(parse_compare_mode("tokens") == CompareMode::Tokens);
+        EXPECT(parse_compare_mode("bogus") == CompareMode::Exact);
+
+        // Exact forgives only trailing whitespace at the very end
+        EXPECT(outputs_match("1 2\n", "1 2", CompareMode::Exact));
+        EXPECT(outputs_match("1 2", "1 2\n\n", CompareMode::Exact));
+        EXPECT(!outputs_match("1  2", "1 2", CompareMode::Exact));
+        EXPECT(!outputs_match("1 2 \n3", "1 2\n3", CompareMode::Exact));
+        EXPECT(!outputs_match("1 2", "1 2 3", CompareMode::Exact));
+
+        // Lines forgives trailing whitespace per line and trailing blank lines
+        EXPECT(outputs_match("a  \nb\t\n\n\n", "a\nb", CompareMode::Lines));
+        EXPECT(outputs_match("a\nb", "a\nb\n\n", CompareMode::Lines));
+        EXPECT(!outputs_match("a b", "a\nb", CompareMode::Lines));
+        EXPECT(!outputs_match("a\n\nb", "a\nb", CompareMode::Lines));
+        EXPECT(!outputs_match(" a", "a", CompareMode::Lines));
+
+        // Tokens ignores the amount and kind of whitespace
+        EXPECT(outputs_match("1\n2   3\n", "1 2 3", CompareMode::Tokens));
+        EXPECT(outputs_match("  1 2", "1\t2\n", CompareMode::Tokens));
+        EXPECT(!outputs_match("1 2", "1 2 3", CompareMode::Tokens));
+        EXPECT(!outputs_match("12 3", "1 2 3", CompareMode::Tokens));
+        EXPECT(!outputs_match("1 2 3 4", "1 2 3", CompareMode::Tokens));
+
+        // Streaming gives up at the first byte that can't match
+        StreamingComparator comparator("abc", CompareMode::Exact);
+        EXPECT(comparator.feed("ab", 2));
+        EXPECT(!comparator.feed("d", 1));
+        EXPECT(comparator.mismatched());
+    }
+
+    void test_builtin_checker_specs()
+    {
+        for (const char *spec : {"exact", "lines", "tokens", "nocase", "unordered", "float", "float:1e-3", "float:0"})
+        {
+            EXPECT(make_builtin_checker(spec) != nullptr);
+        }
+        for (const char *spec : {"", "bogus", "Exact", "float:", "float:abc", "float:1e-3x", "float:-1", "float:nan",
+                                 "float 1e-3", "unordered:1"})
+        {
+            EXPECT(make_builtin_checker(spec) == nullptr);
+        }
+
+        EXPECT(accepts("exact", "42\n", "42"));
+        EXPECT(!accepts("exact", "42 ", "4 2"));
+        EXPECT(accepts("tokens", "1\n2", "1 2"));
+
+        EXPECT(accepts("nocase", "YES\n", "yes"));
+        EXPECT(accepts("nocase", "Hello   World", "hello world"));
+        EXPECT(!accepts("nocase", "yes no", "yes"));
+
+        // The default tolerance is 1e-6, absolute or relative
+        EXPECT(accepts("float", "0.3333333", "0.333333333"));
+        EXPECT(!accepts("float", "1.0005", "1"));
+        EXPECT(accepts("float:1e-3", "1.0005", "1"));
+        EXPECT(!accepts("float:1e-3", "1.01", "1"));
+        EXPECT(accepts("float:1e-3", "1000.5", "1000"));
+        EXPECT(!accepts("float:0", "1.0000001", "1"));
+        EXPECT(accepts("float:1e-3", "case 1: 2.0001", "case 1: 2"));
+        EXPECT(!accepts("float:1e-3", "Case 1: 2", "case 1: 2"));
+        EXPECT(!accepts("float", "abc", "1"));
+        EXPECT(!accepts("float", "1 2", "1"));
+
+        EXPECT(accepts("unordered", "b\na  \n", "a\nb\n"));
+        EXPECT(accepts("unordered", "a\n\nb", "b\na"));
+        EXPECT(!accepts("unordered", "a\na", "a\nb"));
+        EXPECT(!accepts("unordered", "a", "a\nb"));
+        EXPECT(!accepts("unordered", "a\nb\nc", "a\nb"));
+    }
+
+    void test_run_pool_permuted_order()
+    {
+        RunPool pool(4);
+        const size_t count = 20;
+
+        std::vector<size_t> reversed;
+        for (size_t i = count; i-- > 0;)
+        {
+            reversed.push_back(i);
+        }
+
+        // Every test passes: count comes back, and each ran once
+        std::vector<std::atomic<int>> runs(count);
+        size_t failed = pool.run_until_failure(count, [&](size_t index, size_t, CancellationToken &)
+                                               {
+                                                   runs[index]++;
+                                                   return true; },
+                                               reversed);
+        EXPECT(failed == count);
+        for (size_t i = 0; i < count; i++)
+        {
+            EXPECT(runs[i] == 1);
+        }
+
+        // Started last to first, the lowest failing index is still the one
+        // reported, and everything before it has run
+        std::vector<std::atomic<bool>> ran(count);
+        failed = pool.run_until_failure(count, [&](size_t index, size_t slot, CancellationToken &)
+                                        {
+                                            EXPECT(slot < pool.slot_count());
+                                            ran[index] = true;
+                                            return index != 7 && index != 13; },
+                                        reversed);
+        EXPECT(failed == 7);
+        for (size_t i = 0; i < 7; i++)
+        {
+            EXPECT(ran[i]);
+        }
+
+        // A task that throws counts as failed
+        failed = pool.run_until_failure(5, [](size_t index, size_t, CancellationToken &) -> bool
+                                        {
+                                            if (index == 2)
+                                                throw std::runtime_error("test error");
+                                            return true; });
+        EXPECT(failed == 2);
+        EXPECT(pool.run_until_failure(0, [](size_t, size_t, CancellationToken &)
+                                      { return false; }) == 0);
+    }
+
+    // Polls until flag is set, or gives up after two seconds
+    bool wait_for(const std::function<bool()> &flag)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+        while (!flag())
+        {
+            if (std::chrono::steady_clock::now() > deadline)
+            {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return true;
+    }
+
+    void test_run_pool_lower_failure_later()
+    {
+        // 8 starts first and fails at once, cancelling everything after
+        // it. 3 is already running and fails later, once 5 has started in
+        // the slot 8 freed; that cancels 5. The runs cancelled along the
+        // way return false too, and none of them may be what is reported.
+        RunPool pool(3);
+        const size_t count = 10;
+        std::vector<size_t> order{8, 3, 9, 5, 0, 1, 2, 4, 6, 7};
+        std::vector<std::atomic<bool>> started(count);
+        std::vector<std::atomic<bool>> saw_cancel(count);
+        std::vector<std::atomic<bool>> passed(count);
+
+        size_t failed = pool.run_until_failure(count, [&](size_t index, size_t, CancellationToken &cancel)
+                                               {
+                                                   started[index] = true;
+                                                   if (index == 8)
+                                                       return false;
+                                                   if (index == 3)
+                                                   {
+                                                       EXPECT(wait_for([&]
+                                                                       { return started[5].load(); }));
+                                                       return false;
+                                                   }
+                                                   if (index == 5 || index == 9)
+                                                   {
+                                                       saw_cancel[index] = wait_for([&]
+                                                                                    { return cancel.cancelled(); });
+                                                       return false;
+                                                   }
+                                                   passed[index] = true;
+                                                   return true; },
+                                               order);
+
+        EXPECT(failed == 3);
+        EXPECT(saw_cancel[5]);
+        EXPECT(!started[9] || saw_cancel[9]);
+        for (size_t i = 0; i < 3; i++)
+        {
+            EXPECT(passed[i]);
+        }
+        for (size_t i = 0; i <= 3; i++)
+        {
+            EXPECT(!saw_cancel[i]);
+        }
+    }
+
+    std::vector<int> drain(Scheduler &scheduler)
+    {
+        std::vector<int> ids;
+        while (std::optional<Scheduler::Job> job = scheduler.next())
+        {
+            ids.push_back(job->submission_id);
+        }
+        return ids;
+    }
+
+    Scheduler::Job make_job(int id, size_t lane, const std::string &user, long enqueued_ms, int problem_id = 1)
+    {
+        Scheduler::Job job;
+        job.submission_id = id;
+        job.lane = lane;
+        job.user = user;
+        job.problem_id = problem_id;
+        job.enqueued = Scheduler::Clock::time_point(std::chrono::milliseconds(enqueued_ms));
+        return job;
+    }
+
+    void test_scheduler_parse()
+    {
+        // A bare id counts as enqueued now, by nobody in particular
+        auto before = Scheduler::Clock::now();
+        std::optional<Scheduler::Job> bare = Scheduler::parse(1, "42");
+        EXPECT(bare && bare->submission_id == 42 && bare->lane == 1);
+        EXPECT(bare && bare->user.empty() && bare->problem_id == 0 && bare->attempts == 0);
+        EXPECT(bare && bare->enqueued >= before && bare->entry == "42");
+
+        std::optional<Scheduler::Job> full = Scheduler::parse(0, "42:alice:7:1700000000123:3");
+        EXPECT(full && full->submission_id == 42 && full->user == "alice" && full->problem_id == 7);
+        EXPECT(full && full->enqueued == Scheduler::Clock::time_point(std::chrono::milliseconds(1700000000123)));
+        EXPECT(full && full->attempts == 3);
+        EXPECT(full && Scheduler::format(*full) == "42:alice:7:1700000000123:3");
+
+        // Without attempts, as first queued; format adds them back
+        std::optional<Scheduler::Job> fresh = Scheduler::parse(0, "42:alice:7:1700000000123");
+        EXPECT(fresh && fresh->attempts == 0);
+        EXPECT(fresh && Scheduler::format(*fresh) == "42:alice:7:1700000000123:0");
+
+        for (const char *entry : {"", "abc", "42x", "x42", "42:alice:seven", "42:alice:7:soon", "42:alice:7:1:many",
+                                  "99999999999"})
+        {
+            EXPECT(!Scheduler::parse(0, entry));
+        }
+    }
+
+    void test_scheduler_fair_share()
+    {
+        // alice queued three before bob's two; they take turns
+        Scheduler scheduler({"practice"});
+        scheduler.add(make_job(1, 0, "alice", 1));
+        scheduler.add(make_job(2, 0, "alice", 2));
+        scheduler.add(make_job(3, 0, "alice", 3));
+        scheduler.add(make_job(4, 0, "bob", 4));
+        scheduler.add(make_job(5, 0, "bob", 5));
+        EXPECT(scheduler.pending(0) == 5);
+        EXPECT(scheduler.expected_work() == std::chrono::milliseconds(5000));
+        EXPECT((drain(scheduler) == std::vector<int>{1, 4, 2, 5, 3}));
+
+        // In flight until finished
+        EXPECT(scheduler.expected_work() == std::chrono::milliseconds(5000));
+        EXPECT(scheduler.record_failure(2) == 1);
+        EXPECT(scheduler.record_failure(2) == 2);
+        std::optional<Scheduler::Job> finished = scheduler.finish(2);
+        EXPECT(finished && finished->attempts == 2);
+        EXPECT(!scheduler.finish(2));
+        EXPECT(scheduler.record_failure(2) == 0);
+        EXPECT(scheduler.expected_work() == std::chrono::milliseconds(4000));
+
+        // Of one user's jobs, the one expected to be cheapest goes first
+        Scheduler costs({"practice"});
+        costs.record_cost(2, std::chrono::milliseconds(100));
+        costs.add(make_job(1, 0, "alice", 1, 1));
+        costs.add(make_job(2, 0, "alice", 2, 2));
+        EXPECT((drain(costs) == std::vector<int>{2, 1}));
+    }
+
+    void test_scheduler_lanes_and_shedding()
+    {
+        // Contest work goes ahead of practice however long that waited
+        Scheduler scheduler({"contest", "practice"});
+        scheduler.add(make_job(1, 1, "alice", 1));
+        scheduler.add(make_job(2, 1, "bob", 2));
+        scheduler.add(make_job(3, 0, "carol", 3));
+        scheduler.add(make_job(4, 7, "dave", 4)); // past the last lane: lowest priority
+        EXPECT(scheduler.pending(0) == 1 && scheduler.pending(1) == 3);
+        std::optional<Scheduler::Job> first = scheduler.next();
+        EXPECT(first && first->submission_id == 3);
+
+        // Shedding takes the lowest lane's latest arrivals until the excess
+        // is covered, and leaves contest work alone
+        scheduler.add(make_job(5, 0, "erin", 5));
+        std::vector<Scheduler::Job> shed = scheduler.shed(std::chrono::milliseconds(1500));
+        EXPECT(shed.size() == 2);
+        EXPECT(shed.size() == 2 && shed[0].submission_id == 4 && shed[1].submission_id == 2);
+        EXPECT(scheduler.pending(0) == 1 && scheduler.pending(1) == 1);
+        EXPECT((drain(scheduler) == std::vector<int>{5, 1}));
+        EXPECT(scheduler.shed(std::chrono::milliseconds(1000)).empty());
+
+        std::vector<Scheduler::LaneStats> stats = scheduler.stats();
+        EXPECT(stats.size() == 2 && stats[0].name == "contest" && stats[1].name == "practice");
+        EXPECT(stats.size() == 2 && stats[0].started == 2 && stats[1].started == 1);
+    }
+
+    void test_test_history_order()
+    {
+        using std::chrono::milliseconds;
+        TestHistory history(10);
+        TestSet tests(4);
+        for (size_t i = 0; i < tests.size(); i++)
+        {
+            tests[i].id = 100 + static_cast<int>(i);
+        }
+        const std::vector<size_t> id_order{0, 1, 2, 3};
+
+        // Nothing known yet
+        EXPECT(history.order(1, 1, tests) == id_order);
+
+        // 102 is cheap and keeps failing; the others pass slowly
+        for (int i = 0; i < 5; i++)
+        {
+            history.record(1, 1, 100, false, milliseconds(50));
+            history.record(1, 1, 101, false, milliseconds(50));
+            history.record(1, 1, 102, true, milliseconds(2));
+            history.record(1, 1, 103, false, milliseconds(50));
+        }
+        EXPECT((history.order(1, 1, tests) == std::vector<size_t>{2, 0, 1, 3}));
+
+        // Of the passing ones, one that got faster moves up
+        for (int i = 0; i < 10; i++)
+        {
+            history.record(1, 1, 103, false, milliseconds(5));
+        }
+        EXPECT((history.order(1, 1, tests) == std::vector<size_t>{2, 3, 0, 1}));
+
+        // A version bump restores id order. Recording for the new version
+        // forgets the old one, and late results for the old are dropped:
+        // only 100, seen passing, is known and it goes last.
+        EXPECT(history.order(1, 2, tests) == id_order);
+        history.record(1, 2, 100, false, milliseconds(1));
+        EXPECT(history.order(1, 1, tests) == id_order);
+        history.record(1, 1, 102, true, milliseconds(1));
+        EXPECT((history.order(1, 2, tests) == std::vector<size_t>{1, 2, 3, 0}));
+    }
+
+    void test_test_history_eviction()
+    {
+        using std::chrono::milliseconds;
+        TestHistory history(2);
+        TestSet tests(2);
+        tests[0].id = 1;
+        tests[1].id = 2;
+        const std::vector<size_t> failing_first{1, 0};
+
+        for (int problem = 1; problem <= 2; problem++)
+        {
+            history.record(problem, 1, 1, false, milliseconds(10));
+            history.record(problem, 1, 2, true, milliseconds(10));
+        }
+        EXPECT(history.order(1, 1, tests) == failing_first);
+
+        // Problem 1 was used last, so a third problem pushes out 2
+        history.record(3, 1, 2, true, milliseconds(10));
+        EXPECT(history.order(1, 1, tests) == failing_first);
+        EXPECT((history.order(2, 1, tests) == std::vector<size_t>{0, 1}));
+        EXPECT(history.order(3, 1, tests) == failing_first);
+    }
+
+    void test_test_case_cache_versions()
+    {
+        TestCaseCache cache(1024 * 1024);
+        int loads = 0;
+        auto loader = [&](const std::string &output)
+        {
+            return [&loads, output]
+            {
+                loads++;
+                return make_set({{"1 2\n", output}});
+            };
+        };
+
+        TestCaseCache::Handle first = cache.get(1, 1, loader("3"));
+        EXPECT(loads == 1);
+        EXPECT(first->size() == 1 && (*first)[0].expected_output == "3");
+        EXPECT(read_all(*(*first)[0].input) == "1 2\n");
+
+        // The same or an older version is a hit on the same set
+        EXPECT(cache.get(1, 1, loader("x")) == first);
+        EXPECT(cache.get(1, 0, loader("x")) == first);
+        EXPECT(loads == 1);
+
+        // A newer version reloads, and is what later lookups get
+        TestCaseCache::Handle second = cache.get(1, 2, loader("4"));
+        EXPECT(loads == 2);
+        EXPECT((*second)[0].expected_output == "4");
+        EXPECT(cache.get(1, 2, loader("x")) == second);
+        EXPECT((*first)[0].expected_output == "3"); // still alive through its handle
+
+        cache.invalidate(1);
+        cache.get(1, 2, loader("4"));
+        EXPECT(loads == 3);
+        EXPECT(cache.hits() == 3);
+        EXPECT(cache.misses() == 3);
+
+        // A failed load is not cached and the next lookup tries again
+        bool threw = false;
+        try
+        {
+            cache.get(2, 1, []() -> TestSet
+                      { throw std::runtime_error("database down"); });
+        }
+        catch (const std::runtime_error &)
+        {
+            threw = true;
+        }
+        EXPECT(threw);
+        cache.get(2, 1, loader("5"));
+        EXPECT(loads == 4);
+    }
+
+    void test_test_case_cache_eviction()
+    {
+        // Room for two sets of 40 bytes, not three
+        TestCaseCache cache(100);
+        int loads = 0;
+        auto load = [&]
+        {
+            loads++;
+            return make_set({{std::string(20, 'i'), std::string(20, 'o')}});
+        };
+
+        cache.get(1, 1, load);
+        cache.get(2, 1, load);
+        cache.get(1, 1, load); // now 2 is the least recently used
+        EXPECT(loads == 2);
+
+        cache.get(3, 1, load);
+        EXPECT(loads == 3);
+        cache.get(1, 1, load);
+        cache.get(3, 1, load);
+        EXPECT(loads == 3);
+        cache.get(2, 1, load);
+        EXPECT(loads == 4);
+
+        // A set larger than the whole budget is used but never kept
+        auto huge = [&]
+        {
+            loads++;
+            return make_set({{std::string(80, 'i'), std::string(80, 'o')}});
+        };
+        TestCaseCache::Handle tests = cache.get(4, 1, huge);
+        EXPECT(tests && tests->size() == 1);
+        cache.get(4, 1, huge);
+        EXPECT(loads == 6);
+    }
+
+    void test_compile_cache_single_flight()
+    {
+        TempDir dir;
+        CompileCache cache(dir.path(), 1024 * 1024);
+        std::string key = CompileCache::make_key("int main() {}", "/nonexistent/c++", {"-O2"});
+        EXPECT(key.size() == 64);
+        EXPECT(key != CompileCache::make_key("int main() {}", "/nonexistent/c++", {"-O0"}));
+        EXPECT(key == CompileCache::make_key("int main() {}", "/nonexistent/c++", {"-O2"}));
+
+        // Concurrent misses on one key compile it once and share the binary
+        std::atomic<int> compiles{0};
+        auto compile = [&](const std::string &output_path)
+        {
+            compiles++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            std::ofstream(output_path) << "binary";
+            return true;
+        };
+        std::vector<CompileCache::Lease> leases(8);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < leases.size(); i++)
+        {
+            threads.emplace_back([&, i]
+                                 { leases[i] = cache.acquire(key, compile); });
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        EXPECT(compiles == 1);
+        for (const auto &lease : leases)
+        {
+            EXPECT(lease && lease->path == leases[0]->path);
+        }
+        EXPECT(fs::exists(leases[0]->path));
+        EXPECT((fs::status(leases[0]->path).permissions() & fs::perms::others_exec) != fs::perms::none);
+        EXPECT(cache.stats().compiles == 1);
+        EXPECT(cache.stats().hits >= 1);
+
+        // A source that doesn't compile is nullptr for everyone waiting on it
+        std::string bad_key = CompileCache::make_key("int main( {}", "/nonexistent/c++", {});
+        std::atomic<int> bad_compiles{0};
+        std::vector<CompileCache::Lease> bad(4, leases[0]);
+        threads.clear();
+        for (size_t i = 0; i < bad.size(); i++)
+        {
+            threads.emplace_back([&, i]
+                                 { bad[i] = cache.acquire(bad_key, [&](const std::string &)
+                                                          {
+                                                              bad_compiles++;
+                                                              std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                                                              return false; }); });
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        for (const auto &lease : bad)
+        {
+            EXPECT(!lease);
+        }
+        EXPECT(bad_compiles >= 1);
+
+        // A compile that throws says nothing about the source: the next
+        // acquire compiles again
+        std::string flaky_key = CompileCache::make_key("int x;", "/nonexistent/c++", {});
+        bool threw = false;
+        try
+        {
+            cache.acquire(flaky_key, [](const std::string &) -> bool
+                          { throw std::runtime_error("no sandbox"); });
+        }
+        catch (const std::runtime_error &)
+        {
+            threw = true;
+        }
+        EXPECT(threw);
+        EXPECT(cache.acquire(flaky_key, compile) != nullptr);
+    }
+
+    void test_compile_cache_lease_eviction()
+    {
+        TempDir dir;
+        CompileCache cache(dir.path(), 150); // room for one 100-byte binary
+        auto compile = [](const std::string &output_path)
+        {
+            std::ofstream(output_path) << std::string(100, 'x');
+            return true;
+        };
+        auto key = [](const std::string &source)
+        { return CompileCache::make_key(source, "/nonexistent/c++", {}); };
+
+        // Both leased, so neither goes even though the cache is over its cap
+        CompileCache::Lease a = cache.acquire(key("a"), compile);
+        CompileCache::Lease b = cache.acquire(key("b"), compile);
+        EXPECT(a && b);
+        EXPECT(fs::exists(a->path) && fs::exists(b->path));
+
+        // Once b is released, the next insert evicts it and keeps leased a
+        std::string b_path = b->path;
+        b.reset();
+        CompileCache::Lease c = cache.acquire(key("c"), compile);
+        EXPECT(c && fs::exists(c->path));
+        EXPECT(fs::exists(a->path));
+        EXPECT(!fs::exists(b_path));
+
+        // a is still a hit while leased
+        uint64_t compiles = cache.stats().compiles;
+        EXPECT(cache.acquire(key("a"), compile) == a);
+        EXPECT(cache.stats().compiles == compiles);
+
+        // A restarted cache finds what is on disk
+        std::string c_path = c->path;
+        a.reset();
+        c.reset();
+        CompileCache reopened(dir.path(), 1024 * 1024);
+        EXPECT(reopened.acquire(key("c"), compile)->path == c_path);
+        EXPECT(reopened.stats().hits == 1 && reopened.stats().compiles == 0);
+    }
+
+    // A remote tier several caches share, as judges share Redis
+    class MemoryStore : public CompileCache::RemoteStore
+    {
+    public:
+        explicit MemoryStore(std::shared_ptr<std::map<std::string, std::string>> blobs) : blobs_(std::move(blobs)) {}
+
+        bool fetch(const std::string &key, std::string &blob) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = blobs_->find(key);
+            if (it == blobs_->end())
+                return false;
+            blob = it->second;
+            return true;
+        }
+
+        void store(const std::string &key, const std::string &blob) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            (*blobs_)[key] = blob;
+        }
+
+    private:
+        std::mutex mutex_;
+        std::shared_ptr<std::map<std::string, std::string>> blobs_;
+    };
+
+    void test_compile_cache_remote_signatures()
+    {
+        auto blobs = std::make_shared<std::map<std::string, std::string>>();
+        std::string key = CompileCache::make_key("int main() {}", "/nonexistent/c++", {});
+        auto compile = [](const std::string &output_path)
+        {
+            std::ofstream(output_path) << "genuine binary";
+            return true;
+        };
+        auto fetch_with = [&](const std::string &secret)
+        {
+            TempDir dir;
+            CompileCache cache(dir.path(), 1024 * 1024, std::make_unique<MemoryStore>(blobs), secret);
+            CompileCache::Lease lease = cache.acquire(key, compile);
+            std::ifstream in(lease->path);
+            std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            EXPECT(contents == "genuine binary");
+            return cache.stats();
+        };
+
+        // The first judge compiles and shares; another with the secret
+        // fetches instead of compiling
+        CompileCache::Stats stats = fetch_with("secret");
+        EXPECT(stats.compiles == 1 && stats.remote_hits == 0);
+        EXPECT(blobs->count(key) == 1);
+        stats = fetch_with("secret");
+        EXPECT(stats.compiles == 0 && stats.remote_hits == 1);
+
+        // Without the right secret, or with the binary swapped, a blob is
+        // a miss and the source is compiled here
+        stats = fetch_with("other secret");
+        EXPECT(stats.compiles == 1 && stats.remote_hits == 0);
+        std::string &blob = (*blobs)[key];
+        blob = blob.substr(0, 32) + "planted binary";
+        stats = fetch_with("secret");
+        EXPECT(stats.compiles == 1 && stats.remote_hits == 0);
+        (*blobs)[key] = "short";
+        stats = fetch_with("secret");
+        EXPECT(stats.compiles == 1 && stats.remote_hits == 0);
+
+        // Nor is a genuine binary taken under another key
+        std::string other_key = CompileCache::make_key("int x;", "/nonexistent/c++", {});
+        (*blobs)[other_key] = (*blobs)[key];
+        key = other_key;
+        stats = fetch_with("secret");
+        EXPECT(stats.compiles == 1 && stats.remote_hits == 0);
+
+        bool threw = false;
+        try
+        {
+            TempDir dir;
+            CompileCache cache(dir.path(), 1024, std::make_unique<MemoryStore>(blobs));
+        }
+        catch (const std::invalid_argument &)
+        {
+            threw = true;
+        }
+        EXPECT(threw);
+    }
+
+    void test_test_pack_round_trip()
+    {
+        TempDir dir;
+        TestPackStore store(dir.path() + "/packs");
+        TestSet tests = make_set({{"1 2\n", "3\n"}, {"", ""}, {std::string(100000, 'x'), "long"}}, 10);
+
+        EXPECT(!store.load(5, 1));
+        EXPECT(store.save(5, 1, tests));
+
+        std::optional<TestSet> loaded = store.load(5, 1);
+        EXPECT(loaded && loaded->size() == tests.size());
+        for (size_t i = 0; loaded && i < tests.size(); i++)
+        {
+            EXPECT((*loaded)[i].id == tests[i].id);
+            EXPECT((*loaded)[i].expected_output == tests[i].expected_output);
+            EXPECT(read_all(*(*loaded)[i].input) == read_all(*tests[i].input));
+        }
+        EXPECT(!store.load(5, 2));
+        EXPECT(!store.load(6, 1));
+
+        // A new version replaces the old one's pack
+        EXPECT(store.save(5, 2, make_set({{"in", "out"}})));
+        EXPECT(store.load(5, 2).has_value());
+        EXPECT(!store.load(5, 1));
+        EXPECT(store.hits() == 2);
+        EXPECT(store.misses() == 4);
+    }
+
+    void test_test_pack_corruption()
+    {
+        TempDir dir;
+        TestPackStore store(dir.path());
+        EXPECT(store.save(7, 3, make_set({{"input", "expected output"}})));
+
+        std::string pack;
+        for (const auto &file : fs::directory_iterator(dir.path()))
+        {
+            pack = file.path().string();
+        }
+        EXPECT(!pack.empty());
+
+        // Flip the last byte of the data
+        {
+            std::fstream file(pack, std::ios::in | std::ios::out | std::ios::binary);
+            file.seekg(-1, std::ios::end);
+            char last = static_cast<char>(file.get());
+            file.seekp(-1, std::ios::end);
+            file.put(static_cast<char>(last ^ 0x20));
+        }
+        EXPECT(!store.load(7, 3));
+        EXPECT(!fs::exists(pack));
+
+        // Nor is a truncated pack loaded
+        EXPECT(store.save(7, 3, make_set({{"input", "expected output"}})));
+        fs::resize_file(pack, fs::file_size(pack) / 2);
+        EXPECT(!store.load(7, 3));
+        EXPECT(!fs::exists(pack));
+    }
+}
+
+int main()
+{
+    struct
+    {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"comparator modes", test_comparator_modes},
+        {"built-in checker specs", test_builtin_checker_specs},
+        {"run pool in permuted order", test_run_pool_permuted_order},
+        {"run pool with a lower failure later", test_run_pool_lower_failure_later},
+        {"scheduler entry parsing", test_scheduler_parse},
+        {"scheduler fair share", test_scheduler_fair_share},
+        {"scheduler lanes and shedding", test_scheduler_lanes_and_shedding},
+        {"test history order", test_test_history_order},
+        {"test history eviction", test_test_history_eviction},
+        {"test case cache versions", test_test_case_cache_versions},
+        {"test case cache eviction", test_test_case_cache_eviction},
+        {"compile cache single flight", test_compile_cache_single_flight},
+        {"compile cache lease eviction", test_compile_cache_lease_eviction},
+        {"compile cache remote signatures", test_compile_cache_remote_signatures},
+        {"test pack round trip", test_test_pack_round_trip},
+        {"test pack corruption", test_test_pack_corruption},
+    };
+
+    int failed_tests = 0;
+    for (const auto &test : tests)
+    {
+        int before = failed_checks;
+        try
+        {
+            test.run();
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "  threw: " << e.what() << std::endl;
+            failed_checks++;
+        }
+        bool passed = failed_checks == before;
+        failed_tests += passed ? 0 : 1;
+        std::cout << (passed ? "ok      " : "FAILED  ") << test.name << std::endl;
+    }
+    return failed_tests == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
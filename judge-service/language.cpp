@@ -0,0 +1,255 @@
+#include "language.h"
+
+#include <unistd.h>
+
+namespace
+{
+    // Runs in a Python zygote, see LanguageProfile::zygote_command. The
+    // modules named in argv[1] are imported up front, so a run starts with
+    // them already loaded. Streams are recreated the way the interpreter
+    // sets them up for pipes, once the run's fds are in place.
+    constexpr const char *kPythonBootstrap = R"PY(
+import os, socket, struct, sys
+for name in sys.argv[1].split(','):
+    try:
+        __import__(name)
+    except ImportError:
+        pass
+import atexit, resource, runpy, traceback
+
+control = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET, 0, 3)
+control.send(struct.pack('i', os.getpid()))
+try:
+    packed_run, fds, _, _ = socket.recv_fds(control, 32 * 1024 + 1, 3)
+except OSError:
+    os._exit(127)
+if not packed_run:
+    os._exit(0)
+if len(fds) != 3 or len(packed_run) < 5 or not packed_run.endswith(b'\0'):
+    os._exit(127)
+for target, fd in enumerate(fds):
+    os.dup2(fd, target)
+    os.close(fd)
+
+usage = resource.getrusage(resource.RUSAGE_SELF)
+control.send(struct.pack('l', int((usage.ru_utime + usage.ru_stime) * 1000000)))
+control.close()
+
+sys.stdin = sys.__stdin__ = open(0, 'r', encoding='utf-8', errors='surrogateescape', newline='\n', closefd=False)
+sys.stdout = sys.__stdout__ = open(1, 'w', encoding='utf-8', errors='surrogateescape', newline='\n', closefd=False)
+sys.stderr = sys.__stderr__ = open(2, 'w', buffering=1, encoding='utf-8', errors='backslashreplace', newline='\n',
+                                   closefd=False)
+argc, = struct.unpack_from('I', packed_run)
+strings = packed_run[4:-1].split(b'\0')
+sys.argv = [os.fsdecode(arg) for arg in strings[:argc]]
+os.environ.clear()
+for entry in strings[argc:]:
+    key, _, value = entry.partition(b'=')
+    os.environb[key] = value
+del argc, control, fds, packed_run, strings, usage
+
+# Exits the way the interpreter would, minus tearing down every module
+status = 0
+try:
+    runpy.run_path(sys.argv[0], run_name='__main__')
+except SystemExit as e:
+    if e.code is None or isinstance(e.code, int):
+        status = e.code or 0
+    else:
+        print(e.code, file=sys.stderr)
+        status = 1
+except BaseException:
+    traceback.print_exc()
+    status = 1
+if 'threading' in sys.modules:
+    sys.modules['threading']._shutdown()
+atexit._run_exitfuncs()
+for stream in (sys.stdout, sys.stderr):
+    try:
+        stream.flush()
+    except Exception:
+        status = status or 120
+os._exit(status & 0xff)
+)PY";
+
+    // What solutions commonly import
+    constexpr const char *kPythonPreload = "array,bisect,collections,copy,decimal,fractions,functools,heapq,io,"
+                                           "itertools,math,operator,random,re,string,typing";
+
+    // Touches what solutions commonly use, so it lands in the class data
+    // archive
+    constexpr const char *kJavaWarmUp = R"JAVA(
+import java.io.*;
+import java.math.BigInteger;
+import java.util.*;
+import java.util.stream.*;
+
+public class Main {
+    public static void main(String[] args) throws IOException {
+        BufferedReader reader = new BufferedReader(new InputStreamReader(System.in));
+        StringTokenizer tokens = new StringTokenizer("1 2 3");
+        Scanner scanner = new Scanner("4 5");
+        PrintWriter out = new PrintWriter(new BufferedWriter(new OutputStreamWriter(System.out)));
+        List<Integer> list = new ArrayList<>();
+        while (tokens.hasMoreTokens())
+            list.add(Integer.parseInt(tokens.nextToken()));
+        while (scanner.hasNextInt())
+            list.add(scanner.nextInt());
+        Map<Integer, Long> counts = new HashMap<>();
+        TreeMap<Integer, Integer> ordered = new TreeMap<>();
+        Deque<Integer> deque = new ArrayDeque<>(list);
+        PriorityQueue<Integer> heap = new PriorityQueue<>(Comparator.reverseOrder());
+        for (int value : list) {
+            counts.merge(value, 1L, Long::sum);
+            ordered.put(value, value);
+            heap.add(value);
+        }
+        int[] values = list.stream().mapToInt(Integer::intValue).sorted().toArray();
+        Arrays.sort(values);
+        Collections.sort(list);
+        String joined = Arrays.stream(values).mapToObj(String::valueOf).collect(Collectors.joining(" "));
+        StringBuilder builder = new StringBuilder(joined);
+        builder.append(String.format("%d %.3f", deque.size(), Math.sqrt(heap.size())));
+        builder.append(BigInteger.valueOf(counts.size()).pow(3)).append(ordered.firstKey());
+        if (reader.readLine() != null)
+            out.println(builder);
+        out.flush();
+    }
+}
+)JAVA";
+
+    // JVM flags every run and the archive dump share. Keeps unified logging
+    // off stdout, which is the program's output.
+    const std::vector<std::string> kJvmFlags{"-XX:+UseSerialGC", "-XX:-UsePerfData", "-XX:ReservedCodeCacheSize=64m",
+                                             "-XX:CompressedClassSpaceSize=64m", "-Xlog:disable",
+                                             "-Xlog:all=warning:stderr"};
+
+    std::vector<std::string> concat(std::vector<std::string> head, const std::vector<std::string> &tail)
+    {
+        head.insert(head.end(), tail.begin(), tail.end());
+        return head;
+    }
+}
+
+bool LanguageProfile::available() const
+{
+    std::vector<const std::vector<std::string> *> commands{&run_command, &zygote_command};
+    for (const auto &step : compile_steps)
+        commands.push_back(&step);
+    for (const auto &step : prepare_steps)
+        commands.push_back(&step);
+
+    for (const auto *command : commands)
+    {
+        // {bin} is the program itself
+        if (!command->empty() && command->front() != "{bin}" && access(command->front().c_str(), X_OK) != 0)
+        {
+            return false;
+        }
+    }
+    return !compile_steps.empty() && !run_command.empty();
+}
+
+std::vector<std::string> expand_command(const std::vector<std::string> &command, const Placeholders &values)
+{
+    std::vector<std::string> expanded;
+    expanded.reserve(command.size());
+    for (const auto &arg : command)
+    {
+        std::string result = arg;
+        bool dropped = false;
+        for (const auto &value : values)
+        {
+            if (arg == value.first && value.second.empty())
+            {
+                dropped = true;
+                break;
+            }
+            size_t at = 0;
+            while ((at = result.find(value.first, at)) != std::string::npos)
+            {
+                result.replace(at, value.first.size(), value.second);
+                at += value.second.size();
+            }
+        }
+        if (!dropped)
+        {
+            expanded.push_back(std::move(result));
+        }
+    }
+    return expanded;
+}
+
+std::vector<std::shared_ptr<const LanguageProfile>> builtin_languages(const std::string &compiler,
+                                                                     const std::vector<std::string> &flags,
+                                                                     const std::vector<std::string> &precompiled_headers,
+                                                                     const std::string &runtime_dir)
+{
+    std::vector<std::shared_ptr<const LanguageProfile>> languages;
+
+    auto cpp = std::make_shared<LanguageProfile>();
+    cpp->name = "cpp";
+    cpp->source_file = "main.cpp";
+    cpp->compile_steps = {concat(concat({compiler}, flags), {"{pch}", "-pipe", "{src}", "-o", "{out}"})};
+    cpp->run_command = {"{bin}"};
+    for (const auto &header : precompiled_headers)
+    {
+        cpp->warm_up_source += "#include <" + header + ">\n";
+    }
+    cpp->warm_up_source += "int main() { return 0; }\n";
+    languages.push_back(cpp);
+
+    auto c = std::make_shared<LanguageProfile>();
+    c->name = "c";
+    c->source_file = "main.c";
+    c->compile_steps = {{"/usr/bin/gcc", "-std=c11", "-O2", "-pipe", "{src}", "-o", "{out}", "-lm"}};
+    c->run_command = {"{bin}"};
+    c->warm_up_source = "#include <stdio.h>\nint main(void) { return 0; }\n";
+    languages.push_back(c);
+
+    // Byte-compiled once, so a syntax error is a compilation error and no
+    // run parses the source again
+    auto python = std::make_shared<LanguageProfile>();
+    python->name = "python";
+    python->source_file = "main.py";
+    python->compile_steps = {{"/usr/bin/python3", "-I", "-S", "-c",
+                              "import py_compile, sys\n"
+                              "try:\n"
+                              "    py_compile.compile(sys.argv[1], cfile=sys.argv[2], doraise=True)\n"
+                              "except py_compile.PyCompileError as e:\n"
+                              "    sys.exit(e.msg)\n",
+                              "{src}", "{out}"}};
+    python->run_command = {"/usr/bin/python3", "-I", "-S", "-X", "utf8", "{bin}"};
+    python->zygote_command = {"/usr/bin/python3", "-I", "-S", "-X", "utf8", "-c", kPythonBootstrap, kPythonPreload};
+    python->time_multiplier = 3.0;
+    python->syscalls = SyscallProfile::Interpreter;
+    python->warm_up_source = "import sys\n";
+    languages.push_back(python);
+
+    // JDK classes a typical solution loads come from a class data archive
+    // dumped at startup instead of being parsed and verified on every run
+    std::string archive = runtime_dir + "/java/classes.jsa";
+    auto java = std::make_shared<LanguageProfile>();
+    java->name = "java";
+    java->source_file = "Main.java";
+    java->compile_steps = {{"/usr/bin/javac", "-J-XX:+UseSerialGC", "-J-XX:TieredStopAtLevel=1", "-J-XX:-UsePerfData",
+                            "-encoding", "UTF-8", "-d", "{dir}/classes", "{src}"},
+                           {"/usr/bin/jar", "-J-XX:+UseSerialGC", "-J-XX:TieredStopAtLevel=1", "-J-XX:-UsePerfData",
+                            "--create", "--file", "{out}", "-C", "{dir}/classes", "."}};
+    java->run_command = concat(concat({"/usr/bin/java"}, kJvmFlags),
+                               {"-Xmx{memory_mb}m", "-Xshare:auto", "-XX:SharedArchiveFile=" + archive, "-cp", "{bin}",
+                                "Main"});
+    java->time_multiplier = 2.0;
+    java->syscalls = SyscallProfile::Jvm;
+    java->threads = 32;
+    java->warm_up_source = kJavaWarmUp;
+    java->prepare_steps = {concat(concat({"/usr/bin/java"}, kJvmFlags),
+                                  {"-Xshare:off", "-XX:DumpLoadedClassList={dir}/classes.lst", "-cp", "{bin}", "Main"}),
+                           concat(concat({"/usr/bin/java"}, kJvmFlags),
+                                  {"-Xshare:dump", "-XX:SharedClassListFile={dir}/classes.lst",
+                                   "-XX:SharedArchiveFile={out}"})};
+    java->prepared_path = archive;
+    languages.push_back(java);
+
+    return languages;
+}
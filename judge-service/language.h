@@ -0,0 +1,66 @@
+#ifndef LANGUAGE_H
+#define LANGUAGE_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "seccomp_profile.h"
+
+// How submissions in one language are built and run. Commands are argv
+// templates in which {src}, {dir}, {out}, {bin}, {pch} and {memory_mb}
+// are filled in where they apply; an argument that is just a placeholder
+// with nothing to fill in is dropped.
+struct LanguageProfile
+{
+    std::string name;        // as stored in submissions.language
+    std::string source_file; // what the source is saved as in the job directory
+
+    // Run one after another in the compile sandbox. {src} is the source,
+    // {dir} the job directory, {out} the artifact to produce and {pch} the
+    // include flag for precompiled headers once they are ready.
+    std::vector<std::vector<std::string>> compile_steps;
+
+    // What a test runs; {bin} is the artifact, {memory_mb} the memory limit
+    std::vector<std::string> run_command;
+
+    // Applied to the CPU and wall-clock limits of every run
+    double time_multiplier = 1.0;
+    SyscallProfile syscalls = SyscallProfile::Native;
+    size_t threads = 1; // lower bound on the sandbox's process_limit
+
+    // Warm start: an interpreter every zygote starts ahead of its run.
+    // It takes the run over the zygote's control socket (fd 3) itself:
+    // reports its pid when ready, receives the packed argv and environment
+    // of the program with stdin, stdout and stderr attached, reports the CPU time it
+    // used itself and closes the socket before it runs the program.
+    std::vector<std::string> zygote_command;
+
+    // Compiled once at startup, which also pulls the toolchain into the
+    // page cache. Each prepare step then runs with {bin} standing for it,
+    // and the {out} the last one wrote is published at prepared_path,
+    // e.g. a class data archive run_command points at.
+    std::string warm_up_source;
+    std::vector<std::vector<std::string>> prepare_steps;
+    std::string prepared_path;
+
+    // True if every command's program is installed
+    bool available() const;
+};
+
+using Placeholders = std::vector<std::pair<std::string, std::string>>;
+
+// Fills the placeholders into an argv template
+std::vector<std::string> expand_command(const std::vector<std::string> &command, const Placeholders &values);
+
+// The built-in profiles: cpp, c, python and java. C++ is built by compiler
+// with flags, as the precompiled headers are, and warms up on those
+// headers; runtime_dir holds what runtimes prepare at startup.
+std::vector<std::shared_ptr<const LanguageProfile>> builtin_languages(const std::string &compiler,
+                                                                     const std::vector<std::string> &flags,
+                                                                     const std::vector<std::string> &precompiled_headers,
+                                                                     const std::string &runtime_dir);
+
+#endif // LANGUAGE_H
@@ -1,131 +1,64 @@
 #include <iostream>
-#include <fstream>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <cstdlib>
-#include <unistd.h>
-#include <sys/wait.h>
-#include <sys/resource.h>
-#include <hiredis/hiredis.h>
-#include <hiredis/hiredis_ssl.h>
+#include <csignal>
 #include <libpq-fe.h>
 #include <cstdio>
 #include <stdexcept>
-#include <filesystem>
-
-struct TestCase
+#include <memory>
+#include <thread>
+
+#include "cgroup_pool.h"
+#include "checker.h"
+#include "compile_cache.h"
+#include "compile_server.h"
+#include "language.h"
+#include "redis_connection.h"
+#include "run_pool.h"
+#include "sandbox.h"
+#include "sandbox_root.h"
+#include "test_case_cache.h"
+
+// What judging needs, set up once: compiles go through the compile server
+// and its cache, tests run in parallel on sandboxed run slots, as they do
+// in the modern judge
+struct Engine
 {
-    std::string input;
-    std::string output;
+    std::shared_ptr<const LanguageProfile> cpp;
+    std::shared_ptr<const Checker> checker;
+    std::unique_ptr<CompileCache> compile_cache;
+    std::unique_ptr<CompileServer> compile_server;
+    std::vector<std::unique_ptr<SecureSandbox>> sandboxes; // one per run slot
+    std::unique_ptr<RunPool> run_pool;
+    std::unique_ptr<TestCaseCache> test_case_cache;
 };
 
-struct RedisConfig
-{
-    std::string host = "redis";
-    int port = 6379;
-    std::string password;
-    bool use_tls = false;
-};
-
-static std::string rtrim_copy(const std::string &s)
-{
-    size_t end = s.find_last_not_of(" \n\r\t");
-    return (end == std::string::npos) ? "" : s.substr(0, end + 1);
-}
-
-static std::string verdict_from_output(const std::string &run_out, const std::string &expected)
+// Same order of precedence as the modern judge
+static std::string verdict_of(const SecureSandbox::SandboxResult &result, CheckSession &check)
 {
-    if (run_out == "TIME_LIMIT_EXCEEDED")
+    if (result.setup_failed)
+        return "Judge Error";
+    if (result.output_rejected)
+        return "Wrong Answer";
+    if (result.timeout)
         return "Time Limit Exceeded";
-    if (run_out == "RUNTIME_ERROR" || run_out == "JUDGE_ERROR")
+    if (result.memory_exceeded)
+        return "Memory Limit Exceeded";
+    if (result.output_limit_exceeded)
+        return "Output Limit Exceeded";
+    if (result.signal_killed || result.exit_code != 0)
         return "Runtime Error";
-    return rtrim_copy(run_out) == rtrim_copy(expected) ? "Accepted" : "Wrong Answer";
-}
-
-RedisConfig parse_redis_url(const std::string &url)
-{
-    RedisConfig config;
-    if (url.empty())
-    {
-        return config;
-    }
-
-    std::string working = url;
-    auto scheme_pos = working.find("://");
-    if (scheme_pos != std::string::npos)
-    {
-        std::string scheme = working.substr(0, scheme_pos);
-        if (scheme == "rediss")
-        {
-            config.use_tls = true;
-        }
-        working = working.substr(scheme_pos + 3);
-    }
-
-    auto at_pos = working.find('@');
-    if (at_pos != std::string::npos)
-    {
-        std::string credentials = working.substr(0, at_pos);
-        working = working.substr(at_pos + 1);
-
-        if (!credentials.empty())
-        {
-            if (credentials.front() == ':')
-            {
-                config.password = credentials.substr(1);
-            }
-            else
-            {
-                auto colon_pos = credentials.find(':');
-                if (colon_pos != std::string::npos)
-                {
-                    config.password = credentials.substr(colon_pos + 1);
-                }
-                else
-                {
-                    config.password = credentials;
-                }
-            }
-        }
-    }
-
-    auto end_host = working.find_first_of("/?");
-    std::string host_port = working.substr(0, end_host);
-    if (!host_port.empty())
+    switch (check.finish())
     {
-        auto colon_pos = host_port.find(':');
-        if (colon_pos != std::string::npos)
-        {
-            config.host = host_port.substr(0, colon_pos);
-            try
-            {
-                config.port = std::stoi(host_port.substr(colon_pos + 1));
-            }
-            catch (const std::exception &)
-            {
-                config.port = 6379;
-            }
-        }
-        else
-        {
-            config.host = host_port;
-        }
+    case CheckResult::Accepted:
+        return "Accepted";
+    case CheckResult::WrongAnswer:
+        return "Wrong Answer";
+    default:
+        return "Judge Error";
     }
-
-    if (end_host != std::string::npos)
-    {
-        std::string remainder = working.substr(end_host);
-        if (remainder.find("ssl=true") != std::string::npos || remainder.find("ssl=1") != std::string::npos)
-        {
-            config.use_tls = true;
-        }
-        if (remainder.find("ssl=false") != std::string::npos || remainder.find("ssl=0") != std::string::npos)
-        {
-            config.use_tls = false;
-        }
-    }
-
-    return config;
 }
 
 bool fetch_source_code(PGconn *db_conn, const std::string &submission_id, std::string &source_code)
@@ -144,106 +77,6 @@ bool fetch_source_code(PGconn *db_conn, const std::string &submission_id, std::s
     return true;
 }
 
-bool write_source_to_disk(const std::string &path, const std::string &contents)
-{
-    std::ofstream out(path);
-    if (!out.is_open())
-    {
-        return false;
-    }
-    out << contents;
-    out.close();
-    return out.good();
-}
-
-void set_limits()
-{
-    struct rlimit time_limit;
-    time_limit.rlim_cur = 2;
-    time_limit.rlim_max = 2;
-    setrlimit(RLIMIT_CPU, &time_limit);
-
-    struct rlimit mem_limit;
-    mem_limit.rlim_cur = 256 * 1024 * 1024;
-    mem_limit.rlim_max = 256 * 1024 * 1024;
-    setrlimit(RLIMIT_AS, &mem_limit);
-}
-
-bool compile_code(const std::string &source_path, const std::string &executable_path)
-{
-    pid_t pid = fork();
-    if (pid == 0)
-    {
-        execlp("g++", "g++", source_path.c_str(), "-o", executable_path.c_str(), "-std=c++17", (char *)NULL);
-        exit(1);
-    }
-    else if (pid > 0)
-    {
-        int status;
-        waitpid(pid, &status, 0);
-        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
-    }
-    return false;
-}
-
-std::string run_code(const std::string &executable_path, const std::string &input)
-{
-    int input_pipe[2];
-    int output_pipe[2];
-    if (pipe(input_pipe) == -1 || pipe(output_pipe) == -1)
-        return "JUDGE_ERROR";
-
-    pid_t pid = fork();
-    if (pid == 0)
-    {
-        set_limits();
-
-        dup2(input_pipe[0], STDIN_FILENO);
-        dup2(output_pipe[1], STDOUT_FILENO);
-
-        close(input_pipe[0]);
-        close(input_pipe[1]);
-        close(output_pipe[0]);
-        close(output_pipe[1]);
-
-        execlp(executable_path.c_str(), executable_path.c_str(), (char *)NULL);
-        exit(127);
-    }
-    else if (pid > 0)
-    {
-        close(input_pipe[0]);
-        close(output_pipe[1]);
-
-        write(input_pipe[1], input.c_str(), input.length());
-        close(input_pipe[1]);
-
-        std::string output = "";
-        char buffer[1024];
-        ssize_t count;
-        while ((count = read(output_pipe[0], buffer, sizeof(buffer))) > 0)
-        {
-            output.append(buffer, count);
-        }
-        close(output_pipe[0]);
-
-        int status;
-        waitpid(pid, &status, 0);
-
-        if (WIFSIGNALED(status))
-        {
-            if (WTERMSIG(status) == SIGXCPU)
-                return "TIME_LIMIT_EXCEEDED";
-            return "RUNTIME_ERROR";
-        }
-        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
-        {
-            return output;
-        }
-        return "RUNTIME_ERROR";
-    }
-    return "JUDGE_ERROR";
-}
-
 void update_verdict(PGconn *db_conn, const std::string &submission_id, const std::string &verdict)
 {
     std::string query = "UPDATE submissions SET verdict = $1 WHERE id = $2";
@@ -256,9 +89,10 @@ void update_verdict(PGconn *db_conn, const std::string &submission_id, const std
     PQclear(res);
 }
 
-int get_problem_id(PGconn *db_conn, const std::string &submission_id)
+int get_problem_id(PGconn *db_conn, const std::string &submission_id, long &test_version)
 {
-    std::string query = "SELECT problem_id FROM submissions WHERE id = $1";
+    std::string query = "SELECT s.problem_id, COALESCE(p.test_version, 0) FROM submissions s "
+                        "LEFT JOIN problems p ON p.id = s.problem_id WHERE s.id = $1";
     const char *paramValues[1] = {submission_id.c_str()};
     PGresult *res = PQexecParams(db_conn, query.c_str(), 1, NULL, paramValues, NULL, NULL, 0);
 
@@ -268,158 +102,127 @@ int get_problem_id(PGconn *db_conn, const std::string &submission_id)
         return -1;
     }
     int problem_id = std::stoi(PQgetvalue(res, 0, 0));
+    test_version = std::stol(PQgetvalue(res, 0, 1));
     PQclear(res);
     return problem_id;
 }
 
-std::vector<TestCase> get_test_cases(PGconn *db_conn, int problem_id)
+TestSet get_test_cases(PGconn *db_conn, int problem_id)
 {
-    std::vector<TestCase> test_cases;
-    std::string query = "SELECT input, output FROM test_cases WHERE problem_id = $1";
+    TestSet test_cases;
+    std::string query = "SELECT id, input, output FROM test_cases WHERE problem_id = $1 ORDER BY id";
     std::string problem_id_str = std::to_string(problem_id);
     const char *paramValues[1] = {problem_id_str.c_str()};
     PGresult *res = PQexecParams(db_conn, query.c_str(), 1, NULL, paramValues, NULL, NULL, 0);
 
     if (PQresultStatus(res) == PGRES_TUPLES_OK)
     {
+        OutputArena outputs;
+        test_cases.reserve(PQntuples(res));
         for (int i = 0; i < PQntuples(res); i++)
         {
-            test_cases.push_back({PQgetvalue(res, i, 0),
-                                  PQgetvalue(res, i, 1)});
+            TestCase tc{std::stoi(PQgetvalue(res, i, 0)),
+                        InputFile::create(std::string_view(PQgetvalue(res, i, 1), PQgetlength(res, i, 1))), {}, nullptr};
+            outputs.add(tc, PQgetvalue(res, i, 2), PQgetlength(res, i, 2));
+            test_cases.push_back(std::move(tc));
         }
     }
     PQclear(res);
     return test_cases;
 }
 
-void process_submission(const std::string &submission_id, PGconn *db_conn)
+void process_submission(const std::string &submission_id, PGconn *db_conn, Engine &engine)
 {
     std::cout << "Processing submission ID: " << submission_id << std::endl;
-    std::string workdir = getenv("SUBMISSION_WORKDIR") ? getenv("SUBMISSION_WORKDIR") : "/tmp/codejudge-submissions";
-    try
-    {
-        std::filesystem::create_directories(workdir);
-    }
-    catch (const std::exception &ex)
-    {
-        std::cerr << "Failed to create work directory: " << ex.what() << std::endl;
-        update_verdict(db_conn, submission_id, "Judge Error: Storage unavailable");
-        return;
-    }
-
-    std::string source_path = workdir + "/" + submission_id + ".cpp";
-    std::string executable_path = workdir + "/" + submission_id;
-
-    auto cleanup_files = [&]()
-    {
-        std::remove(source_path.c_str());
-        std::remove(executable_path.c_str());
-    };
-
-    auto finish = [&](const std::string &v)
-    {
-        update_verdict(db_conn, submission_id, v);
-        cleanup_files();
-    };
 
     std::string source_code;
     if (!fetch_source_code(db_conn, submission_id, source_code))
     {
-        finish("Judge Error: Source not found");
+        update_verdict(db_conn, submission_id, "Judge Error: Source not found");
         return;
     }
 
-    if (!write_source_to_disk(source_path, source_code))
+    // Identical sources (resubmits, rejudges) reuse the cached executable
+    bool compiler_ran = true;
+    CompileCache::Lease binary = engine.compile_cache->acquire(
+        CompileServer::cache_key(*engine.cpp, source_code), [&](const std::string &output_path)
+        {
+            CompileServer::Result result = engine.compile_server->compile(*engine.cpp, source_code, output_path);
+            compiler_ran = !result.setup_failed;
+            return result.ok;
+        });
+
+    if (!compiler_ran)
     {
-        finish("Judge Error: Write failure");
+        update_verdict(db_conn, submission_id, "Judge Error: Compiler unavailable");
         return;
     }
 
-    if (!compile_code(source_path, executable_path))
+    if (!binary)
     {
         std::cout << "Verdict for " << submission_id << ": Compilation Error" << std::endl;
-        finish("Compilation Error");
+        update_verdict(db_conn, submission_id, "Compilation Error");
         return;
     }
 
-    int problem_id = get_problem_id(db_conn, submission_id);
+    long test_version = 0;
+    int problem_id = get_problem_id(db_conn, submission_id, test_version);
     if (problem_id == -1)
     {
-        finish("Judge Error: Problem not found");
+        update_verdict(db_conn, submission_id, "Judge Error: Problem not found");
         return;
     }
 
-    std::vector<TestCase> test_cases = get_test_cases(db_conn, problem_id);
+    TestCaseCache::Handle cached = engine.test_case_cache->get(problem_id, test_version, [&]
+                                                               { return get_test_cases(db_conn, problem_id); });
+    const TestSet &test_cases = *cached;
     if (test_cases.empty())
     {
-        finish("Judge Error: No test cases");
+        update_verdict(db_conn, submission_id, "Judge Error: No test cases");
         return;
     }
 
-    std::string final_verdict = "Accepted";
-    for (const auto &tc : test_cases)
-    {
-        std::string verdict = verdict_from_output(run_code(executable_path, tc.input), tc.output);
-        if (verdict != "Accepted")
+    // The lowest failing test decides, whichever finishes first
+    std::vector<std::string> verdicts(test_cases.size());
+    size_t failed = engine.run_pool->run_until_failure(
+        test_cases.size(), [&](size_t index, size_t slot, CancellationToken &cancel)
         {
-            final_verdict = verdict;
-            break;
-        }
-    }
+            try
+            {
+                std::unique_ptr<CheckSession> check = engine.checker->start(test_cases[index]);
+                auto result = engine.sandboxes[slot]->execute(binary->path, *test_cases[index].input, &cancel,
+                                                              [&](const char *data, size_t size)
+                                                              { return check->feed(data, size); });
+                verdicts[index] = verdict_of(result, *check);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Test " << index << " of submission " << submission_id << ": " << e.what() << std::endl;
+                verdicts[index] = "Judge Error";
+            }
+            return verdicts[index] == "Accepted";
+        });
+    std::string final_verdict = failed < verdicts.size() ? verdicts[failed] : "Accepted";
 
     std::cout << "Verdict for " << submission_id << ": " << final_verdict << std::endl;
     update_verdict(db_conn, submission_id, final_verdict);
-
-    cleanup_files();
 }
 
 int main()
 {
     std::string redis_url_env = getenv("REDIS_URL") ? getenv("REDIS_URL") : "redis:6379";
     RedisConfig redis_cfg = parse_redis_url(redis_url_env);
-    redisContext *redis_c = redisConnect(redis_cfg.host.c_str(), redis_cfg.port);
-    if (redis_c == NULL || redis_c->err)
+    std::unique_ptr<RedisConnection> redis;
+    try
     {
-        if (redis_c)
-        {
-            std::cerr << "Redis connection error: " << redis_c->errstr << std::endl;
-            redisFree(redis_c);
-        }
-        else
-        {
-            std::cerr << "Can't allocate redis context" << std::endl;
-        }
-        return 1;
+        redis = std::make_unique<RedisConnection>(redis_cfg);
     }
-
-    if (redis_cfg.use_tls)
+    catch (const std::exception &e)
     {
-        if (redisSecureConnection(redis_c, NULL, NULL, "/etc/ssl/certs", redis_cfg.host.c_str()) != REDIS_OK)
-        {
-            std::cerr << "Redis TLS handshake failed: " << redis_c->errstr << std::endl;
-            redisFree(redis_c);
-            return 1;
-        }
-    }
-
-    if (!redis_cfg.password.empty())
-    {
-        redisReply *auth_reply = (redisReply *)redisCommand(redis_c, "AUTH %s", redis_cfg.password.c_str());
-        if (auth_reply == NULL)
-        {
-            std::cerr << "Redis AUTH failed" << std::endl;
-            redisFree(redis_c);
-            return 1;
-        }
-        if (auth_reply->type == REDIS_REPLY_ERROR)
-        {
-            std::cerr << "Redis AUTH error: " << auth_reply->str << std::endl;
-            freeReplyObject(auth_reply);
-            redisFree(redis_c);
-            return 1;
-        }
-        freeReplyObject(auth_reply);
+        std::cerr << e.what() << std::endl;
+        return 1;
     }
+    redisContext *redis_c = redis->get();
 
     const char *db_url = getenv("DATABASE_URL");
     if (db_url == NULL)
@@ -435,6 +238,90 @@ int main()
         return 1;
     }
 
+    // Sandboxes write to pipes the program may have closed
+    std::signal(SIGPIPE, SIG_IGN);
+
+    Engine engine;
+    try
+    {
+        const char *run_slots_env = getenv("JUDGE_RUN_SLOTS");
+        size_t run_slots = std::max<size_t>(
+            run_slots_env ? std::stoul(run_slots_env) : std::thread::hardware_concurrency(), 1);
+
+        // One submission is judged at a time, so one compile runs at a time
+        CompileServer::Config compile_config;
+        const char *compile_dir = getenv("JUDGE_COMPILE_DIR");
+        if (compile_dir)
+            compile_config.work_dir = compile_dir;
+        compile_config.slots = 1;
+        for (auto &language : builtin_languages(compile_config.compiler, compile_config.flags,
+                                                compile_config.precompiled_headers, compile_config.work_dir + "/runtime"))
+        {
+            if (language->name == "cpp")
+                engine.cpp = language;
+        }
+        compile_config.languages = {engine.cpp};
+        engine.checker = make_builtin_checker("exact");
+
+        SecureSandbox::SandboxConfig sandbox_config;
+        sandbox_config.user = "nobody";
+        // Every run, compile and warm zygote holds a cgroup
+        const char *cgroups = getenv("JUDGE_CGROUPS");
+        const char *cgroup_root = getenv("JUDGE_CGROUP_ROOT");
+        if (!cgroups || std::string(cgroups) != "0")
+        {
+            try
+            {
+                sandbox_config.cgroups = CgroupPool::create(cgroup_root ? cgroup_root : "",
+                                                            run_slots * (sandbox_config.prefork_count + 1) + 2);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "cgroup v2 unavailable, limiting memory with RLIMIT_AS: " << e.what() << std::endl;
+            }
+        }
+
+        const char *cache_dir = getenv("JUDGE_COMPILE_CACHE_DIR");
+        const char *cache_mb = getenv("JUDGE_COMPILE_CACHE_MB");
+        std::string binary_dir = cache_dir ? cache_dir : "/tmp/codejudge-compile-cache";
+        engine.compile_cache = std::make_unique<CompileCache>(binary_dir,
+                                                              (cache_mb ? std::stoul(cache_mb) : 1024) * 1024 * 1024);
+
+        // Programs see the host's system directories read-only and nothing
+        // else of it but their binaries
+        const char *chroot_env = getenv("JUDGE_CHROOT");
+        const char *chroot_dir = getenv("JUDGE_CHROOT_DIR");
+        if (!chroot_env || std::string(chroot_env) != "0")
+        {
+            try
+            {
+                sandbox_config.root = SandboxRoot::create(chroot_dir ? chroot_dir : "/tmp/codejudge-root");
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Sandbox root unavailable, programs see the host filesystem: " << e.what() << std::endl;
+            }
+        }
+        sandbox_config.read_only_paths = {binary_dir};
+
+        for (size_t i = 0; i < run_slots; i++)
+            engine.sandboxes.push_back(std::make_unique<SecureSandbox>(sandbox_config));
+        engine.run_pool = std::make_unique<RunPool>(run_slots);
+
+        compile_config.sandbox = CompileServer::compile_sandbox(sandbox_config, compile_config.work_dir);
+        engine.compile_server = std::make_unique<CompileServer>(compile_config);
+
+        const char *test_cache_mb = getenv("JUDGE_TEST_CACHE_MB");
+        engine.test_case_cache =
+            std::make_unique<TestCaseCache>((test_cache_mb ? std::stoul(test_cache_mb) : 512) * 1024 * 1024);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Failed to set up judging: " << e.what() << std::endl;
+        PQfinish(db_conn);
+        return 1;
+    }
+
     std::cout << "Judge Service Started. Waiting for submissions..." << std::endl;
 
     while (true)
@@ -445,13 +332,14 @@ int main()
         {
             if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 2)
             {
-                process_submission(reply->element[1]->str, db_conn);
+                // Entries may carry user, problem and enqueue time after the id
+                std::string entry = reply->element[1]->str;
+                process_submission(entry.substr(0, entry.find(':')), db_conn, engine);
             }
             freeReplyObject(reply);
         }
     }
 
-    redisFree(redis_c);
     PQfinish(db_conn);
     return 0;
 }
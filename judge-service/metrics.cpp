@@ -0,0 +1,301 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+    std::string format_value(double value)
+    {
+        if (std::isinf(value))
+        {
+            return value > 0 ? "+Inf" : "-Inf";
+        }
+        std::ostringstream out;
+        out.precision(12);
+        out << value;
+        return out.str();
+    }
+
+    // name{labels} or name{labels,extra}
+    std::string series_name(const std::string &name, const std::string &labels, const std::string &extra = "")
+    {
+        if (labels.empty() && extra.empty())
+        {
+            return name;
+        }
+        std::string joined = labels;
+        if (!labels.empty() && !extra.empty())
+        {
+            joined += ",";
+        }
+        return name + "{" + joined + extra + "}";
+    }
+
+    void write_all(int fd, const std::string &data)
+    {
+        size_t written = 0;
+        while (written < data.size())
+        {
+            ssize_t n = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                return;
+            }
+            written += n;
+        }
+    }
+}
+
+Histogram::Histogram(std::vector<double> bounds)
+    : bounds_(std::move(bounds)), buckets_(new std::atomic<uint64_t>[bounds_.size() + 1])
+{
+    for (double bound : bounds_)
+    {
+        bounds_ns_.push_back(static_cast<int64_t>(bound * 1e9));
+    }
+    for (size_t i = 0; i <= bounds_.size(); i++)
+    {
+        buckets_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void Histogram::observe(std::chrono::nanoseconds duration)
+{
+    int64_t ns = std::max<int64_t>(duration.count(), 0);
+    size_t bucket = std::lower_bound(bounds_ns_.begin(), bounds_ns_.end(), ns) - bounds_ns_.begin();
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_ns_.fetch_add(static_cast<uint64_t>(ns), std::memory_order_relaxed);
+}
+
+std::vector<double> MetricsRegistry::latency_buckets()
+{
+    return {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+            0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60};
+}
+
+MetricsRegistry::Series &MetricsRegistry::add(const std::string &name, const std::string &help,
+                                              const std::string &type, const std::string &labels)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find_if(families_.begin(), families_.end(), [&](const auto &family)
+                           { return family->name == name; });
+    if (it == families_.end())
+    {
+        auto family = std::make_unique<Family>();
+        family->name = name;
+        family->help = help;
+        family->type = type;
+        families_.push_back(std::move(family));
+        it = families_.end() - 1;
+    }
+    else if ((*it)->type != type)
+    {
+        throw std::runtime_error("Metric " + name + " registered as both " + (*it)->type + " and " + type);
+    }
+
+    (*it)->series.push_back(std::make_unique<Series>());
+    Series &series = *(*it)->series.back();
+    series.labels = labels;
+    return series;
+}
+
+Counter &MetricsRegistry::counter(const std::string &name, const std::string &help, const std::string &labels)
+{
+    Series &series = add(name, help, "counter", labels);
+    series.counter = std::make_unique<Counter>();
+    return *series.counter;
+}
+
+Gauge &MetricsRegistry::gauge(const std::string &name, const std::string &help, const std::string &labels)
+{
+    Series &series = add(name, help, "gauge", labels);
+    series.gauge = std::make_unique<Gauge>();
+    return *series.gauge;
+}
+
+Histogram &MetricsRegistry::histogram(const std::string &name, const std::string &help, const std::string &labels,
+                                      std::vector<double> bounds)
+{
+    Series &series = add(name, help, "histogram", labels);
+    series.histogram = std::make_unique<Histogram>(std::move(bounds));
+    return *series.histogram;
+}
+
+void MetricsRegistry::counter_callback(const std::string &name, const std::string &help, const std::string &labels,
+                                       std::function<double()> read)
+{
+    add(name, help, "counter", labels).read = std::move(read);
+}
+
+void MetricsRegistry::gauge_callback(const std::string &name, const std::string &help, const std::string &labels,
+                                     std::function<double()> read)
+{
+    add(name, help, "gauge", labels).read = std::move(read);
+}
+
+std::string MetricsRegistry::render() const
+{
+    // Only registration takes the lock; the values are read without it
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string out;
+    for (const auto &family : families_)
+    {
+        out += "# HELP " + family->name + " " + family->help + "\n";
+        out += "# TYPE " + family->name + " " + family->type + "\n";
+        for (const auto &series : family->series)
+        {
+            if (series->histogram)
+            {
+                const Histogram &histogram = *series->histogram;
+                uint64_t cumulative = 0;
+                for (size_t i = 0; i <= histogram.bounds().size(); i++)
+                {
+                    cumulative += histogram.bucket(i);
+                    double bound = i < histogram.bounds().size() ? histogram.bounds()[i] : INFINITY;
+                    out += series_name(family->name + "_bucket", series->labels, "le=\"" + format_value(bound) + "\"") +
+                           " " + std::to_string(cumulative) + "\n";
+                }
+                out += series_name(family->name + "_sum", series->labels) + " " +
+                       format_value(histogram.sum_seconds()) + "\n";
+                // Buckets and count are read one by one, so make them agree
+                out += series_name(family->name + "_count", series->labels) + " " +
+                       std::to_string(cumulative) + "\n";
+            }
+            else
+            {
+                double value = series->counter ? static_cast<double>(series->counter->value())
+                               : series->gauge ? static_cast<double>(series->gauge->value())
+                                               : series->read();
+                out += series_name(family->name, series->labels) + " " + format_value(value) + "\n";
+            }
+        }
+    }
+    return out;
+}
+
+MetricsServer::MetricsServer(const MetricsRegistry &registry, int port, std::function<bool()> ready)
+    : registry_(registry), ready_(std::move(ready))
+{
+    listen_fd_ = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0)
+    {
+        throw std::runtime_error(std::string("Metrics socket failed: ") + strerror(errno));
+    }
+    int on = 1;
+    int off = 0;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(listen_fd_, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+    sockaddr_in6 address{};
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(static_cast<uint16_t>(port));
+    if (bind(listen_fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(listen_fd_, 16) != 0)
+    {
+        std::string error = strerror(errno);
+        close(listen_fd_);
+        throw std::runtime_error("Cannot serve metrics on port " + std::to_string(port) + ": " + error);
+    }
+
+    stop_fd_ = eventfd(0, EFD_CLOEXEC);
+    thread_ = std::thread([this]
+                          { serve(); });
+}
+
+MetricsServer::~MetricsServer()
+{
+    uint64_t one = 1;
+    if (write(stop_fd_, &one, sizeof(one)) < 0)
+    {
+        // Nothing to do; the thread is joined either way
+    }
+    thread_.join();
+    close(stop_fd_);
+    close(listen_fd_);
+}
+
+void MetricsServer::serve()
+{
+    pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {stop_fd_, POLLIN, 0}};
+    while (true)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (fds[1].revents)
+        {
+            return;
+        }
+        int client = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client >= 0)
+        {
+            handle(client);
+            close(client);
+        }
+    }
+}
+
+void MetricsServer::handle(int client)
+{
+    // Scrapers send a short GET; the request line is all that matters
+    timeval timeout{2, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char buffer[2048];
+    ssize_t n = recv(client, buffer, sizeof(buffer) - 1, 0);
+    if (n <= 0)
+    {
+        return;
+    }
+    buffer[n] = '\0';
+
+    std::string request(buffer);
+    std::string line = request.substr(0, request.find("\r\n"));
+    std::string path;
+    if (line.rfind("GET ", 0) == 0)
+    {
+        path = line.substr(4, line.find(' ', 4) - 4);
+        path = path.substr(0, path.find('?'));
+    }
+
+    std::string status = "200 OK";
+    std::string content_type = "text/plain; version=0.0.4; charset=utf-8";
+    std::string body;
+    if (path == "/metrics")
+    {
+        body = registry_.render();
+    }
+    else if (path == "/health")
+    {
+        body = "ok\n";
+    }
+    else if (path == "/ready")
+    {
+        bool ready = !ready_ || ready_();
+        status = ready ? "200 OK" : "503 Service Unavailable";
+        body = ready ? "ready\n" : "saturated\n";
+    }
+    else
+    {
+        status = "404 Not Found";
+        body = "not found\n";
+    }
+
+    write_all(client, "HTTP/1.1 " + status + "\r\nContent-Type: " + content_type +
+                          "\r\nContent-Length: " + std::to_string(body.size()) +
+                          "\r\nConnection: close\r\n\r\n" + body);
+}
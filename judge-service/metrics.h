@@ -0,0 +1,150 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Metrics in the Prometheus text format. Updating one is a few relaxed
+// atomic increments and never takes a lock, so they can sit on the per-test
+// path. Metrics are registered up front and live as long as the registry.
+
+class Counter
+{
+public:
+    void inc(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+class Gauge
+{
+public:
+    void add(int64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+    void set(int64_t n) { value_.store(n, std::memory_order_relaxed); }
+    int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> value_{0};
+};
+
+// Latency histogram; bucket bounds are in seconds
+class Histogram
+{
+public:
+    explicit Histogram(std::vector<double> bounds);
+
+    void observe(std::chrono::nanoseconds duration);
+
+    const std::vector<double> &bounds() const { return bounds_; }
+    // Not cumulative; the last bucket is +Inf
+    uint64_t bucket(size_t i) const { return buckets_[i].load(std::memory_order_relaxed); }
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    double sum_seconds() const { return sum_ns_.load(std::memory_order_relaxed) / 1e9; }
+
+private:
+    const std::vector<double> bounds_;
+    std::vector<int64_t> bounds_ns_;
+    std::unique_ptr<std::atomic<uint64_t>[]> buckets_;
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_ns_{0};
+};
+
+class MetricsRegistry
+{
+public:
+    // 100us to 60s, roughly three per decade
+    static std::vector<double> latency_buckets();
+
+    MetricsRegistry() = default;
+    MetricsRegistry(const MetricsRegistry &) = delete;
+    MetricsRegistry &operator=(const MetricsRegistry &) = delete;
+
+    // labels is the inside of the braces, e.g. lane="contest"; metrics of
+    // one name share its help text and differ only in labels
+    Counter &counter(const std::string &name, const std::string &help, const std::string &labels = "");
+    Gauge &gauge(const std::string &name, const std::string &help, const std::string &labels = "");
+    Histogram &histogram(const std::string &name, const std::string &help, const std::string &labels = "",
+                         std::vector<double> bounds = latency_buckets());
+
+    // Read when scraped, for values another component already keeps
+    void counter_callback(const std::string &name, const std::string &help, const std::string &labels,
+                          std::function<double()> read);
+    void gauge_callback(const std::string &name, const std::string &help, const std::string &labels,
+                        std::function<double()> read);
+
+    std::string render() const;
+
+private:
+    struct Series
+    {
+        std::string labels;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+        std::function<double()> read;
+    };
+
+    struct Family
+    {
+        std::string name;
+        std::string help;
+        std::string type;
+        std::vector<std::unique_ptr<Series>> series;
+    };
+
+    Series &add(const std::string &name, const std::string &help, const std::string &type,
+                const std::string &labels);
+
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<Family>> families_;
+};
+
+// Measures a scope into a histogram
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer(Histogram &histogram) : histogram_(histogram), started_(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() { histogram_.observe(std::chrono::steady_clock::now() - started_); }
+
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+private:
+    Histogram &histogram_;
+    std::chrono::steady_clock::time_point started_;
+};
+
+// Serves GET /metrics (and /health) over plain HTTP on its own thread.
+// GET /ready answers 503 while ready, if given, returns false, and 200
+// otherwise.
+class MetricsServer
+{
+public:
+    // Throws std::runtime_error if the port can't be bound
+    MetricsServer(const MetricsRegistry &registry, int port, std::function<bool()> ready = {});
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer &) = delete;
+    MetricsServer &operator=(const MetricsServer &) = delete;
+
+private:
+    void serve();
+    void handle(int client);
+
+    const MetricsRegistry &registry_;
+    const std::function<bool()> ready_;
+    int listen_fd_ = -1;
+    int stop_fd_ = -1; // eventfd that wakes the accept loop
+    std::thread thread_;
+};
+
+#endif // METRICS_H
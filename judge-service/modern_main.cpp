@@ -1,26 +1,128 @@
 #include <iostream>
-#include <fstream>
 #include <string>
 #include <vector>
 #include <memory>
-#include <filesystem>
 #include <chrono>
 #include <thread>
 #include <exception>
+#include <csignal>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <unistd.h>
 
 #include <hiredis/hiredis.h>
 #include <libpq-fe.h>
 #include <nlohmann/json.hpp>
 
+#include "cgroup_pool.h"
+#include "checker.h"
+#include "compile_cache.h"
+#include "compile_server.h"
+#include "cpu_topology.h"
+#include "language.h"
+#include "metrics.h"
+#include "redis_connection.h"
+#include "run_pool.h"
 #include "sandbox.h"
+#include "sandbox_root.h"
+#include "scheduler.h"
+#include "test_case_cache.h"
+#include "test_history.h"
+#include "test_pack_store.h"
+#include "work_queue.h"
 
 using json = nlohmann::json;
 
+// The database couldn't be asked, as opposed to answering with something
+// that can't be judged. Worth trying again once it is back.
+struct DatabaseUnavailable : std::runtime_error
+{
+    using std::runtime_error::runtime_error;
+};
+
+// The sandbox couldn't get a program started, e.g. out of zygotes, pipes
+// or cgroup slots. Not the submission's fault, and likely passing.
+struct SandboxUnavailable : std::runtime_error
+{
+    using std::runtime_error::runtime_error;
+};
+
+// Whether a failed query is worth retrying: the connection is gone, or the
+// server is out of resources or shutting down. Anything else, a statement
+// timeout or a missing column, fails the same way next time.
+bool is_transient(PGconn *conn, const PGresult *result)
+{
+    if (PQstatus(conn) == CONNECTION_BAD)
+    {
+        return true;
+    }
+    const char *state = result ? PQresultErrorField(result, PG_DIAG_SQLSTATE) : nullptr;
+    if (!state)
+    {
+        return false;
+    }
+    std::string_view code(state);
+    return code.compare(0, 2, "08") == 0 || code.compare(0, 2, "53") == 0 || code.compare(0, 3, "57P") == 0;
+}
+
 // RAII wrapper for PostgreSQL connection
 class DatabaseConnection
 {
+public:
+    struct Statement
+    {
+        const char *name;
+        const char *sql;
+    };
+
 private:
     PGconn *conn_;
+    std::vector<Statement> statements_;
+
+    void prepare_statements()
+    {
+        // Pipelined, so setting up any number of them is one round trip
+        if (!PQenterPipelineMode(conn_))
+        {
+            throw std::runtime_error(std::string("Cannot enter pipeline mode: ") + PQerrorMessage(conn_));
+        }
+        for (const auto &statement : statements_)
+        {
+            PQsendPrepare(conn_, statement.name, statement.sql, 0, nullptr);
+        }
+        PQpipelineSync(conn_);
+
+        // Each statement's result is followed by a null, then comes the sync
+        std::string error;
+        for (size_t i = 0; i < statements_.size(); i++)
+        {
+            PGresult *result = PQgetResult(conn_);
+            if (PQresultStatus(result) != PGRES_COMMAND_OK && error.empty())
+            {
+                error = std::string(statements_[i].name) + ": " + PQresultErrorMessage(result);
+            }
+            PQclear(result);
+            PQclear(PQgetResult(conn_));
+        }
+        PQclear(PQgetResult(conn_));
+        PQexitPipelineMode(conn_);
+
+        if (!error.empty())
+        {
+            throw std::runtime_error("Failed to prepare statements: " + error);
+        }
+    }
 
 public:
     explicit DatabaseConnection(const std::string &connection_string)
@@ -67,298 +169,2056 @@ public:
     PGconn *get() const { return conn_; }
 
     bool is_valid() const { return conn_ && PQstatus(conn_) == CONNECTION_OK; }
+
+    // Prepares the statements once for this connection, and again after
+    // each reset(); run them with PQexecPrepared
+    void prepare(std::vector<Statement> statements)
+    {
+        statements_ = std::move(statements);
+        prepare_statements();
+    }
+
+    // Reconnects. Prepared statements don't survive that and are set up again.
+    void reset()
+    {
+        PQreset(conn_);
+        if (is_valid())
+        {
+            prepare_statements();
+        }
+    }
 };
 
-// RAII wrapper for Redis connection
-class RedisConnection
+// Shared compile cache tier so pods reuse each other's builds
+class RedisBinaryStore : public CompileCache::RemoteStore
 {
 private:
-    redisContext *context_;
+    RedisConnection redis_;
+    int ttl_seconds_;
+    size_t max_blob_bytes_;
+    std::mutex mutex_;
 
 public:
-    explicit RedisConnection(const std::string &host, int port)
+    RedisBinaryStore(const RedisConfig &redis, int ttl_seconds, size_t max_blob_bytes)
+        : redis_(redis), ttl_seconds_(ttl_seconds), max_blob_bytes_(max_blob_bytes) {}
+
+    bool fetch(const std::string &key, std::string &blob) override
     {
-        context_ = redisConnect(host.c_str(), port);
-        if (!context_ || context_->err)
+        std::lock_guard<std::mutex> lock(mutex_);
+        redisReply *reply = (redisReply *)redisCommand(redis_.get(), "GET compiled:%s", key.c_str());
+        bool found = reply && reply->type == REDIS_REPLY_STRING;
+        if (found)
         {
-            std::string error = context_ ? context_->errstr : "Unknown connection error";
-            if (context_)
-                redisFree(context_);
-            throw std::runtime_error("Redis connection failed: " + error);
+            blob.assign(reply->str, reply->len);
         }
+        if (reply)
+            freeReplyObject(reply);
+        return found;
     }
 
-    ~RedisConnection()
+    void store(const std::string &key, const std::string &blob) override
     {
-        if (context_)
+        if (blob.size() > max_blob_bytes_)
         {
-            redisFree(context_);
+            return;
         }
+        std::lock_guard<std::mutex> lock(mutex_);
+        redisReply *reply = (redisReply *)redisCommand(redis_.get(), "SET compiled:%s %b EX %d", key.c_str(),
+                                                       blob.data(), blob.size(), ttl_seconds_);
+        if (reply)
+            freeReplyObject(reply);
     }
+};
 
-    // Non-copyable
-    RedisConnection(const RedisConnection &) = delete;
-    RedisConnection &operator=(const RedisConnection &) = delete;
+// Reliable consumption of the submission queues, one Redis list per lane.
+// Taken entries are moved atomically into this pod's processing list for
+// their lane and only leave it once their verdict has been written. Every
+// pod keeps a heartbeat key alive; the processing lists of a pod whose
+// heartbeat has expired go back on their queues, so a crash or a scale-down
+// loses nothing.
+class SubmissionQueue
+{
+public:
+    struct Entry
+    {
+        size_t lane;
+        std::string value;
+        std::string requeue_as = {}; // what release() puts back instead, if set
+    };
 
-    // Movable
-    RedisConnection(RedisConnection &&other) noexcept : context_(other.context_)
+private:
+    static constexpr const char *kConsumersKey = "submission_consumers";
+
+    RedisConnection redis_;   // takes, dispatcher thread only
+    RedisConnection control_; // acks, heartbeats and reclaims
+    std::mutex control_mutex_;
+    const std::vector<std::string> queues_;
+    const std::string consumer_;
+    const int timeout_seconds_;
+
+    std::mutex stop_mutex_;
+    std::condition_variable stop_cv_;
+    bool stopping_ = false;
+    std::thread heartbeat_thread_;
+
+    std::string processing_key(size_t lane, const std::string &consumer) const
     {
-        other.context_ = nullptr;
+        return queues_[lane] + ":processing:" + consumer;
     }
+    static std::string heartbeat_key(const std::string &consumer) { return "submission_consumer:" + consumer; }
 
-    RedisConnection &operator=(RedisConnection &&other) noexcept
+    // Runs the commands in one round trip; the replies must be freed
+    std::vector<redisReply *> pipeline(redisContext *context, const std::vector<std::vector<std::string>> &commands)
     {
-        if (this != &other)
+        for (const auto &command : commands)
         {
-            if (context_)
-                redisFree(context_);
-            context_ = other.context_;
-            other.context_ = nullptr;
+            std::vector<const char *> argv;
+            std::vector<size_t> lengths;
+            for (const auto &arg : command)
+            {
+                argv.push_back(arg.data());
+                lengths.push_back(arg.size());
+            }
+            redisAppendCommandArgv(context, static_cast<int>(argv.size()), argv.data(), lengths.data());
         }
-        return *this;
+
+        std::vector<redisReply *> replies;
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            void *reply = nullptr;
+            if (redisGetReply(context, &reply) != REDIS_OK)
+            {
+                for (redisReply *r : replies)
+                    freeReplyObject(r);
+                throw std::runtime_error(std::string("Redis pipeline failed: ") + context->errstr);
+            }
+            replies.push_back(static_cast<redisReply *>(reply));
+        }
+        return replies;
     }
 
-    redisContext *get() const { return context_; }
+    // Moves a consumer's processing lists back onto their queues, where they
+    // are picked up before anything newer. Caller holds control_mutex_.
+    size_t requeue_locked(const std::string &consumer)
+    {
+        size_t moved = 0;
+        for (size_t lane = 0; lane < queues_.size(); lane++)
+        {
+            std::string key = processing_key(lane, consumer);
+            while (true)
+            {
+                redisReply *reply = (redisReply *)redisCommand(control_.get(), "LMOVE %s %s LEFT RIGHT", key.c_str(),
+                                                               queues_[lane].c_str());
+                bool got = reply && reply->type == REDIS_REPLY_STRING;
+                if (reply)
+                    freeReplyObject(reply);
+                if (!got)
+                    break;
+                moved++;
+            }
+        }
+        return moved;
+    }
 
-    bool is_valid() const { return context_ && !context_->err; }
-};
+    void heartbeat()
+    {
+        std::lock_guard<std::mutex> lock(control_mutex_);
+        std::vector<redisReply *> replies =
+            pipeline(control_.get(), {{"SET", heartbeat_key(consumer_), "1", "EX", std::to_string(timeout_seconds_)},
+                                      {"SADD", kConsumersKey, consumer_},
+                                      {"SMEMBERS", kConsumersKey}});
+
+        std::vector<std::string> others;
+        redisReply *members = replies[2];
+        if (members && members->type == REDIS_REPLY_ARRAY)
+        {
+            for (size_t i = 0; i < members->elements; i++)
+            {
+                std::string name(members->element[i]->str, members->element[i]->len);
+                if (name != consumer_)
+                    others.push_back(name);
+            }
+        }
+        for (redisReply *reply : replies)
+            freeReplyObject(reply);
+        if (others.empty())
+            return;
 
-struct TestCase
-{
-    int id;
-    std::string input;
-    std::string expected_output;
-};
+        std::vector<std::vector<std::string>> checks;
+        for (const auto &name : others)
+            checks.push_back({"EXISTS", heartbeat_key(name)});
+        replies = pipeline(control_.get(), checks);
 
-struct Submission
-{
-    int id;
-    int problem_id;
-    std::string source_code;
-    std::vector<TestCase> test_cases;
-};
+        for (size_t i = 0; i < others.size(); i++)
+        {
+            if (replies[i] && replies[i]->type == REDIS_REPLY_INTEGER && replies[i]->integer == 0)
+            {
+                // Several pods may do this at once; each LMOVE moves an entry exactly once
+                size_t moved = requeue_locked(others[i]);
+                freeReplyObject(redisCommand(control_.get(), "SREM %s %s", kConsumersKey, others[i].c_str()));
+                if (moved > 0)
+                {
+                    std::cout << "Requeued " << moved << " submissions left in flight by " << others[i] << std::endl;
+                }
+            }
+        }
+        for (redisReply *reply : replies)
+            freeReplyObject(reply);
+    }
 
-class ModernJudgeService
-{
-private:
-    std::unique_ptr<DatabaseConnection> db_;
-    std::unique_ptr<RedisConnection> redis_;
-    SecureSandbox::SandboxConfig sandbox_config_;
+    void heartbeat_loop()
+    {
+        // Refresh well inside the timeout so a slow round trip can't let it lapse
+        const auto interval = std::chrono::seconds(std::max(1, timeout_seconds_ / 3));
+        std::unique_lock<std::mutex> lock(stop_mutex_);
+        while (!stop_cv_.wait_for(lock, interval, [this]
+                                  { return stopping_; }))
+        {
+            lock.unlock();
+            try
+            {
+                heartbeat();
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Submission queue heartbeat failed: " << e.what() << std::endl;
+            }
+            lock.lock();
+        }
+    }
 
 public:
-    ModernJudgeService(const std::string &db_url, const std::string &redis_host, int redis_port)
+    // queues are the lanes' list keys, highest priority first
+    SubmissionQueue(const RedisConfig &redis, std::vector<std::string> queues, const std::string &consumer,
+                    int timeout_seconds)
+        : redis_(redis), control_(redis), queues_(std::move(queues)), consumer_(consumer),
+          timeout_seconds_(std::max(timeout_seconds, 3))
     {
-        // Initialize database connection
-        db_ = std::make_unique<DatabaseConnection>(db_url);
+        heartbeat();
 
-        // Initialize Redis connection
-        redis_ = std::make_unique<RedisConnection>(redis_host, redis_port);
+        // A previous run under the same name may have died mid-submission
+        size_t moved;
+        {
+            std::lock_guard<std::mutex> lock(control_mutex_);
+            moved = requeue_locked(consumer_);
+        }
+        if (moved > 0)
+        {
+            std::cout << "Requeued " << moved << " submissions left in flight by a previous run" << std::endl;
+        }
 
-        // Configure secure sandbox
-        sandbox_config_.memory_limit_mb = 256;
-        sandbox_config_.time_limit_seconds = 2;
-        sandbox_config_.enable_network = false;
-        sandbox_config_.enable_filesystem_write = false;
-        sandbox_config_.user = "nobody"; // Run as restricted user
+        heartbeat_thread_ = std::thread([this]
+                                        { heartbeat_loop(); });
     }
 
-    std::vector<TestCase> fetch_test_cases(int problem_id)
+    ~SubmissionQueue()
     {
-        const char *query = "SELECT id, input, output FROM test_cases WHERE problem_id = $1";
-        const char *param_values[] = {std::to_string(problem_id).c_str()};
-
-        PGresult *result = PQexecParams(db_->get(), query, 1, nullptr, param_values, nullptr, nullptr, 0);
-
-        if (PQresultStatus(result) != PGRES_TUPLES_OK)
         {
-            std::string error = PQerrorMessage(db_->get());
-            PQclear(result);
-            throw std::runtime_error("Failed to fetch test cases: " + error);
+            std::lock_guard<std::mutex> lock(stop_mutex_);
+            stopping_ = true;
         }
+        stop_cv_.notify_all();
+        heartbeat_thread_.join();
+    }
 
-        std::vector<TestCase> test_cases;
-        int rows = PQntuples(result);
+    SubmissionQueue(const SubmissionQueue &) = delete;
+    SubmissionQueue &operator=(const SubmissionQueue &) = delete;
 
-        for (int i = 0; i < rows; i++)
+    // Takes up to want[lane] entries from each lane without blocking, all in
+    // one round trip. Dispatcher thread only.
+    std::vector<Entry> take(const std::vector<size_t> &want)
+    {
+        std::vector<std::vector<std::string>> moves;
+        std::vector<size_t> lanes;
+        for (size_t lane = 0; lane < queues_.size() && lane < want.size(); lane++)
         {
-            TestCase tc;
-            tc.id = std::stoi(PQgetvalue(result, i, 0));
-            tc.input = PQgetvalue(result, i, 1);
-            tc.expected_output = PQgetvalue(result, i, 2);
-            test_cases.push_back(tc);
+            for (size_t i = 0; i < want[lane]; i++)
+            {
+                moves.push_back({"LMOVE", queues_[lane], processing_key(lane, consumer_), "RIGHT", "LEFT"});
+                lanes.push_back(lane);
+            }
         }
 
-        PQclear(result);
-        return test_cases;
+        std::vector<Entry> entries;
+        if (moves.empty())
+            return entries;
+        std::vector<redisReply *> replies = pipeline(redis_.get(), moves);
+        for (size_t i = 0; i < replies.size(); i++)
+        {
+            if (replies[i] && replies[i]->type == REDIS_REPLY_STRING)
+                entries.push_back({lanes[i], std::string(replies[i]->str, replies[i]->len)});
+            freeReplyObject(replies[i]);
+        }
+        return entries;
     }
 
-    Submission fetch_submission(int submission_id)
+    // Blocks until an entry arrives on lane or timeout passes. There is no
+    // atomic blocking move from several lists, so the dispatcher waits on
+    // the top lane and polls the others in between.
+    std::vector<Entry> wait(size_t lane, std::chrono::milliseconds timeout)
     {
-        const char *query = "SELECT id, problem_id, source_code FROM submissions WHERE id = $1";
-        const char *param_values[] = {std::to_string(submission_id).c_str()};
-
-        PGresult *result = PQexecParams(db_->get(), query, 1, nullptr, param_values, nullptr, nullptr, 0);
-
-        if (PQresultStatus(result) != PGRES_TUPLES_OK || PQntuples(result) == 0)
+        std::string seconds = std::to_string(timeout.count() / 1000.0);
+        std::string processing = processing_key(lane, consumer_);
+        redisReply *reply = (redisReply *)redisCommand(redis_.get(), "BLMOVE %s %s RIGHT LEFT %s",
+                                                       queues_[lane].c_str(), processing.c_str(), seconds.c_str());
+        if (!reply)
         {
-            PQclear(result);
-            throw std::runtime_error("Submission not found");
+            throw std::runtime_error(std::string("Redis pop failed: ") + redis_.get()->errstr);
         }
 
-        Submission submission;
-        submission.id = std::stoi(PQgetvalue(result, 0, 0));
-        submission.problem_id = std::stoi(PQgetvalue(result, 0, 1));
-        submission.source_code = PQgetvalue(result, 0, 2);
+        std::vector<Entry> entries;
+        if (reply->type == REDIS_REPLY_STRING)
+            entries.push_back({lane, std::string(reply->str, reply->len)});
+        freeReplyObject(reply);
+        return entries;
+    }
 
-        PQclear(result);
+    // Marks entries as done; safe to call from any thread
+    void ack(const std::vector<Entry> &entries)
+    {
+        if (entries.empty())
+            return;
 
-        // Fetch test cases
-        submission.test_cases = fetch_test_cases(submission.problem_id);
+        std::vector<std::vector<std::string>> removes;
+        for (const auto &entry : entries)
+            removes.push_back({"LREM", processing_key(entry.lane, consumer_), "1", entry.value});
 
-        return submission;
+        std::lock_guard<std::mutex> lock(control_mutex_);
+        try
+        {
+            for (redisReply *reply : pipeline(control_.get(), removes))
+                freeReplyObject(reply);
+        }
+        catch (const std::exception &e)
+        {
+            // They stay in flight and are judged again should this pod die
+            std::cerr << "Failed to ack " << entries.size() << " submissions: " << e.what() << std::endl;
+        }
     }
 
-    bool compile_submission(const Submission &submission, const std::string &executable_path)
+    // Puts entries taken but not started back on their queues, where they
+    // are taken next, by whichever pod is first; safe to call from any
+    // thread. Pushed before they leave the processing list, so a crash in
+    // between judges one twice rather than never.
+    void release(const std::vector<Entry> &entries)
     {
-        // Create temporary source file
-        std::string source_path = "/tmp/submission_" + std::to_string(submission.id) + ".cpp";
+        if (entries.empty())
+            return;
 
-        std::ofstream source_file(source_path);
-        if (!source_file)
+        std::vector<std::vector<std::string>> moves;
+        for (const auto &entry : entries)
         {
-            return false;
+            moves.push_back({"RPUSH", queues_[entry.lane], entry.requeue_as.empty() ? entry.value : entry.requeue_as});
+            moves.push_back({"LREM", processing_key(entry.lane, consumer_), "1", entry.value});
         }
-        source_file << submission.source_code;
-        source_file.close();
 
-        // Compile with timeout and resource limits
-        SecureSandbox compiler_sandbox(sandbox_config_);
-        SecureSandbox::SandboxResult result = compiler_sandbox.execute(
-            "/usr/bin/g++",
-            source_path + " -o " + executable_path + " -std=c++17 -O2");
+        std::lock_guard<std::mutex> lock(control_mutex_);
+        for (redisReply *reply : pipeline(control_.get(), moves))
+            freeReplyObject(reply);
+    }
+};
+
+struct Submission
+{
+    int id;
+    int problem_id;
+    long test_version;
+    std::string source_code;
+    std::string language;
+    std::string checker;        // checker spec; empty for the default
+    std::string checker_source; // source of a "custom" checker
+    TestCaseCache::Handle test_cases;
+};
+
+struct Judgement
+{
+    std::string verdict;
+    long time_ms = -1;   // slowest test's CPU time; -1 if nothing ran
+    long memory_kb = -1; // largest peak RSS of any test
+};
 
-        // Clean up source file
-        std::filesystem::remove(source_path);
+// Handed from the stage that fetches and compiles a submission to the one
+// that runs it. A verdict already reached, like Compilation Error, skips
+// the runs.
+struct PreparedSubmission
+{
+    Submission submission;
+    std::shared_ptr<const Checker> checker;
+    CompileCache::Lease binary;
+    std::optional<Judgement> judgement;
+};
 
-        return result.exit_code == 0;
-    }
+// A language the judge accepts, with a sandbox per run slot set up for its
+// runtime
+struct Runtime
+{
+    std::shared_ptr<const LanguageProfile> language;
+    std::vector<std::unique_ptr<SecureSandbox>> sandboxes;
+};
 
-    std::string determine_verdict(const SecureSandbox::SandboxResult &result, const std::string &expected_output)
+// Custom checkers are C++ whatever the submissions are written in
+constexpr const char *kCheckerLanguage = "cpp";
+
+// What one test run cost; setup_us stays -1 for tests that were skipped
+// or cancelled
+struct RunStats
+{
+    long setup_us = -1;
+    long cpu_us = 0;
+    long memory_kb = 0;
+};
+
+// Everything /metrics reports. Registered up front; the hot paths only
+// touch atomics.
+class JudgeMetrics
+{
+private:
+    static constexpr const char *kVerdicts[] = {"Accepted", "Wrong Answer", "Time Limit Exceeded",
+                                                "Memory Limit Exceeded", "Output Limit Exceeded", "Runtime Error",
+                                                "Compilation Error", "Judge Error"};
+
+    std::vector<Counter *> verdicts_;
+    std::vector<Histogram *> queue_wait_;
+
+public:
+    MetricsRegistry registry;
+    Histogram &db_fetch;
+    Histogram &compile;
+    Histogram &sandbox_setup;
+    Histogram &test_run;
+    Histogram &verdict_write;
+    Counter &tests_skipped;
+    Gauge &busy_workers;
+    Counter busy_ns; // exported in seconds
+
+    JudgeMetrics(const std::vector<std::string> &lanes, size_t worker_count)
+        : db_fetch(registry.histogram("judge_db_fetch_seconds", "Loading a submission and its test cases")),
+          compile(registry.histogram("judge_compile_seconds", "Compiles that missed the cache")),
+          sandbox_setup(registry.histogram("judge_sandbox_setup_seconds",
+                                           "From execute() until a sandboxed process had the program")),
+          test_run(registry.histogram("judge_test_run_seconds", "Wall-clock time of one test run")),
+          verdict_write(registry.histogram("judge_verdict_write_seconds", "One batched verdict UPDATE")),
+          tests_skipped(registry.counter("judge_tests_skipped_total",
+                                         "Tests not run, or cancelled, once an earlier one had failed")),
+          busy_workers(registry.gauge("judge_workers_busy", "Workers judging a submission right now"))
     {
-        if (result.timeout)
+        for (const auto &lane : lanes)
         {
-            return "Time Limit Exceeded";
+            queue_wait_.push_back(&registry.histogram("judge_queue_wait_seconds", "From enqueue until a worker took it",
+                                                      "lane=\"" + lane + "\""));
         }
-
-        if (result.memory_exceeded)
+        for (const char *verdict : kVerdicts)
         {
-            return "Memory Limit Exceeded";
+            verdicts_.push_back(&registry.counter("judge_verdicts_total", "Verdicts by type",
+                                                  std::string("verdict=\"") + verdict + "\""));
         }
+        registry.gauge("judge_workers", "Configured workers").set(static_cast<int64_t>(worker_count));
+        // Utilization is its rate over judge_workers
+        registry.counter_callback("judge_worker_busy_seconds_total", "Time workers spent judging", "", [this]
+                                  { return busy_ns.value() / 1e9; });
+    }
 
-        if (result.signal_killed || result.exit_code != 0)
+    Histogram &queue_wait(size_t lane) { return *queue_wait_[std::min(lane, queue_wait_.size() - 1)]; }
+
+    void count_verdict(const std::string &verdict)
+    {
+        for (size_t i = 0; i < verdicts_.size(); i++)
         {
-            return "Runtime Error";
+            if (verdict == kVerdicts[i])
+            {
+                verdicts_[i]->inc();
+                return;
+            }
         }
-
-        // Normalize output for comparison
-        std::string actual_output = result.output;
-        std::string expected = expected_output;
-
-        // Remove trailing whitespace
-        actual_output.erase(actual_output.find_last_not_of(" \n\r\t") + 1);
-        expected.erase(expected.find_last_not_of(" \n\r\t") + 1);
-
-        return (actual_output == expected) ? "Accepted" : "Wrong Answer";
+        verdicts_.back()->inc();
     }
+};
 
-    std::string judge_submission(const Submission &submission)
+// Writes the verdicts of every worker on a connection of its own. Whatever
+// finished while the previous write was in flight goes out together as one
+// multi-row UPDATE, so at peak a single round trip settles many submissions
+// and workers never wait for the database to move on.
+class VerdictWriter
+{
+private:
+    DatabaseConnection db_;
+    Histogram &write_latency_;
+    const size_t max_batch_;
+    const std::function<void(const std::vector<int> &)> on_written_;
+    const std::function<void(const std::vector<int> &)> on_failed_;
+    std::mutex mutex_;
+    std::condition_variable pending_cv_;
+    std::vector<std::pair<int, Judgement>> pending_;
+    bool stopping_ = false;
+    std::thread thread_;
+
+    static constexpr std::chrono::seconds kRetryDelay{1};
+
+    static std::string quote(const std::string &value)
     {
-        std::string executable_path = "/tmp/submission_" + std::to_string(submission.id);
+        std::string quoted = "\"";
+        for (char c : value)
+        {
+            if (c == '"' || c == '\\')
+                quoted += '\\';
+            quoted += c;
+        }
+        return quoted + "\"";
+    }
 
-        try
+    // The batch travels as four parallel arrays in text form. False if
+    // nothing was written.
+    bool write_rows(const std::vector<std::pair<int, Judgement>> &batch)
+    {
+        std::string ids = "{", verdicts = "{", times = "{", memories = "{";
+        for (size_t i = 0; i < batch.size(); i++)
         {
-            // Compile the submission
-            if (!compile_submission(submission, executable_path))
+            const char *separator = i ? "," : "";
+            const Judgement &judgement = batch[i].second;
+            ids += separator + std::to_string(batch[i].first);
+            verdicts += separator + quote(judgement.verdict);
+            times += separator + (judgement.time_ms >= 0 ? std::to_string(judgement.time_ms) : "NULL");
+            memories += separator + (judgement.memory_kb >= 0 ? std::to_string(judgement.memory_kb) : "NULL");
+        }
+        ids += "}";
+        verdicts += "}";
+        times += "}";
+        memories += "}";
+        const char *param_values[] = {ids.c_str(), verdicts.c_str(), times.c_str(), memories.c_str()};
+        ScopedTimer timer(write_latency_);
+
+        // One reconnect if the connection dropped under us
+        std::string error;
+        for (int attempt = 0; attempt < 2; attempt++)
+        {
+            try
             {
-                return "Compilation Error";
+                if (!db_.is_valid())
+                {
+                    db_.reset();
+                }
             }
-
-            // Run against test cases
-            SecureSandbox sandbox(sandbox_config_);
-
-            for (const auto &test_case : submission.test_cases)
+            catch (const std::exception &e)
             {
-                auto result = sandbox.execute(executable_path, test_case.input);
-                std::string verdict = determine_verdict(result, test_case.expected_output);
+                error = e.what();
+                continue;
+            }
 
-                if (verdict != "Accepted")
-                {
-                    std::filesystem::remove(executable_path);
-                    return verdict;
-                }
+            PGresult *result = PQexecPrepared(db_.get(), "update_verdicts", 4, param_values, nullptr, nullptr, 0);
+            bool ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+            if (!ok)
+            {
+                error = PQerrorMessage(db_.get());
             }
+            PQclear(result);
+            if (ok)
+            {
+                return true;
+            }
+        }
+        std::cerr << "Failed to update " << batch.size() << " verdicts: " << error << std::endl;
+        return false;
+    }
 
-            std::filesystem::remove(executable_path);
-            return "Accepted";
+    // Sorts the batch's submissions into written and failed. One bad row
+    // fails the whole UPDATE, so a failed batch is tried a row at a time
+    // while the connection is still up.
+    void write(const std::vector<std::pair<int, Judgement>> &batch, std::vector<int> &written,
+               std::vector<int> &failed)
+    {
+        if (write_rows(batch))
+        {
+            for (const auto &entry : batch)
+                written.push_back(entry.first);
+            return;
         }
-        catch (const std::exception &e)
+        for (const auto &entry : batch)
         {
-            std::filesystem::remove(executable_path);
-            std::cerr << "Judge error: " << e.what() << std::endl;
-            return "Judge Error";
+            bool ok = batch.size() > 1 && db_.is_valid() && write_rows({entry});
+            (ok ? written : failed).push_back(entry.first);
         }
     }
 
-    void update_verdict(int submission_id, const std::string &verdict)
+    void run()
     {
-        const char *query = "UPDATE submissions SET verdict = $1, judged_at = NOW() WHERE id = $2";
-        const char *param_values[] = {verdict.c_str(), std::to_string(submission_id).c_str()};
-
-        PGresult *result = PQexecParams(db_->get(), query, 2, nullptr, param_values, nullptr, nullptr, 0);
-
-        if (PQresultStatus(result) != PGRES_COMMAND_OK)
+        std::unique_lock<std::mutex> lock(mutex_);
+        bool backing_off = false;
+        while (true)
         {
-            std::string error = PQerrorMessage(db_->get());
-            PQclear(result);
-            throw std::runtime_error("Failed to update verdict: " + error);
+            // After a failed write, gives the database a moment unless stopping
+            if (backing_off)
+            {
+                pending_cv_.wait_for(lock, kRetryDelay, [this]
+                                     { return stopping_; });
+            }
+            pending_cv_.wait(lock, [this]
+                             { return stopping_ || !pending_.empty(); });
+            if (pending_.empty())
+            {
+                return;
+            }
+
+            // An UPDATE ... FROM applies only one of several rows for the
+            // same id, so a rejudge's verdict waits for the batch after its
+            // predecessor's. Both are written, in order, and acked apart.
+            std::vector<std::pair<int, Judgement>> batch;
+            std::vector<std::pair<int, Judgement>> later;
+            std::unordered_set<int> batched;
+            for (auto &entry : pending_)
+            {
+                if (batch.size() < max_batch_ && batched.insert(entry.first).second)
+                    batch.push_back(std::move(entry));
+                else
+                    later.push_back(std::move(entry));
+            }
+            pending_.swap(later);
+
+            lock.unlock();
+            std::vector<int> written, failed;
+            write(batch, written, failed);
+            if (!written.empty())
+                on_written_(written);
+            if (!failed.empty())
+                on_failed_(failed);
+            backing_off = !failed.empty();
+            lock.lock();
         }
+    }
 
-        PQclear(result);
+public:
+    // Called on the writer thread with each batch's submissions: on_written
+    // with those whose verdicts are stored, on_failed with those that
+    // couldn't be written even on their own, whose verdicts are gone
+    VerdictWriter(const std::string &db_url, size_t max_batch, Histogram &write_latency,
+                  std::function<void(const std::vector<int> &)> on_written,
+                  std::function<void(const std::vector<int> &)> on_failed)
+        : db_(db_url), write_latency_(write_latency), max_batch_(std::max<size_t>(max_batch, 1)),
+          on_written_(std::move(on_written)), on_failed_(std::move(on_failed))
+    {
+        db_.prepare({{"update_verdicts",
+                      "UPDATE submissions AS s SET verdict = v.verdict, time_ms = v.time_ms, "
+                      "memory_kb = v.memory_kb, judged_at = NOW() "
+                      "FROM unnest($1::int[], $2::text[], $3::int[], $4::int[]) AS v(id, verdict, time_ms, memory_kb) "
+                      "WHERE s.id = v.id"}});
+        thread_ = std::thread([this]
+                              { run(); });
     }
 
-    void process_submission_queue()
+    // Writes out everything still pending
+    ~VerdictWriter()
     {
-        while (true)
         {
-            try
-            {
-                // Block and wait for submission from Redis queue
-                redisReply *reply = (redisReply *)redisCommand(redis_->get(), "BRPOP submission_queue 0");
-
-                if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2)
-                {
-                    if (reply)
-                        freeReplyObject(reply);
-                    continue;
-                }
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        pending_cv_.notify_all();
+        thread_.join();
+    }
 
-                int submission_id = std::stoi(reply->element[1]->str);
-                freeReplyObject(reply);
+    VerdictWriter(const VerdictWriter &) = delete;
+    VerdictWriter &operator=(const VerdictWriter &) = delete;
 
-                std::cout << "Processing submission " << submission_id << std::endl;
+    void submit(int submission_id, const Judgement &judgement)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.emplace_back(submission_id, judgement);
+        }
+        pending_cv_.notify_one();
+    }
+};
 
-                // Fetch and judge submission
-                Submission submission = fetch_submission(submission_id);
-                std::string verdict = judge_submission(submission);
+// Publishes judging progress as JSON on <prefix>:<submission id>, so
+// clients see each test as it finishes instead of polling the database.
+// Best effort: events are sent in the background, pipelined, and dropped
+// while Redis is unreachable or too far behind. The verdict itself only
+// ever comes from the database.
+class ProgressPublisher
+{
+private:
+    const RedisConfig redis_config_;
+    const std::string prefix_;
+    std::unique_ptr<RedisConnection> redis_;
+    std::mutex mutex_;
+    std::condition_variable pending_cv_;
+    std::vector<std::pair<int, std::string>> pending_;
+    bool stopping_ = false;
+    std::thread thread_;
 
-                // Update database with verdict
-                update_verdict(submission_id, verdict);
+    static constexpr size_t kMaxPending = 10000;
 
-                std::cout << "Submission " << submission_id << " judged: " << verdict << std::endl;
+    bool connect()
+    {
+        if (redis_ && redis_->is_valid())
+        {
+            return true;
+        }
+        try
+        {
+            redis_ = std::make_unique<RedisConnection>(redis_config_);
+            return true;
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Progress events dropped: " << e.what() << std::endl;
+            redis_.reset();
+            return false;
+        }
+    }
+
+    void send(const std::vector<std::pair<int, std::string>> &events)
+    {
+        if (!connect())
+        {
+            // Retried with later events, not these
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            return;
+        }
+        for (const auto &event : events)
+        {
+            std::string channel = prefix_ + ":" + std::to_string(event.first);
+            redisAppendCommand(redis_->get(), "PUBLISH %b %b", channel.data(), channel.size(), event.second.data(),
+                               event.second.size());
+        }
+        for (size_t i = 0; i < events.size(); i++)
+        {
+            void *reply = nullptr;
+            if (redisGetReply(redis_->get(), &reply) != REDIS_OK)
+            {
+                break;
+            }
+            freeReplyObject(reply);
+        }
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true)
+        {
+            pending_cv_.wait(lock, [this]
+                             { return stopping_ || !pending_.empty(); });
+            if (stopping_)
+            {
+                return;
+            }
+            std::vector<std::pair<int, std::string>> events;
+            events.swap(pending_);
+            lock.unlock();
+            send(events);
+            lock.lock();
+        }
+    }
+
+public:
+    ProgressPublisher(const RedisConfig &redis, const std::string &prefix)
+        : redis_config_(redis), prefix_(prefix)
+    {
+        thread_ = std::thread([this]
+                              { run(); });
+    }
+
+    // Whatever is still pending is dropped
+    ~ProgressPublisher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        pending_cv_.notify_all();
+        thread_.join();
+    }
+
+    ProgressPublisher(const ProgressPublisher &) = delete;
+    ProgressPublisher &operator=(const ProgressPublisher &) = delete;
+
+    // Never blocks on Redis; safe to call from run slots
+    void publish(int submission_id, const json &event)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (pending_.size() >= kMaxPending)
+            {
+                return;
+            }
+            pending_.emplace_back(submission_id, event.dump());
+        }
+        pending_cv_.notify_one();
+    }
+};
+
+// Judges one submission at a time with its own database connection, so any
+// number of workers can run side by side without sharing libpq state.
+class JudgeWorker
+{
+private:
+    int worker_id_;
+    std::unique_ptr<DatabaseConnection> db_;
+    SecureSandbox::SandboxConfig sandbox_config_;
+    RunPool &run_pool_;
+    const std::unordered_map<std::string, Runtime> &runtimes_;
+    SecureSandbox *checker_sandbox_; // nullptr if custom checkers can't be run
+    CompileCache &compile_cache_;
+    CompileServer &compile_server_;
+    TestCaseCache &test_case_cache_;
+    TestPackStore *test_packs_; // nullptr loads every miss from the database
+    TestHistory *test_history_; // nullptr keeps database order
+    VerdictWriter &verdict_writer_;
+    ProgressPublisher *progress_; // nullptr publishes nothing
+    Scheduler &scheduler_;
+    JudgeMetrics &metrics_;
+    std::function<void(const std::vector<int> &)> retry_; // hands submissions back to be judged later
+    std::shared_ptr<const Checker> default_checker_;
+
+public:
+    JudgeWorker(int worker_id, const std::string &db_url, const SecureSandbox::SandboxConfig &sandbox_config,
+                RunPool &run_pool, const std::unordered_map<std::string, Runtime> &runtimes,
+                SecureSandbox *checker_sandbox, CompileCache &compile_cache, CompileServer &compile_server, TestCaseCache &test_case_cache,
+                TestPackStore *test_packs, TestHistory *test_history,
+                VerdictWriter &verdict_writer, ProgressPublisher *progress, Scheduler &scheduler,
+                JudgeMetrics &metrics, std::function<void(const std::vector<int> &)> retry,
+                std::shared_ptr<const Checker> default_checker)
+        : worker_id_(worker_id), sandbox_config_(sandbox_config), run_pool_(run_pool), runtimes_(runtimes),
+          checker_sandbox_(checker_sandbox), compile_cache_(compile_cache), compile_server_(compile_server), test_case_cache_(test_case_cache),
+          test_packs_(test_packs), test_history_(test_history),
+          verdict_writer_(verdict_writer), progress_(progress),
+          scheduler_(scheduler), metrics_(metrics), retry_(std::move(retry)), default_checker_(std::move(default_checker))
+    {
+        db_ = std::make_unique<DatabaseConnection>(db_url);
+        // The problem's test_version and checker ride along with the
+        // submission, so a test cache hit costs a single round trip
+        db_->prepare({{"fetch_submission",
+                       "SELECT s.id, s.problem_id, s.source_code, COALESCE(p.test_version, 0), "
+                       "p.checker, p.checker_source, s.language "
+                       "FROM submissions s LEFT JOIN problems p ON p.id = s.problem_id WHERE s.id = $1"},
+                      {"fetch_test_cases", "SELECT id, input, output FROM test_cases WHERE problem_id = $1 ORDER BY id"}});
+    }
+
+    // Streamed a row at a time in binary, so libpq never holds more than
+    // one test: each input goes straight into its memfd and each expected
+    // output into the set's arena
+    TestSet fetch_test_cases(int problem_id)
+    {
+        std::string problem_id_str = std::to_string(problem_id);
+        const char *param_values[] = {problem_id_str.c_str()};
+
+        PGconn *conn = db_->get();
+        if (!PQsendQueryPrepared(conn, "fetch_test_cases", 1, param_values, nullptr, nullptr, 1))
+        {
+            std::string error = std::string("Failed to fetch test cases: ") + PQerrorMessage(conn);
+            if (is_transient(conn, nullptr))
+                throw DatabaseUnavailable(error);
+            throw std::runtime_error(error);
+        }
+        PQsetSingleRowMode(conn);
+
+        // Every result is read, even after an error, so the connection is
+        // ready for the next query
+        TestSet test_cases;
+        OutputArena outputs;
+        std::string error;
+        bool unavailable = false;
+        while (PGresult *result = PQgetResult(conn))
+        {
+            ExecStatusType status = PQresultStatus(result);
+            if (status == PGRES_SINGLE_TUPLE && error.empty())
+            {
+                try
+                {
+                    test_cases.push_back(test_case_from_row(result, outputs));
+                }
+                catch (const std::exception &e)
+                {
+                    error = e.what();
+                }
+            }
+            else if (status != PGRES_SINGLE_TUPLE && status != PGRES_TUPLES_OK && error.empty())
+            {
+                error = PQresultErrorMessage(result);
+                unavailable = is_transient(conn, result);
+            }
+            PQclear(result);
+        }
+
+        if (unavailable)
+        {
+            throw DatabaseUnavailable("Failed to fetch test cases: " + error);
+        }
+        if (!error.empty())
+        {
+            throw std::runtime_error("Failed to fetch test cases: " + error);
+        }
+        return test_cases;
+    }
+
+    static TestCase test_case_from_row(const PGresult *row, OutputArena &outputs)
+    {
+        // The id comes as an int4 in network byte order, text as its bytes
+        uint32_t id;
+        if (PQgetlength(row, 0, 0) != sizeof(id))
+        {
+            throw std::runtime_error("unexpected test case id format");
+        }
+        std::memcpy(&id, PQgetvalue(row, 0, 0), sizeof(id));
+
+        TestCase tc;
+        tc.id = static_cast<int>(ntohl(id));
+        tc.input = InputFile::create(std::string_view(PQgetvalue(row, 0, 1), PQgetlength(row, 0, 1)));
+        outputs.add(tc, PQgetvalue(row, 0, 2), PQgetlength(row, 0, 2));
+        return tc;
+    }
+
+    // From this node's pack when any judge here has loaded the version
+    // before, otherwise from the database, leaving a pack for the next
+    TestSet load_test_cases(int problem_id, long version)
+    {
+        if (test_packs_)
+        {
+            if (std::optional<TestSet> tests = test_packs_->load(problem_id, version))
+            {
+                return std::move(*tests);
+            }
+        }
+        TestSet tests = fetch_test_cases(problem_id);
+        if (test_packs_ && !test_packs_->save(problem_id, version, tests))
+        {
+            std::cerr << "[worker " << worker_id_ << "] Could not write the test pack of problem " << problem_id
+                      << std::endl;
+        }
+        return tests;
+    }
+
+    Submission fetch_submission(int submission_id)
+    {
+        std::string submission_id_str = std::to_string(submission_id);
+        const char *param_values[] = {submission_id_str.c_str()};
+
+        PGresult *result = PQexecPrepared(db_->get(), "fetch_submission", 1, param_values, nullptr, nullptr, 0);
+
+        if (PQresultStatus(result) != PGRES_TUPLES_OK)
+        {
+            std::string error = "Failed to fetch submission: " + std::string(PQresultErrorMessage(result));
+            bool transient = is_transient(db_->get(), result);
+            PQclear(result);
+            if (transient)
+                throw DatabaseUnavailable(error);
+            throw std::runtime_error(error);
+        }
+        if (PQntuples(result) == 0)
+        {
+            PQclear(result);
+            throw std::runtime_error("Submission not found");
+        }
+
+        Submission submission;
+        submission.id = std::stoi(PQgetvalue(result, 0, 0));
+        submission.problem_id = std::stoi(PQgetvalue(result, 0, 1));
+        submission.source_code = PQgetvalue(result, 0, 2);
+        submission.test_version = std::stol(PQgetvalue(result, 0, 3));
+        if (!PQgetisnull(result, 0, 4))
+            submission.checker = PQgetvalue(result, 0, 4);
+        if (!PQgetisnull(result, 0, 5))
+            submission.checker_source = PQgetvalue(result, 0, 5);
+        submission.language = PQgetvalue(result, 0, 6);
+
+        PQclear(result);
+        return submission;
+    }
+
+    const Runtime &runtime(const std::string &language)
+    {
+        auto it = runtimes_.find(language);
+        if (it == runtimes_.end())
+        {
+            throw std::runtime_error("Language '" + language + "' is not enabled");
+        }
+        return it->second;
+    }
+
+    // Compiles source, or reuses an identical earlier build
+    CompileCache::Lease compile_cached(const LanguageProfile &language, const std::string &source_code)
+    {
+        return compile_cache_.acquire(CompileServer::cache_key(language, source_code),
+                                      [&](const std::string &output_path)
+                                      {
+                                          // Only reached on a cache miss, so this times real compiles
+                                          ScopedTimer timer(metrics_.compile);
+                                          CompileServer::Result result =
+                                              compile_server_.compile(language, source_code, output_path);
+                                          if (result.setup_failed)
+                                          {
+                                              throw SandboxUnavailable("Compile failed to run: " + result.diagnostics);
+                                          }
+                                          return result.ok;
+                                      });
+    }
+
+    // Custom checkers are compiled through the same cache as submissions
+    std::shared_ptr<const Checker> load_checker(const Submission &submission)
+    {
+        if (submission.checker.empty())
+        {
+            return default_checker_;
+        }
+
+        if (submission.checker == "custom")
+        {
+            CompileCache::Lease binary =
+                compile_cached(*runtime(kCheckerLanguage).language, submission.checker_source);
+            if (!binary)
+            {
+                throw std::runtime_error("Checker for problem " + std::to_string(submission.problem_id) +
+                                         " failed to compile");
+            }
+
+            if (!checker_sandbox_)
+            {
+                throw std::runtime_error("Custom checker for problem " + std::to_string(submission.problem_id) +
+                                         " needs the sandbox root");
+            }
+            return make_custom_checker(std::move(binary), *checker_sandbox_);
+        }
+
+        auto checker = make_builtin_checker(submission.checker);
+        if (!checker)
+        {
+            throw std::runtime_error("Unknown checker '" + submission.checker + "' for problem " +
+                                     std::to_string(submission.problem_id));
+        }
+        return checker;
+    }
+
+    std::string determine_verdict(const SecureSandbox::SandboxResult &result, CheckSession &check)
+    {
+        // The program never ran, so there is nothing to judge it on
+        if (result.setup_failed)
+        {
+            return "Judge Error";
+        }
+
+        // Killed by us on the first wrong byte, whatever it would have done next
+        if (result.output_rejected)
+        {
+            return "Wrong Answer";
+        }
+
+        if (result.timeout)
+        {
+            return "Time Limit Exceeded";
+        }
+
+        if (result.memory_exceeded)
+        {
+            return "Memory Limit Exceeded";
+        }
+
+        if (result.output_limit_exceeded)
+        {
+            return "Output Limit Exceeded";
+        }
+
+        if (result.signal_killed || result.exit_code != 0)
+        {
+            return "Runtime Error";
+        }
+
+        switch (check.finish())
+        {
+        case CheckResult::Accepted:
+            return "Accepted";
+        case CheckResult::WrongAnswer:
+            return "Wrong Answer";
+        default:
+            return "Judge Error";
+        }
+    }
+
+    // Per-test cost of getting a program started in the sandbox, i.e. what
+    // the zygote pool saves
+    void log_setup_overhead(int submission_id, const std::vector<RunStats> &stats)
+    {
+        long total = 0;
+        long runs = 0;
+        for (const auto &run : stats)
+        {
+            if (run.setup_us >= 0)
+            {
+                total += run.setup_us;
+                runs++;
+            }
+        }
+        if (runs > 0)
+        {
+            std::cout << "[worker " << worker_id_ << "] Submission " << submission_id << ": " << runs
+                      << " runs, avg sandbox setup " << total / runs << "us" << std::endl;
+        }
+    }
+
+    // Compiles on a thread of its own; the build needs nothing but the
+    // source, so it doesn't have to wait for the test cases. The future's
+    // destructor waits for the compile, so submission outlives it and the
+    // source is not copied.
+    std::future<CompileCache::Lease> compile_async(const Submission &submission)
+    {
+        return std::async(std::launch::async, [this, &submission]
+                          { return compile_cached(*runtime(submission.language).language, submission.source_code); });
+    }
+
+    Judgement judge_submission(const PreparedSubmission &prepared)
+    {
+        if (prepared.judgement)
+        {
+            return *prepared.judgement;
+        }
+        try
+        {
+            const Submission &submission = prepared.submission;
+            const Checker &checker = *prepared.checker;
+            const CompileCache::Lease &binary = prepared.binary;
+            const Runtime &runtime = this->runtime(submission.language);
+
+            // Run the test cases in parallel on the shared run slots, those
+            // that have failed most per millisecond first. The lowest failing
+            // index is reported whatever the order.
+            const TestSet &test_cases = *submission.test_cases;
+            std::vector<std::string> verdicts(test_cases.size());
+            std::vector<RunStats> stats(test_cases.size());
+            std::vector<char> setup_failed(test_cases.size());
+            std::vector<size_t> order;
+            if (test_history_)
+            {
+                order = test_history_->order(submission.problem_id, submission.test_version, test_cases);
+            }
+            std::atomic<size_t> completed{0};
+            size_t failed = run_pool_.run_until_failure(
+                test_cases.size(),
+                [&](size_t index, size_t slot, CancellationToken &cancel)
+                {
+                    try
+                    {
+                        const TestCase &test_case = test_cases[index];
+
+                        // Output is checked as it arrives rather than buffered
+                        std::unique_ptr<CheckSession> check = checker.start(test_case);
+                        auto result = runtime.sandboxes[slot]->execute(binary->path, *test_case.input, &cancel,
+                                                                       [&](const char *data, size_t size)
+                                                                       { return check->feed(data, size); });
+                        setup_failed[index] = result.setup_failed;
+                        verdicts[index] = determine_verdict(result, *check);
+                        // Neither says anything about the program or the test
+                        if (result.cancelled || result.setup_failed)
+                        {
+                            return false;
+                        }
+
+                        metrics_.sandbox_setup.observe(result.setup_time);
+                        metrics_.test_run.observe(result.wall_time);
+                        stats[index] = {result.setup_time.count(), static_cast<long>(result.cpu_time.count()),
+                                        static_cast<long>(result.peak_memory_kb)};
+                        if (test_history_)
+                        {
+                            test_history_->record(submission.problem_id, submission.test_version, test_case.id,
+                                                  verdicts[index] != "Accepted", result.wall_time);
+                        }
+                        // Tests finish out of order; index is the test's place in the set
+                        if (progress_)
+                        {
+                            progress_->publish(submission.id, {{"event", "test"},
+                                                               {"index", index},
+                                                               {"completed", ++completed},
+                                                               {"total", test_cases.size()},
+                                                               {"verdict", verdicts[index]},
+                                                               {"time_ms", stats[index].cpu_us / 1000},
+                                                               {"memory_kb", stats[index].memory_kb}});
+                        }
+                        return verdicts[index] == "Accepted";
+                    }
+                    catch (const std::exception &e)
+                    {
+                        // The judge's fault, so never a verdict against the program
+                        std::cerr << "[worker " << worker_id_ << "] Test " << index << " of submission "
+                                  << submission.id << ": " << e.what() << std::endl;
+                        verdicts[index] = "Judge Error";
+                        return false;
+                    }
+                },
+                order);
+            metrics_.tests_skipped.inc(std::count_if(stats.begin(), stats.end(), [](const RunStats &run)
+                                                     { return run.setup_us < 0; }));
+            log_setup_overhead(submission.id, stats);
+            if (failed < verdicts.size() && setup_failed[failed])
+            {
+                throw SandboxUnavailable("Sandbox failed to start test " + std::to_string(failed));
+            }
+
+            Judgement judgement{failed < verdicts.size() ? verdicts[failed] : "Accepted"};
+            for (const auto &run : stats)
+            {
+                if (run.setup_us >= 0)
+                {
+                    judgement.time_ms = std::max(judgement.time_ms, run.cpu_us / 1000);
+                    judgement.memory_kb = std::max(judgement.memory_kb, run.memory_kb);
+                }
+            }
+            return judgement;
+        }
+        catch (const SandboxUnavailable &)
+        {
+            throw;
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Judge error: " << e.what() << std::endl;
+            return {"Judge Error"};
+        }
+    }
+
+    // Everything up to the runs: the submission, its binary, checker and
+    // tests. Compiles while the tests load.
+    PreparedSubmission prepare(int submission_id)
+    {
+        if (!db_->is_valid())
+        {
+            try
+            {
+                db_->reset();
+            }
+            catch (const std::exception &e)
+            {
+                throw DatabaseUnavailable(e.what());
+            }
+            if (!db_->is_valid())
+            {
+                throw DatabaseUnavailable(std::string("Database connection lost: ") + PQerrorMessage(db_->get()));
+            }
+        }
+
+        std::cout << "[worker " << worker_id_ << "] Processing submission " << submission_id << std::endl;
+
+        PreparedSubmission prepared;
+        Submission &submission = prepared.submission;
+        std::future<CompileCache::Lease> compiled;
+        {
+            ScopedTimer timer(metrics_.db_fetch);
+            submission = fetch_submission(submission_id);
+            compiled = compile_async(submission);
+
+            // From the shared cache when this version is already loaded
+            submission.test_cases = test_case_cache_.get(submission.problem_id, submission.test_version, [&]
+                                                         { return load_test_cases(submission.problem_id,
+                                                                                  submission.test_version); });
+        }
+
+        try
+        {
+            // A broken checker must not turn into verdicts against the submission
+            prepared.checker = load_checker(submission);
+            prepared.binary = compiled.get();
+            if (!prepared.binary)
+            {
+                prepared.judgement = Judgement{"Compilation Error"};
+            }
+        }
+        catch (const SandboxUnavailable &)
+        {
+            // The compile reads the submission until it is done
+            if (compiled.valid())
+            {
+                compiled.wait();
+            }
+            throw;
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Judge error: " << e.what() << std::endl;
+            prepared.judgement = Judgement{"Judge Error"};
+            if (compiled.valid())
+            {
+                compiled.wait();
+            }
+        }
+        return prepared;
+    }
+
+    void judge(const PreparedSubmission &prepared)
+    {
+        const Submission &submission = prepared.submission;
+        auto started = std::chrono::steady_clock::now();
+        Judgement judgement = judge_submission(prepared);
+        metrics_.count_verdict(judgement.verdict);
+
+        // Teaches the scheduler what this problem costs; compile errors and
+        // judge errors say nothing about that
+        if (judgement.time_ms >= 0)
+        {
+            scheduler_.record_cost(submission.problem_id, std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                              std::chrono::steady_clock::now() - started));
+        }
+
+        // Written in the background, batched with other workers' verdicts
+        verdict_writer_.submit(submission.id, judgement);
+        if (progress_)
+        {
+            progress_->publish(submission.id, {{"event", "verdict"},
+                                               {"verdict", judgement.verdict},
+                                               {"time_ms", judgement.time_ms >= 0 ? json(judgement.time_ms) : json()},
+                                               {"memory_kb", judgement.memory_kb >= 0 ? json(judgement.memory_kb) : json()}});
+        }
+
+        std::cout << "[worker " << worker_id_ << "] Submission " << submission.id << " judged: " << judgement.verdict;
+        if (judgement.time_ms >= 0)
+        {
+            std::cout << " (" << judgement.time_ms << " ms, " << judgement.memory_kb << " KB)";
+        }
+        std::cout << std::endl;
+    }
+
+    // Ends a submission that can't be judged with a Judge Error, acked like
+    // any verdict once it is written
+    void fail(int submission_id)
+    {
+        metrics_.count_verdict("Judge Error");
+        verdict_writer_.submit(submission_id, {"Judge Error"});
+        if (progress_)
+        {
+            progress_->publish(submission_id, {{"event", "verdict"}, {"verdict", "Judge Error"}, {"time_ms", json()}, {"memory_kb", json()}});
+        }
+    }
+
+    // The first stage: hands each submission on as soon as it is ready to
+    // run and starts on the next, so its fetch and compile overlap the
+    // runs of the one before. Blocks while ready is full.
+    void prepare_loop(WorkQueue<int> &queue, WorkQueue<PreparedSubmission> &ready)
+    {
+        while (auto submission_id = queue.pop())
+        {
+            try
+            {
+                if (!ready.push(prepare(*submission_id)))
+                {
+                    // Shutting down; another pod judges it
+                    break;
+                }
+            }
+            catch (const DatabaseUnavailable &e)
+            {
+                std::cerr << "[worker " << worker_id_ << "] Database unavailable for submission " << *submission_id << ": " << e.what() << std::endl;
+                retry_({*submission_id});
+                // Gives the database a moment before this worker asks again
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            }
+            catch (const SandboxUnavailable &e)
+            {
+                std::cerr << "[worker " << worker_id_ << "] Sandbox unavailable for submission " << *submission_id << ": " << e.what() << std::endl;
+                retry_({*submission_id});
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "[worker " << worker_id_ << "] Error processing submission " << *submission_id << ": " << e.what() << std::endl;
+                // Judging it again would fail the same way
+                fail(*submission_id);
+            }
+        }
+    }
+
+    // The second stage: runs the tests and reports the verdict
+    void judge_loop(WorkQueue<PreparedSubmission> &ready)
+    {
+        while (auto prepared = ready.pop())
+        {
+            metrics_.busy_workers.add(1);
+            auto started = std::chrono::steady_clock::now();
+            try
+            {
+                judge(*prepared);
+            }
+            catch (const SandboxUnavailable &e)
+            {
+                std::cerr << "[worker " << worker_id_ << "] Sandbox unavailable for submission " << prepared->submission.id << ": " << e.what() << std::endl;
+                retry_({prepared->submission.id});
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "[worker " << worker_id_ << "] Error judging submission " << prepared->submission.id << ": " << e.what() << std::endl;
+                fail(prepared->submission.id);
+            }
+            metrics_.busy_workers.add(-1);
+            metrics_.busy_ns.inc(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now() - started)
+                                     .count());
+        }
+    }
+};
+
+// Pulls submissions from the Redis lanes on a single dispatcher and hands the
+// scheduler's pick to an idle worker. Only a bounded lookahead per lane is
+// taken, so a saturated pod leaves the rest of the queued work in Redis for
+// other pods.
+class ModernJudgeService
+{
+private:
+    std::unique_ptr<JudgeMetrics> metrics_;
+    std::unique_ptr<SubmissionQueue> submissions_;
+    std::unique_ptr<Scheduler> scheduler_;
+    size_t lookahead_;
+    // Past this much expected judging per worker, taken or in flight, the
+    // pod takes nothing new until it is down to three quarters of it, and
+    // hands back what it hasn't started beyond it; 0 never
+    std::chrono::milliseconds max_backlog_;
+    int max_attempts_; // tries at a submission before it gets a Judge Error
+    size_t worker_count_;
+    std::atomic<bool> saturated_{false};
+    Gauge *saturated_gauge_ = nullptr;
+    Counter *shed_ = nullptr;
+    std::chrono::milliseconds poll_interval_;
+    std::chrono::seconds report_interval_;
+    std::unordered_map<std::string, Runtime> runtimes_;
+    std::unique_ptr<SecureSandbox> checker_sandbox_; // nullptr without a root: no custom checkers
+    std::unique_ptr<RunPool> run_pool_;
+    std::unique_ptr<CompileCache> compile_cache_;
+    std::unique_ptr<CompileServer> compile_server_;
+    std::unique_ptr<TestCaseCache> test_case_cache_;
+    std::unique_ptr<TestPackStore> test_packs_;
+    std::unique_ptr<TestHistory> test_history_;
+    std::unique_ptr<VerdictWriter> verdict_writer_;
+    std::unique_ptr<ProgressPublisher> progress_;
+    std::vector<std::unique_ptr<JudgeWorker>> workers_;
+    std::vector<std::thread> prepare_threads_;
+    std::vector<std::thread> judge_threads_;
+    std::unique_ptr<MetricsServer> metrics_server_;
+    WorkQueue<int> queue_;
+    // Between the stages, with room for one prepared submission per worker,
+    // taken by whichever judge thread is free first. Prepare threads block
+    // while it is full.
+    WorkQueue<PreparedSubmission> ready_;
+
+public:
+    ModernJudgeService(const std::string &db_url, const RedisConfig &redis, size_t worker_count, size_t run_slots)
+        : queue_(worker_count), ready_(worker_count)
+    {
+        // In-flight submissions of a pod that stops heartbeating for this
+        // long are requeued for other pods
+        const char *consumer = std::getenv("JUDGE_CONSUMER_NAME");
+        const char *inflight_timeout = std::getenv("JUDGE_INFLIGHT_TIMEOUT_S");
+        char hostname[256] = {};
+        gethostname(hostname, sizeof(hostname) - 1);
+
+        // Lanes in priority order. Producers that don't pick one push onto
+        // the plain submission_queue, the practice lane.
+        const std::vector<std::string> lanes{"contest", "practice", "rejudge"};
+        submissions_ = std::make_unique<SubmissionQueue>(
+            redis,
+            std::vector<std::string>{"submission_queue:contest", "submission_queue", "submission_queue:rejudge"},
+            consumer ? consumer : hostname, inflight_timeout ? std::stoi(inflight_timeout) : 30);
+        scheduler_ = std::make_unique<Scheduler>(lanes);
+        metrics_ = std::make_unique<JudgeMetrics>(lanes, worker_count);
+
+        // Entries taken ahead per lane for the scheduler to choose from. They
+        // sit in this pod's processing lists, so keep it near the worker count.
+        const char *lookahead = std::getenv("JUDGE_SCHEDULER_LOOKAHEAD");
+        lookahead_ = lookahead ? std::stoul(lookahead) : worker_count;
+        const char *max_backlog_s = std::getenv("JUDGE_MAX_BACKLOG_S");
+        max_backlog_ = std::chrono::seconds(max_backlog_s ? std::stol(max_backlog_s) : 30);
+        const char *max_attempts = std::getenv("JUDGE_MAX_ATTEMPTS");
+        max_attempts_ = std::max(max_attempts ? std::stoi(max_attempts) : 3, 1);
+        worker_count_ = worker_count;
+        const char *poll_ms = std::getenv("JUDGE_QUEUE_POLL_MS");
+        poll_interval_ = std::chrono::milliseconds(poll_ms ? std::stol(poll_ms) : 200);
+        const char *report_s = std::getenv("JUDGE_SCHEDULER_REPORT_S");
+        report_interval_ = std::chrono::seconds(report_s ? std::stol(report_s) : 60);
+
+        // Each run slot gets a physical core of its own. The judge's threads
+        // and the compiles keep to the first JUDGE_RESERVED_CORES, so they
+        // never disturb a run's timing. "0" lets the kernel place everything.
+        const char *pinning = std::getenv("JUDGE_CPU_PINNING");
+        const char *reserved_env = std::getenv("JUDGE_RESERVED_CORES");
+        size_t reserved = reserved_env ? std::stoul(reserved_env) : 1;
+        std::vector<CpuCore> slot_cores;
+        if (!pinning || std::string(pinning) != "0")
+        {
+            std::vector<CpuCore> cores = allowed_cores();
+            if (cores.size() > reserved)
+            {
+                std::vector<CpuCore> control(cores.begin(), cores.begin() + reserved);
+                slot_cores.assign(cores.begin() + reserved, cores.end());
+                if (run_slots > slot_cores.size())
+                {
+                    std::cerr << "Only " << slot_cores.size() << " cores left for run slots, not " << run_slots
+                              << std::endl;
+                }
+                if (run_slots == 0 || run_slots > slot_cores.size())
+                    run_slots = slot_cores.size();
+                slot_cores.resize(run_slots);
+                if (!control.empty() && !pin_current_thread(control))
+                {
+                    std::cerr << "Cannot pin the judge to CPUs " << cpu_list(control) << std::endl;
+                }
+                std::cout << "Judge on CPUs " << (control.empty() ? "any" : cpu_list(control)) << ", run slots on "
+                          << cpu_list(slot_cores) << std::endl;
+            }
+            else
+            {
+                std::cerr << "CPU pinning disabled: " << cores.size() << " physical cores, " << reserved
+                          << " reserved" << std::endl;
+            }
+        }
+        if (run_slots == 0)
+            run_slots = std::max(1u, std::thread::hardware_concurrency());
+        std::cout << "Run slots: " << run_slots << std::endl;
+        metrics_->registry.gauge("judge_run_slots", "Tests that may run at once").set(static_cast<int64_t>(run_slots));
+
+        // Configure secure sandbox
+        SecureSandbox::SandboxConfig sandbox_config;
+        sandbox_config.memory_limit_mb = 256;
+        sandbox_config.time_limit_ms = 2000;
+        sandbox_config.enable_network = false;
+        sandbox_config.enable_filesystem_write = false;
+        sandbox_config.user = "nobody"; // Run as restricted user
+
+        // CPU limit per test in milliseconds; the wall-clock limit defaults
+        // to twice that plus a second
+        const char *time_limit_ms = std::getenv("JUDGE_TIME_LIMIT_MS");
+        const char *wall_time_limit_ms = std::getenv("JUDGE_WALL_TIME_LIMIT_MS");
+        if (time_limit_ms)
+            sandbox_config.time_limit_ms = std::stol(time_limit_ms);
+        if (wall_time_limit_ms)
+            sandbox_config.wall_time_limit_ms = std::stol(wall_time_limit_ms);
+
+        // Runs printing more than this are killed as Output Limit Exceeded
+        const char *output_limit_mb = std::getenv("JUDGE_OUTPUT_LIMIT_MB");
+        if (output_limit_mb)
+            sandbox_config.output_limit_bytes = std::stoul(output_limit_mb) * 1024 * 1024;
+
+        // Warm sandboxed processes kept ready per run slot
+        const char *prefork = std::getenv("JUDGE_SANDBOX_PREFORK");
+        if (prefork)
+            sandbox_config.prefork_count = std::stoul(prefork);
+
+        // Compilers that may run at once, each in a sandbox of its own
+        const char *compile_slots_str = std::getenv("JUDGE_COMPILE_SLOTS");
+        size_t compile_slots = compile_slots_str ? std::stoul(compile_slots_str)
+                                                 : std::min<size_t>(4, std::max(1u, std::thread::hardware_concurrency()));
+        compile_slots = std::max<size_t>(compile_slots, 1);
+
+        CompileServer::Config compile_config;
+        const char *compile_dir = std::getenv("JUDGE_COMPILE_DIR");
+        if (compile_dir)
+            compile_config.work_dir = compile_dir;
+        const char *pch_headers = std::getenv("JUDGE_PCH_HEADERS");
+        if (pch_headers)
+        {
+            compile_config.precompiled_headers.clear();
+            std::istringstream headers(pch_headers);
+            std::string header;
+            while (std::getline(headers, header, ','))
+            {
+                if (!header.empty())
+                    compile_config.precompiled_headers.push_back(header);
+            }
+        }
+
+        // Languages submissions may be written in. Those whose toolchain
+        // isn't installed are left out.
+        const char *languages_env = std::getenv("JUDGE_LANGUAGES");
+        std::vector<std::string> wanted;
+        {
+            std::istringstream names(languages_env ? languages_env : "cpp,c,python,java");
+            std::string name;
+            while (std::getline(names, name, ','))
+                wanted.push_back(name);
+        }
+        std::vector<std::shared_ptr<const LanguageProfile>> languages;
+        for (auto &language : builtin_languages(compile_config.compiler, compile_config.flags,
+                                                compile_config.precompiled_headers, compile_config.work_dir + "/runtime"))
+        {
+            if (std::find(wanted.begin(), wanted.end(), language->name) == wanted.end())
+                continue;
+            if (!language->available())
+            {
+                std::cerr << "Language " << language->name << " disabled: toolchain not installed" << std::endl;
+                continue;
+            }
+            languages.push_back(language);
+        }
+        if (languages.empty())
+        {
+            throw std::runtime_error("None of the languages in JUDGE_LANGUAGES is installed");
+        }
+
+        // Every run, compile, checker and warm zygote holds a cgroup, so
+        // start with enough for all of them. Set up before the sandboxes so
+        // their helpers already live in the supervisor cgroup.
+        const char *cgroups = std::getenv("JUDGE_CGROUPS");
+        const char *cgroup_root = std::getenv("JUDGE_CGROUP_ROOT");
+        if (!cgroups || std::string(cgroups) != "0")
+        {
+            try
+            {
+                sandbox_config.cgroups = CgroupPool::create(
+                    cgroup_root ? cgroup_root : "",
+                    languages.size() * run_slots * (sandbox_config.prefork_count + 1) + compile_slots * 2 +
+                        run_slots + 1);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "cgroup v2 unavailable, limiting memory with RLIMIT_AS: " << e.what() << std::endl;
+            }
+        }
+
+        // Compiled binaries on local disk, optionally shared through Redis.
+        // Judges sharing binaries sign them with a common secret, so nothing
+        // written to Redis by anyone else is ever run.
+        const char *cache_dir = std::getenv("JUDGE_COMPILE_CACHE_DIR");
+        const char *cache_mb = std::getenv("JUDGE_COMPILE_CACHE_MB");
+        const char *cache_redis = std::getenv("JUDGE_COMPILE_CACHE_REDIS");
+        const char *cache_secret = std::getenv("JUDGE_COMPILE_CACHE_SECRET");
+        std::unique_ptr<CompileCache::RemoteStore> remote;
+        if (cache_redis && std::string(cache_redis) == "1")
+        {
+            if (cache_secret && *cache_secret)
+            {
+                const char *ttl = std::getenv("JUDGE_COMPILE_CACHE_REDIS_TTL");
+                remote = std::make_unique<RedisBinaryStore>(redis, ttl ? std::stoi(ttl) : 86400,
+                                                            16 * 1024 * 1024);
+            }
+            else
+            {
+                std::cerr << "Redis compile cache disabled: JUDGE_COMPILE_CACHE_SECRET is not set" << std::endl;
+            }
+        }
+        std::string remote_secret = remote ? cache_secret : "";
+        std::string binary_dir = cache_dir ? cache_dir : "/tmp/codejudge-compile-cache";
+        compile_cache_ = std::make_unique<CompileCache>(binary_dir,
+                                                        (cache_mb ? std::stoul(cache_mb) : 1024) * 1024 * 1024,
+                                                        std::move(remote), remote_secret);
+
+        // Programs see the host's system directories read-only and nothing
+        // else of it but their binaries; "0" leaves them in the host's tree
+        const char *chroot_env = std::getenv("JUDGE_CHROOT");
+        const char *chroot_dir = std::getenv("JUDGE_CHROOT_DIR");
+        if (!chroot_env || std::string(chroot_env) != "0")
+        {
+            try
+            {
+                sandbox_config.root = SandboxRoot::create(chroot_dir ? chroot_dir : "/tmp/codejudge-root");
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Sandbox root unavailable, programs see the host filesystem: " << e.what() << std::endl;
+            }
+        }
+        sandbox_config.read_only_paths = {binary_dir, compile_config.work_dir + "/runtime"};
+
+        // One sandbox per language and run slot, shared by all workers
+        // through the pool
+        for (const auto &language : languages)
+        {
+            Runtime &runtime = runtimes_[language->name];
+            runtime.language = language;
+            SecureSandbox::SandboxConfig language_config = sandbox_config;
+            language_config.language = language;
+            for (size_t i = 0; i < run_slots; i++)
+            {
+                if (!slot_cores.empty())
+                {
+                    language_config.cpus = slot_cores[i].cpus;
+                    language_config.numa_node = slot_cores[i].node;
+                }
+                runtime.sandboxes.push_back(std::make_unique<SecureSandbox>(language_config));
+            }
+            std::cout << "Language " << language->name << " enabled"
+                      << (language->zygote_command.empty() ? "" : " with warm interpreters") << std::endl;
+        }
+        run_pool_ = std::make_unique<RunPool>(run_slots);
+
+        // Custom checkers run on the run slots after the program, in the
+        // root and nothing of the host beyond it
+        if (sandbox_config.root)
+        {
+            checker_sandbox_ = std::make_unique<SecureSandbox>(custom_checker_sandbox(sandbox_config));
+        }
+        else
+        {
+            std::cerr << "Custom checkers disabled: they need the sandbox root" << std::endl;
+        }
+
+        // Cache misses go to long-lived compile sandboxes that share
+        // precompiled headers
+        compile_config.slots = compile_slots;
+        compile_config.sandbox = CompileServer::compile_sandbox(sandbox_config, compile_config.work_dir);
+        const char *compile_time_ms = std::getenv("JUDGE_COMPILE_TIME_LIMIT_MS");
+        const char *compile_wall_ms = std::getenv("JUDGE_COMPILE_WALL_TIME_LIMIT_MS");
+        const char *compile_memory_mb = std::getenv("JUDGE_COMPILE_MEMORY_LIMIT_MB");
+        const char *compile_processes = std::getenv("JUDGE_COMPILE_PROCESSES");
+        if (compile_time_ms)
+            compile_config.sandbox.time_limit_ms = std::stol(compile_time_ms);
+        if (compile_wall_ms)
+            compile_config.sandbox.wall_time_limit_ms = std::stol(compile_wall_ms);
+        if (compile_memory_mb)
+            compile_config.sandbox.memory_limit_mb = std::stoul(compile_memory_mb);
+        if (compile_processes)
+            compile_config.sandbox.process_limit = std::max<size_t>(std::stoul(compile_processes), 1);
+        compile_config.languages = languages;
+        compile_server_ = std::make_unique<CompileServer>(compile_config);
+
+        // Test sets of hot problems stay in memory across submissions
+        const char *test_cache_mb = std::getenv("JUDGE_TEST_CACHE_MB");
+        test_case_cache_ = std::make_unique<TestCaseCache>((test_cache_mb ? std::stoul(test_cache_mb) : 512) * 1024 * 1024);
+
+        // Misses there read this node's pack files before the database; a
+        // directory shared by every judge on the node. "" disables them.
+        const char *test_pack_dir = std::getenv("JUDGE_TEST_PACK_DIR");
+        std::string pack_dir = test_pack_dir ? test_pack_dir : "/tmp/codejudge-test-packs";
+        if (!pack_dir.empty())
+        {
+            test_packs_ = std::make_unique<TestPackStore>(pack_dir);
+        }
+
+        // Hit rates come from the caches' own counters
+        CompileCache *compile_cache = compile_cache_.get();
+        TestCaseCache *test_case_cache = test_case_cache_.get();
+        const char *compile_help = "Compile cache lookups by where the binary came from";
+        metrics_->registry.counter_callback("judge_compile_cache_lookups_total", compile_help, "result=\"hit\"",
+                                            [compile_cache]
+                                            { return compile_cache->stats().hits; });
+        metrics_->registry.counter_callback("judge_compile_cache_lookups_total", compile_help, "result=\"remote_hit\"",
+                                            [compile_cache]
+                                            { return compile_cache->stats().remote_hits; });
+        metrics_->registry.counter_callback("judge_compile_cache_lookups_total", compile_help, "result=\"miss\"",
+                                            [compile_cache]
+                                            { return compile_cache->stats().compiles; });
+        const char *test_help = "Test case cache lookups";
+        metrics_->registry.counter_callback("judge_test_cache_lookups_total", test_help, "result=\"hit\"",
+                                            [test_case_cache]
+                                            { return test_case_cache->hits(); });
+        metrics_->registry.counter_callback("judge_test_cache_lookups_total", test_help, "result=\"miss\"",
+                                            [test_case_cache]
+                                            { return test_case_cache->misses(); });
+        if (test_packs_)
+        {
+            TestPackStore *test_packs = test_packs_.get();
+            const char *pack_help = "Test cache misses by whether a pack on this node had the set";
+            metrics_->registry.counter_callback("judge_test_pack_lookups_total", pack_help, "result=\"hit\"",
+                                                [test_packs]
+                                                { return test_packs->hits(); });
+            metrics_->registry.counter_callback("judge_test_pack_lookups_total", pack_help, "result=\"miss\"",
+                                                [test_packs]
+                                                { return test_packs->misses(); });
+        }
+
+        // Admission control, and what an autoscaler needs next to the queue
+        // wait histograms
+        Scheduler *scheduler = scheduler_.get();
+        RunPool *run_pool = run_pool_.get();
+        metrics_->registry.gauge_callback("judge_backlog_seconds",
+                                          "Expected judging per worker of everything taken or in flight", "",
+                                          [scheduler, worker_count]
+                                          { return scheduler->expected_work().count() / 1e3 / worker_count; });
+        saturated_gauge_ = &metrics_->registry.gauge("judge_saturated",
+                                                     "1 while this pod takes no new submissions");
+        shed_ = &metrics_->registry.counter("judge_submissions_shed_total",
+                                            "Submissions taken, then handed back to the queue unstarted");
+        metrics_->registry.counter_callback("judge_run_slot_busy_seconds_total", "Time run slots spent running tests",
+                                            "", [run_pool]
+                                            { return run_pool->busy_seconds(); });
+
+        // Per-test failure rate and run time of this many recently judged
+        // problems decide the order tests start in; "0" keeps database order
+        const char *history_problems = std::getenv("JUDGE_TEST_HISTORY_PROBLEMS");
+        size_t max_history = history_problems ? std::stoul(history_problems) : 10000;
+        if (max_history > 0)
+        {
+            test_history_ = std::make_unique<TestHistory>(max_history);
+        }
+
+        // Checker for problems that don't name one; any built-in spec
+        const char *compare_mode = std::getenv("JUDGE_COMPARE_MODE");
+        std::shared_ptr<const Checker> default_checker = make_builtin_checker(compare_mode ? compare_mode : "exact");
+        if (!default_checker)
+        {
+            throw std::runtime_error(std::string("Unknown JUDGE_COMPARE_MODE: ") + compare_mode);
+        }
+
+        // Verdicts that finish together are written together, up to this many
+        const char *verdict_batch = std::getenv("JUDGE_VERDICT_BATCH");
+        verdict_writer_ = std::make_unique<VerdictWriter>(db_url, verdict_batch ? std::stoul(verdict_batch) : 64,
+                                                          metrics_->verdict_write, [this](const std::vector<int> &ids)
+                                                          { complete(ids); },
+                                                          [this](const std::vector<int> &ids)
+                                                          { retry(ids); });
+
+        // Per-test progress for clients on Redis pub/sub; "" publishes none
+        const char *progress_channel = std::getenv("JUDGE_PROGRESS_CHANNEL");
+        std::string progress_prefix = progress_channel ? progress_channel : "submission_progress";
+        if (!progress_prefix.empty())
+        {
+            progress_ = std::make_unique<ProgressPublisher>(redis, progress_prefix);
+        }
+
+        // Each worker opens its own database connection
+        for (size_t i = 0; i < worker_count; i++)
+        {
+            workers_.push_back(std::make_unique<JudgeWorker>(static_cast<int>(i), db_url, sandbox_config,
+                                                             *run_pool_, runtimes_, checker_sandbox_.get(),
+                                                             *compile_cache_,
+                                                             *compile_server_, *test_case_cache_, test_packs_.get(),
+                                                             test_history_.get(),
+                                                             *verdict_writer_, progress_.get(), *scheduler_,
+                                                             *metrics_, [this](const std::vector<int> &ids)
+                                                             { retry(ids); },
+                                                             default_checker));
+        }
+
+        // Prometheus scrapes this; "0" turns it off
+        const char *metrics_port = std::getenv("JUDGE_METRICS_PORT");
+        int port = metrics_port ? std::stoi(metrics_port) : 8080;
+        if (port > 0)
+        {
+            try
+            {
+                // Kubernetes stops routing to, and can scale on, a saturated pod
+                metrics_server_ = std::make_unique<MetricsServer>(metrics_->registry, port, [this]
+                                                                  { return !saturated_.load(); });
+                std::cout << "Serving metrics on port " << port << std::endl;
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Metrics disabled: " << e.what() << std::endl;
+            }
+        }
+    }
+
+    ~ModernJudgeService()
+    {
+        // The judges finish whatever was already prepared
+        queue_.close();
+        for (auto &thread : prepare_threads_)
+        {
+            if (thread.joinable())
+                thread.join();
+        }
+        ready_.close();
+        for (auto &thread : judge_threads_)
+        {
+            if (thread.joinable())
+                thread.join();
+        }
+    }
+
+    // Ends submissions whose verdict has been written
+    void complete(const std::vector<int> &ids)
+    {
+        std::vector<SubmissionQueue::Entry> entries;
+        for (int id : ids)
+        {
+            if (auto job = scheduler_->finish(id))
+            {
+                entries.push_back({job->lane, job->entry});
+            }
+        }
+        submissions_->ack(entries);
+    }
+
+    // Puts submissions that can't be finished now back on their lanes, to
+    // be judged again by whichever pod takes them first. The attempt count
+    // travels in the entry; on its last attempt a submission gets a Judge
+    // Error instead.
+    void retry(const std::vector<int> &ids)
+    {
+        std::vector<Scheduler::Job> jobs;
+        std::vector<SubmissionQueue::Entry> entries;
+        for (int id : ids)
+        {
+            int attempts = scheduler_->record_failure(id);
+            if (attempts == 0)
+            {
+                continue;
+            }
+            if (attempts == max_attempts_)
+            {
+                // Acked once written, like any verdict
+                std::cerr << "Giving up on submission " << id << " after " << attempts << " attempts" << std::endl;
+                metrics_->count_verdict("Judge Error");
+                verdict_writer_->submit(id, {"Judge Error"});
+                continue;
+            }
+
+            std::optional<Scheduler::Job> job = scheduler_->finish(id);
+            if (!job)
+            {
+                continue;
+            }
+            if (attempts > max_attempts_)
+            {
+                // Not even the Judge Error could be written. It stays in our
+                // processing list, for another pod should this one die.
+                std::cerr << "Cannot record a verdict for submission " << id << std::endl;
+                continue;
+            }
+            entries.push_back({job->lane, job->entry, Scheduler::format(*job)});
+            jobs.push_back(std::move(*job));
+        }
+        try
+        {
+            submissions_->release(entries);
+        }
+        catch (const std::exception &e)
+        {
+            // Still in our processing lists, so judged here again instead
+            std::cerr << "Failed to hand back " << entries.size() << " submissions: " << e.what() << std::endl;
+            for (auto &job : jobs)
+                scheduler_->add(std::move(job));
+        }
+    }
+
+    // Queue wait and end-to-end latency per lane since startup
+    void report_lanes()
+    {
+        for (const auto &lane : scheduler_->stats())
+        {
+            std::cout << "Lane " << lane.name << ": " << lane.pending << " pending, " << lane.started << " started";
+            if (lane.started > 0)
+            {
+                std::cout << ", avg wait " << lane.total_wait.count() / static_cast<long>(lane.started)
+                          << " ms, max wait " << lane.max_wait.count() << " ms";
+            }
+            if (lane.finished > 0)
+            {
+                std::cout << ", avg latency " << lane.total_latency.count() / static_cast<long>(lane.finished) << " ms";
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    // Whether this pod should take nothing new. It saturates on reaching
+    // max_backlog_ of expected judging per worker and stays so until it is
+    // back under three quarters of that, so a refill doesn't take entries
+    // only to hand them straight back. Beyond the limit it gives back
+    // pending entries, lowest lane first, until it is within it.
+    bool check_saturation()
+    {
+        if (max_backlog_.count() <= 0)
+        {
+            return false;
+        }
+        auto limit = max_backlog_ * static_cast<long>(worker_count_);
+        auto resume = limit * 3 / 4;
+        auto work = scheduler_->expected_work();
+        bool saturated = work >= (saturated_.load() ? resume : limit);
+        if (work > limit)
+        {
+            std::vector<Scheduler::Job> jobs = scheduler_->shed(work - limit);
+            std::vector<SubmissionQueue::Entry> entries;
+            for (const auto &job : jobs)
+                entries.push_back({job.lane, job.entry});
+            try
+            {
+                submissions_->release(entries);
+                shed_->inc(entries.size());
+            }
+            catch (const std::exception &e)
+            {
+                // Still in our processing lists, so judged here after all
+                std::cerr << "Failed to hand back " << entries.size() << " submissions: " << e.what() << std::endl;
+                for (auto &job : jobs)
+                    scheduler_->add(std::move(job));
+            }
+        }
+        if (saturated != saturated_.exchange(saturated))
+        {
+            saturated_gauge_->set(saturated ? 1 : 0);
+            std::cout << (saturated ? "Saturated: taking no new submissions, "
+                                    : "No longer saturated, ")
+                      << work.count() / 1000 / static_cast<long>(worker_count_) << " s of work per worker"
+                      << std::endl;
+        }
+        return saturated;
+    }
+
+    // Tops up each lane's lookahead, waiting a while on the top lane when
+    // there is nothing to do at all
+    void refill()
+    {
+        if (check_saturation())
+        {
+            // What is still pending goes to idle workers; with nothing left,
+            // wait for the work in flight to drain instead of spinning
+            bool any_pending = false;
+            for (size_t lane = 0; lane < scheduler_->lane_count(); lane++)
+                any_pending = any_pending || scheduler_->pending(lane) > 0;
+            if (!any_pending)
+                std::this_thread::sleep_for(poll_interval_);
+            return;
+        }
+
+        bool any_pending = false;
+        std::vector<size_t> want(scheduler_->lane_count());
+        for (size_t lane = 0; lane < want.size(); lane++)
+        {
+            size_t pending = scheduler_->pending(lane);
+            any_pending = any_pending || pending > 0;
+            want[lane] = pending < lookahead_ ? lookahead_ - pending : 0;
+        }
+
+        std::vector<SubmissionQueue::Entry> entries = submissions_->take(want);
+        if (entries.empty() && !any_pending)
+        {
+            entries = submissions_->wait(0, poll_interval_);
+        }
+
+        for (const auto &entry : entries)
+        {
+            if (auto job = Scheduler::parse(entry.lane, entry.value))
+            {
+                scheduler_->add(std::move(*job));
+            }
+            else
+            {
+                // Never going to be judged; don't leave it in flight
+                std::cerr << "Dropping malformed queue entry '" << entry.value << "'" << std::endl;
+                submissions_->ack({entry});
+            }
+        }
+    }
+
+    void process_submission_queue()
+    {
+        for (auto &worker : workers_)
+        {
+            JudgeWorker *w = worker.get();
+            prepare_threads_.emplace_back([this, w]
+                                          { w->prepare_loop(queue_, ready_); });
+            judge_threads_.emplace_back([this, w]
+                                        { w->judge_loop(ready_); });
+        }
+
+        auto next_report = std::chrono::steady_clock::now() + report_interval_;
+        while (queue_.wait_for_idle_consumer())
+        {
+            try
+            {
+                refill();
+
+                // Hand the scheduler's picks to however many workers are idle
+                for (size_t idle = queue_.idle_consumers(); idle > 0; idle--)
+                {
+                    std::optional<Scheduler::Job> job = scheduler_->next();
+                    if (!job)
+                        break;
+                    metrics_->queue_wait(job->lane).observe(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        Scheduler::Clock::now() - job->enqueued));
+                    queue_.push(job->submission_id);
+                }
+
+                if (std::chrono::steady_clock::now() >= next_report)
+                {
+                    report_lanes();
+                    next_report = std::chrono::steady_clock::now() + report_interval_;
+                }
             }
             catch (const std::exception &e)
             {
-                std::cerr << "Error processing submission: " << e.what() << std::endl;
+                std::cerr << "Error dispatching submission: " << e.what() << std::endl;
                 std::this_thread::sleep_for(std::chrono::seconds(1));
             }
         }
@@ -371,20 +2231,42 @@ int main()
     {
         // Get configuration from environment
         const char *db_url = std::getenv("DATABASE_URL");
+        const char *redis_url = std::getenv("REDIS_URL");
         const char *redis_host = std::getenv("REDIS_HOST");
         const char *redis_port_str = std::getenv("REDIS_PORT");
+        const char *workers_str = std::getenv("JUDGE_WORKERS");
+        const char *run_slots_str = std::getenv("JUDGE_RUN_SLOTS");
 
         if (!db_url)
             db_url = "postgresql://localhost/codejudge";
-        if (!redis_host)
-            redis_host = "localhost";
-        int redis_port = redis_port_str ? std::stoi(redis_port_str) : 6379;
+        // REDIS_URL, as the other services take it, for TLS or a password;
+        // REDIS_HOST and REDIS_PORT override its parts
+        RedisConfig redis = parse_redis_url(redis_url ? redis_url : "");
+        if (!redis_url)
+            redis.host = "localhost";
+        if (redis_host)
+            redis.host = redis_host;
+        if (redis_port_str)
+            redis.port = std::stoi(redis_port_str);
+
+        // Default to one worker per core
+        size_t worker_count = workers_str ? std::stoul(workers_str) : std::thread::hardware_concurrency();
+        if (worker_count == 0)
+            worker_count = 1;
+
+        // Tests from all workers share this many cores; 0 for one per core
+        size_t run_slots = run_slots_str ? std::stoul(run_slots_str) : 0;
+
+        // A child that exits before reading all of its input must not take
+        // the judge down with it
+        std::signal(SIGPIPE, SIG_IGN);
 
         std::cout << "Starting Modern Judge Service..." << std::endl;
         std::cout << "Database: " << db_url << std::endl;
-        std::cout << "Redis: " << redis_host << ":" << redis_port << std::endl;
+        std::cout << "Redis: " << redis.host << ":" << redis.port << (redis.use_tls ? " (TLS)" : "") << std::endl;
+        std::cout << "Workers: " << worker_count << std::endl;
 
-        ModernJudgeService judge(db_url, redis_host, redis_port);
+        ModernJudgeService judge(db_url, redis, worker_count, run_slots);
         judge.process_submission_queue();
     }
     catch (const std::exception &e)
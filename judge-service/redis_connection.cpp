@@ -0,0 +1,189 @@
+#include "redis_connection.h"
+
+#include <mutex>
+#include <stdexcept>
+
+#ifdef JUDGE_REDIS_TLS
+#include <hiredis/hiredis_ssl.h>
+#endif
+
+RedisConfig parse_redis_url(const std::string &url)
+{
+    RedisConfig config;
+    if (url.empty())
+    {
+        return config;
+    }
+
+    std::string working = url;
+    auto scheme_pos = working.find("://");
+    if (scheme_pos != std::string::npos)
+    {
+        std::string scheme = working.substr(0, scheme_pos);
+        if (scheme == "rediss")
+        {
+            config.use_tls = true;
+        }
+        working = working.substr(scheme_pos + 3);
+    }
+
+    auto at_pos = working.find('@');
+    if (at_pos != std::string::npos)
+    {
+        std::string credentials = working.substr(0, at_pos);
+        working = working.substr(at_pos + 1);
+
+        if (!credentials.empty())
+        {
+            if (credentials.front() == ':')
+            {
+                config.password = credentials.substr(1);
+            }
+            else
+            {
+                auto colon_pos = credentials.find(':');
+                if (colon_pos != std::string::npos)
+                {
+                    config.password = credentials.substr(colon_pos + 1);
+                }
+                else
+                {
+                    config.password = credentials;
+                }
+            }
+        }
+    }
+
+    auto end_host = working.find_first_of("/?");
+    std::string host_port = working.substr(0, end_host);
+    if (!host_port.empty())
+    {
+        auto colon_pos = host_port.find(':');
+        if (colon_pos != std::string::npos)
+        {
+            config.host = host_port.substr(0, colon_pos);
+            try
+            {
+                config.port = std::stoi(host_port.substr(colon_pos + 1));
+            }
+            catch (const std::exception &)
+            {
+                config.port = 6379;
+            }
+        }
+        else
+        {
+            config.host = host_port;
+        }
+    }
+
+    if (end_host != std::string::npos)
+    {
+        std::string remainder = working.substr(end_host);
+        if (remainder.find("ssl=true") != std::string::npos || remainder.find("ssl=1") != std::string::npos)
+        {
+            config.use_tls = true;
+        }
+        if (remainder.find("ssl=false") != std::string::npos || remainder.find("ssl=0") != std::string::npos)
+        {
+            config.use_tls = false;
+        }
+    }
+
+    return config;
+}
+
+RedisConnection::RedisConnection(const RedisConfig &config)
+{
+    context_ = redisConnect(config.host.c_str(), config.port);
+    if (!context_ || context_->err)
+    {
+        std::string error = context_ ? context_->errstr : "Unknown connection error";
+        close();
+        throw std::runtime_error("Redis connection failed: " + error);
+    }
+
+    if (config.use_tls)
+    {
+#ifdef JUDGE_REDIS_TLS
+        static std::once_flag openssl_initialized;
+        std::call_once(openssl_initialized, []
+                       { redisInitOpenSSL(); });
+        redisSSLContextError ssl_error = REDIS_SSL_CTX_NONE;
+        redisSSLContext *ssl =
+            redisCreateSSLContext(nullptr, "/etc/ssl/certs", nullptr, nullptr, config.host.c_str(), &ssl_error);
+        if (!ssl)
+        {
+            close();
+            throw std::runtime_error(std::string("Redis TLS setup failed: ") + redisSSLContextGetError(ssl_error));
+        }
+        ssl_ = ssl;
+        if (redisInitiateSSLWithContext(context_, ssl) != REDIS_OK)
+        {
+            std::string error = context_->errstr;
+            close();
+            throw std::runtime_error("Redis TLS handshake failed: " + error);
+        }
+#else
+        close();
+        throw std::runtime_error("Redis TLS requested, but built without hiredis TLS support");
+#endif
+    }
+
+    if (!config.password.empty())
+    {
+        redisReply *reply = (redisReply *)redisCommand(context_, "AUTH %s", config.password.c_str());
+        std::string error;
+        if (!reply)
+            error = context_->errstr;
+        else if (reply->type == REDIS_REPLY_ERROR)
+            error = std::string(reply->str, reply->len);
+        if (reply)
+            freeReplyObject(reply);
+        if (!reply || !error.empty())
+        {
+            close();
+            throw std::runtime_error("Redis AUTH failed: " + error);
+        }
+    }
+}
+
+RedisConnection::~RedisConnection()
+{
+    close();
+}
+
+RedisConnection::RedisConnection(RedisConnection &&other) noexcept : context_(other.context_), ssl_(other.ssl_)
+{
+    other.context_ = nullptr;
+    other.ssl_ = nullptr;
+}
+
+RedisConnection &RedisConnection::operator=(RedisConnection &&other) noexcept
+{
+    if (this != &other)
+    {
+        close();
+        context_ = other.context_;
+        ssl_ = other.ssl_;
+        other.context_ = nullptr;
+        other.ssl_ = nullptr;
+    }
+    return *this;
+}
+
+void RedisConnection::close()
+{
+    if (context_)
+    {
+        redisFree(context_);
+        context_ = nullptr;
+    }
+#ifdef JUDGE_REDIS_TLS
+    if (ssl_)
+    {
+        redisFreeSSLContext(static_cast<redisSSLContext *>(ssl_));
+    }
+#endif
+    ssl_ = nullptr;
+}
@@ -0,0 +1,47 @@
+#ifndef REDIS_CONNECTION_H
+#define REDIS_CONNECTION_H
+
+#include <string>
+
+#include <hiredis/hiredis.h>
+
+struct RedisConfig
+{
+    std::string host = "redis";
+    int port = 6379;
+    std::string password;
+    bool use_tls = false;
+};
+
+// Reads redis://[[user]:password@]host[:port][/db][?ssl=true]; rediss://
+// or ssl=true turns on TLS. Whatever is missing keeps its default.
+RedisConfig parse_redis_url(const std::string &url);
+
+// One hiredis connection, over TLS and authenticated as configured
+class RedisConnection
+{
+public:
+    // Throws std::runtime_error if Redis can't be reached, the TLS
+    // handshake fails or the password is refused. TLS needs hiredis 1.0
+    // or later at build time; without it asking for TLS throws.
+    explicit RedisConnection(const RedisConfig &config);
+    ~RedisConnection();
+
+    RedisConnection(const RedisConnection &) = delete;
+    RedisConnection &operator=(const RedisConnection &) = delete;
+
+    RedisConnection(RedisConnection &&other) noexcept;
+    RedisConnection &operator=(RedisConnection &&other) noexcept;
+
+    redisContext *get() const { return context_; }
+
+    bool is_valid() const { return context_ && !context_->err; }
+
+private:
+    void close();
+
+    redisContext *context_ = nullptr;
+    void *ssl_ = nullptr; // the redisSSLContext, which must outlive context_
+};
+
+#endif // REDIS_CONNECTION_H
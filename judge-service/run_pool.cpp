@@ -0,0 +1,138 @@
+#include "run_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <iostream>
+
+struct RunPool::Batch
+{
+    Batch(size_t count, const Task &task) : task(task), first_failure(count), tokens(count), remaining(count) {}
+
+    const Task &task;
+    std::atomic<size_t> first_failure;
+    std::vector<CancellationToken> tokens;
+
+    std::mutex done_mutex;
+    std::condition_variable done;
+    size_t remaining;
+
+    void record_failure(size_t index)
+    {
+        size_t current = first_failure.load();
+        while (index < current && !first_failure.compare_exchange_weak(current, index))
+        {
+        }
+        if (index < current)
+        {
+            for (size_t i = index + 1; i < tokens.size(); i++)
+            {
+                tokens[i].cancel();
+            }
+        }
+    }
+
+    void finish_one()
+    {
+        std::lock_guard<std::mutex> lock(done_mutex);
+        if (--remaining == 0)
+        {
+            done.notify_all();
+        }
+    }
+};
+
+RunPool::RunPool(size_t slots)
+{
+    if (slots == 0)
+    {
+        slots = 1;
+    }
+    for (size_t i = 0; i < slots; i++)
+    {
+        threads_.emplace_back([this, i]
+                              { slot_loop(i); });
+    }
+}
+
+RunPool::~RunPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    jobs_available_.notify_all();
+    for (auto &thread : threads_)
+    {
+        thread.join();
+    }
+}
+
+size_t RunPool::run_until_failure(size_t count, const Task &task, const std::vector<size_t> &order)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    auto batch = std::make_shared<Batch>(count, task);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < count; i++)
+        {
+            jobs_.push_back({batch, order.size() == count ? order[i] : i});
+        }
+    }
+    jobs_available_.notify_all();
+
+    std::unique_lock<std::mutex> lock(batch->done_mutex);
+    batch->done.wait(lock, [&batch]
+                     { return batch->remaining == 0; });
+    return batch->first_failure.load();
+}
+
+void RunPool::slot_loop(size_t slot)
+{
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            jobs_available_.wait(lock, [this]
+                                 { return stopping_ || !jobs_.empty(); });
+            if (jobs_.empty())
+            {
+                return;
+            }
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+
+        Batch &batch = *job.batch;
+        if (job.index < batch.first_failure.load())
+        {
+            bool passed = false;
+            auto started = std::chrono::steady_clock::now();
+            try
+            {
+                passed = batch.task(job.index, slot, batch.tokens[job.index]);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Run slot " << slot << " error: " << e.what() << std::endl;
+            }
+            busy_ns_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                   std::chrono::steady_clock::now() - started)
+                                   .count(),
+                               std::memory_order_relaxed);
+
+            // A cancelled run says nothing about the test itself, and it was
+            // only cancelled because an earlier index already failed
+            if (!passed && !batch.tokens[job.index].cancelled())
+            {
+                batch.record_failure(job.index);
+            }
+        }
+        batch.finish_one();
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef RUN_POOL_H
+#define RUN_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "sandbox.h"
+
+// Fixed set of run slots shared by every judge worker. Each slot is one
+// thread that executes one sandboxed test at a time, so the number of
+// concurrently running tests on a pod never exceeds the slot count.
+class RunPool
+{
+public:
+    // Returns true if the test passed. Runs on a slot thread; slot is the
+    // index of that thread, stable for the lifetime of the pool.
+    using Task = std::function<bool(size_t index, size_t slot, CancellationToken &cancel)>;
+
+    explicit RunPool(size_t slots);
+    ~RunPool();
+
+    RunPool(const RunPool &) = delete;
+    RunPool &operator=(const RunPool &) = delete;
+
+    size_t slot_count() const { return threads_.size(); }
+
+    // Time all slots together have spent running tests since startup
+    double busy_seconds() const { return busy_ns_.load(std::memory_order_relaxed) / 1e9; }
+
+    // Runs task for every index in [0, count) in parallel and blocks until
+    // done. As soon as a test fails, indices after it are skipped and those
+    // already running are cancelled; earlier ones still run to completion so
+    // the lowest failing index is always found. Returns that index, or count
+    // if every test passed. order, a permutation of the indices, is the
+    // order to start them in; it changes how soon a failure is found, never
+    // which one is reported.
+    size_t run_until_failure(size_t count, const Task &task, const std::vector<size_t> &order = {});
+
+private:
+    struct Batch;
+    struct Job
+    {
+        std::shared_ptr<Batch> batch;
+        size_t index;
+    };
+
+    void slot_loop(size_t slot);
+
+    std::vector<std::thread> threads_;
+    std::deque<Job> jobs_;
+    bool stopping_ = false;
+    std::atomic<uint64_t> busy_ns_{0};
+    std::mutex mutex_;
+    std::condition_variable jobs_available_;
+};
+
+#endif // RUN_POOL_H
@@ -4,260 +4,1292 @@
 #include <sys/wait.h>
 #include <sys/resource.h>
 #include <sys/mount.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <poll.h>
 #include <sched.h>
-#include <seccomp.h>
+#include <signal.h>
 #include <pwd.h>
 #include <grp.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <filesystem>
-#include <fstream>
 #include <iostream>
+#include <stdexcept>
 #include <cstring>
+#include <vector>
 
-SecureSandbox::SecureSandbox(const SandboxConfig &config) : config_(config)
+namespace
 {
-    sandbox_root_ = "/tmp/sandbox_" + std::to_string(getpid());
-    setup_chroot_environment();
+    void retire_zygote(pid_t pid, int control_fd)
+    {
+        if (control_fd != -1)
+        {
+            close(control_fd);
+        }
+        if (pid > 0)
+        {
+            kill(pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+        }
+    }
+
+    // Sent by a zygote in place of exec'ing the program; one byte, so it
+    // is never mistaken for the CPU time report
+    constexpr char kSetupFailed = 1;
+
+    // A zygote's exit status when it can't get the program started
+    constexpr int kSetupFailedStatus = 127;
+
+    // Tells the judge over the control socket, fd 3, that the run won't
+    // start, and exits. Async-signal-safe.
+    [[noreturn]] void abandon_run()
+    {
+        ssize_t sent = write(3, &kSetupFailed, sizeof(kSetupFailed));
+        (void)sent;
+        _exit(kSetupFailedStatus);
+    }
+
+    // Copies all of from into a new read-only /tmp/<name>. Async-signal-safe.
+    bool copy_to_tmp(const char *name, int from)
+    {
+        int tmp = open("/tmp", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (tmp == -1)
+        {
+            return false;
+        }
+        int to = openat(tmp, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+        close(tmp);
+        if (to == -1)
+        {
+            return false;
+        }
+
+        // From the start, whatever the offset of from
+        off_t offset = 0;
+        ssize_t copied;
+        do
+        {
+            copied = sendfile(to, from, &offset, 1 << 30);
+        } while (copied > 0 || (copied == -1 && errno == EINTR));
+        return close(to) == 0 && copied == 0;
+    }
+
+    long to_us(const struct timeval &tv)
+    {
+        return tv.tv_sec * 1000000L + tv.tv_usec;
+    }
+
+    // Moves fd to 3 and closes everything above it. Used by helpers forked
+    // from the judge, which must not hold on to fds they inherited, such as
+    // other runs' pipes.
+    bool keep_only(int fd)
+    {
+        if (fd != 3 && dup2(fd, 3) == -1)
+        {
+            return false;
+        }
+        fcntl(3, F_SETFD, FD_CLOEXEC);
+        if (close_range(4, ~0U, 0) == -1)
+        {
+            struct rlimit open_files;
+            getrlimit(RLIMIT_NOFILE, &open_files);
+            for (rlim_t i = 4; i < open_files.rlim_cur && i < 65536; i++)
+            {
+                close(static_cast<int>(i));
+            }
+        }
+        return true;
+    }
+
+    // Sends one or two fds
+    bool send_fds(int socket, const int *fds, size_t count)
+    {
+        char byte = 0;
+        char control[CMSG_SPACE(2 * sizeof(int))] = {};
+        struct iovec iov = {&byte, 1};
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+        ssize_t sent;
+        do
+        {
+            sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        } while (sent == -1 && errno == EINTR);
+        return sent == 1;
+    }
+
+    // Receives up to two fds into fds. Returns how many, 0 on EOF or error.
+    size_t receive_fds(int socket, int *fds)
+    {
+        char byte;
+        char control[CMSG_SPACE(2 * sizeof(int))];
+        struct iovec iov = {&byte, 1};
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t received;
+        do
+        {
+            received = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+        } while (received == -1 && errno == EINTR);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (received <= 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            return 0;
+        }
+        size_t count = 0;
+        if (cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int)))
+            count = 2;
+        else if (cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+            count = 1;
+        memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+        return count;
+    }
 }
 
-SecureSandbox::~SecureSandbox()
+void CancellationToken::cancel()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancelled_ = true;
+    if (pid_ > 0)
+    {
+        kill(pid_, SIGKILL);
+    }
+}
+
+bool CancellationToken::cancelled() const
 {
-    cleanup();
+    std::lock_guard<std::mutex> lock(mutex_);
+    return cancelled_;
 }
 
-bool SecureSandbox::setup_chroot_environment()
+bool CancellationToken::attach(pid_t pid)
 {
-    // Create sandbox directory
-    std::filesystem::create_directories(sandbox_root_);
-    std::filesystem::create_directories(sandbox_root_ + "/tmp");
-    std::filesystem::create_directories(sandbox_root_ + "/dev");
-    std::filesystem::create_directories(sandbox_root_ + "/proc");
-    std::filesystem::create_directories(sandbox_root_ + "/bin");
-    std::filesystem::create_directories(sandbox_root_ + "/lib");
-    std::filesystem::create_directories(sandbox_root_ + "/lib64");
-
-    // Copy essential binaries and libraries
-    // This is a simplified version - in production you'd copy only necessary files
-    return true;
+    std::lock_guard<std::mutex> lock(mutex_);
+    pid_ = pid;
+    return !cancelled_;
 }
 
-bool SecureSandbox::setup_seccomp_filter()
+void CancellationToken::detach()
+{
+    // Must happen before the child is reaped so cancel() never signals a
+    // recycled pid
+    std::lock_guard<std::mutex> lock(mutex_);
+    pid_ = -1;
+}
+
+SecureSandbox::SecureSandbox(const SandboxConfig &config) : config_(config)
 {
-    scmp_filter_ctx ctx = seccomp_init(SCMP_ACT_KILL);
-    if (!ctx)
+    // Slower runtimes get proportionally more time; a JVM needs threads
+    if (config_.language)
     {
-        return false;
+        const LanguageProfile &language = *config_.language;
+        config_.time_limit_ms = std::lround(config_.time_limit_ms * language.time_multiplier);
+        config_.wall_time_limit_ms = std::lround(config_.wall_time_limit_ms * language.time_multiplier);
+        config_.process_limit = std::max(config_.process_limit, language.threads);
+        config_.syscalls = language.syscalls;
+        zygote_command_ = language.zygote_command;
+        for (auto &arg : zygote_command_)
+        {
+            zygote_argv_.push_back(arg.data());
+        }
+        if (!zygote_argv_.empty())
+        {
+            zygote_argv_.push_back(nullptr);
+        }
+    }
+    for (auto &entry : config_.environment)
+    {
+        zygote_envp_.push_back(entry.data());
     }
+    zygote_envp_.push_back(nullptr);
 
-    // Allow essential system calls only
-    std::vector<int> allowed_syscalls = {
-        SCMP_SYS(read), SCMP_SYS(write), SCMP_SYS(exit), SCMP_SYS(exit_group),
-        SCMP_SYS(rt_sigreturn), SCMP_SYS(brk), SCMP_SYS(mmap), SCMP_SYS(munmap),
-        SCMP_SYS(mprotect), SCMP_SYS(close), SCMP_SYS(fstat), SCMP_SYS(lseek),
-        SCMP_SYS(arch_prctl), SCMP_SYS(access), SCMP_SYS(rt_sigaction),
-        SCMP_SYS(rt_sigprocmask), SCMP_SYS(ioctl), SCMP_SYS(readv), SCMP_SYS(writev)};
+    // Mount points outside /tmp are made once, in the shared tree. Under
+    // /tmp they are made by each zygote, in its own tmpfs.
+    if (config_.root)
+    {
+        const std::string &root = config_.root->path();
+        root_tmp_ = root + "/tmp";
+        root_tmp_options_ = "size=" + std::to_string(config_.memory_limit_mb) + "m,mode=1777";
+        auto add_bind = [&](const std::string &path, bool writable)
+        {
+            std::filesystem::path source = std::filesystem::absolute(path).lexically_normal();
+            std::error_code ec;
+            std::filesystem::create_directories(source, ec);
+            std::string target = root;
+            for (const auto &part : source.relative_path())
+            {
+                if (part.empty())
+                    continue;
+                target += "/" + part.string();
+                if (target.compare(0, root_tmp_.size() + 1, root_tmp_ + "/") != 0)
+                {
+                    std::filesystem::create_directories(target, ec);
+                }
+                else if (std::find(root_dirs_.begin(), root_dirs_.end(), target) == root_dirs_.end())
+                {
+                    root_dirs_.push_back(target);
+                }
+            }
+            root_binds_.push_back({source.string(), target, writable});
+        };
+        // Writable directories may lie inside read-only ones
+        for (const auto &path : config_.read_only_paths)
+            add_bind(path, false);
+        for (const auto &path : config_.writable_paths)
+            add_bind(path, true);
+    }
 
-    for (int syscall : allowed_syscalls)
+    CPU_ZERO(&run_cpus_);
+    for (int cpu : config_.cpus)
+    {
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &run_cpus_);
+    }
+    if (config_.numa_node >= 0 && config_.numa_node < static_cast<int>(8 * sizeof(run_nodes_)))
     {
-        if (seccomp_rule_add(ctx, SCMP_ACT_ALLOW, syscall, 0) < 0)
+        run_nodes_ = 1UL << config_.numa_node;
+    }
+
+    // Resolve the restricted user once here; getpwnam is not safe to call
+    // in a child forked from a multi-threaded process
+    if (!config_.user.empty())
+    {
+        struct passwd pw;
+        struct passwd *found = nullptr;
+        char buffer[4096];
+        if (getpwnam_r(config_.user.c_str(), &pw, buffer, sizeof(buffer), &found) != 0 || !found)
         {
-            seccomp_release(ctx);
-            return false;
+            // Never fall back to running as the judge
+            throw std::runtime_error("Sandbox user '" + config_.user + "' not found");
         }
+        run_uid_ = pw.pw_uid;
+        run_gid_ = pw.pw_gid;
     }
 
-    // Block dangerous syscalls explicitly
-    std::vector<int> blocked_syscalls = {
-        SCMP_SYS(fork), SCMP_SYS(vfork), SCMP_SYS(clone), SCMP_SYS(execve),
-        SCMP_SYS(ptrace), SCMP_SYS(kill), SCMP_SYS(socket), SCMP_SYS(connect),
-        SCMP_SYS(bind), SCMP_SYS(listen), SCMP_SYS(accept), SCMP_SYS(sendto),
-        SCMP_SYS(recvfrom), SCMP_SYS(mount), SCMP_SYS(umount2), SCMP_SYS(chroot)};
-
-    for (int syscall : blocked_syscalls)
+    seccomp_program_ = &seccomp_program(config_.syscalls);
+    if (seccomp_program_->empty())
     {
-        seccomp_rule_add(ctx, SCMP_ACT_KILL, syscall, 0);
+        // Zygotes refuse to exec anything without a filter
+        std::cerr << "Sandbox: failed to build seccomp filter" << std::endl;
     }
 
-    int result = seccomp_load(ctx);
-    seccomp_release(ctx);
-    return result == 0;
+    start_factory();
+    if (config_.prefork_count > 0)
+    {
+        prefork_thread_ = std::thread([this]
+                                      { prefork_loop(); });
+    }
 }
 
-bool SecureSandbox::setup_cgroups()
+SecureSandbox::~SecureSandbox()
 {
-    // Create cgroup for memory limiting
-    std::string cgroup_path = "/sys/fs/cgroup/memory/sandbox_" + std::to_string(getpid());
+    {
+        std::lock_guard<std::mutex> lock(zygote_mutex_);
+        stopping_ = true;
+    }
+    zygote_cv_.notify_all();
+    if (prefork_thread_.joinable())
+    {
+        prefork_thread_.join();
+    }
 
-    if (mkdir(cgroup_path.c_str(), 0755) == -1 && errno != EEXIST)
+    for (const auto &zygote : zygotes_)
     {
-        return false;
+        retire_zygote(zygote.pid, zygote.control_fd);
+    }
+
+    // EOF on its socket makes the factory exit
+    if (factory_fd_ != -1)
+    {
+        close(factory_fd_);
+        waitpid(factory_pid_, nullptr, 0);
     }
+}
 
-    // Set memory limit
-    std::ofstream memory_limit(cgroup_path + "/memory.limit_in_bytes");
-    if (memory_limit.is_open())
+SecureSandbox::SandboxResult SecureSandbox::execute(const std::string &executable_path, const std::string &input,
+                                                    CancellationToken *cancel, const OutputSink &on_output)
+{
+    std::shared_ptr<const InputFile> input_file;
+    try
     {
-        memory_limit << (config_.memory_limit_mb * 1024 * 1024);
-        memory_limit.close();
+        input_file = InputFile::create(input);
     }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Sandbox input error: " << e.what() << std::endl;
+        SandboxResult result = {};
+        result.exit_code = -1;
+        result.setup_failed = true;
+        return result;
+    }
+    return execute(executable_path, *input_file, cancel, on_output);
+}
 
-    // Add current process to cgroup
-    std::ofstream tasks(cgroup_path + "/tasks");
-    if (tasks.is_open())
+SecureSandbox::SandboxResult SecureSandbox::execute(const std::string &executable_path, const InputFile &input,
+                                                    CancellationToken *cancel, const OutputSink &on_output)
+{
+    // A warm interpreter is already running and only needs the program
+    if (!config_.language || !zygote_argv_.empty())
     {
-        tasks << getpid();
-        tasks.close();
+        return execute(std::vector<std::string>{executable_path}, input, cancel, on_output);
     }
+    return execute(expand_command(config_.language->run_command,
+                                  {{"{bin}", executable_path}, {"{memory_mb}", std::to_string(config_.memory_limit_mb)}}),
+                   input, cancel, on_output);
+}
+
+SecureSandbox::SandboxResult SecureSandbox::execute(const std::vector<std::string> &argv, const InputFile &input,
+                                                    CancellationToken *cancel, const OutputSink &on_output)
+{
+    return execute(argv, config_.environment, input, cancel, on_output);
+}
+
+SecureSandbox::SandboxResult SecureSandbox::execute(const std::vector<std::string> &argv,
+                                                    const std::vector<std::string> &env, const InputFile &input,
+                                                    CancellationToken *cancel, const OutputSink &on_output)
+{
+    return run(argv, env, input, {}, cancel, on_output);
+}
 
-    return true;
+SecureSandbox::SandboxResult SecureSandbox::execute(const std::vector<std::string> &argv, const InputFile &input,
+                                                    const std::vector<RunFile> &files, CancellationToken *cancel,
+                                                    const OutputSink &on_output)
+{
+    return run(argv, config_.environment, input, files, cancel, on_output);
 }
 
-SecureSandbox::SandboxResult SecureSandbox::execute(const std::string &executable_path, const std::string &input)
+SecureSandbox::SandboxResult SecureSandbox::run(const std::vector<std::string> &argv,
+                                                const std::vector<std::string> &env, const InputFile &input,
+                                                const std::vector<RunFile> &files, CancellationToken *cancel,
+                                                const OutputSink &on_output)
 {
+    auto started = std::chrono::steady_clock::now();
     SandboxResult result = {};
 
-    int input_pipe[2];
     int output_pipe[2];
     int error_pipe[2];
 
-    if (pipe(input_pipe) == -1 || pipe(output_pipe) == -1 || pipe(error_pipe) == -1)
+    // Files go into the run's own /tmp, which only a root gives it, and
+    // only a zygote still waiting for its run takes them
+    if (!files.empty() && (!config_.root || !zygote_argv_.empty() || files.size() > kMaxRunFiles))
     {
+        std::cerr << "Sandbox error: this sandbox can't give a run files" << std::endl;
         result.exit_code = -1;
+        result.setup_failed = true;
         return result;
     }
+    std::vector<std::string> file_names;
+    for (const auto &file : files)
+    {
+        if (file.name.empty() || file.name == "." || file.name == ".." || file.name.size() > NAME_MAX ||
+            file.name.find('/') != std::string::npos)
+        {
+            result.exit_code = -1;
+            result.setup_failed = true;
+            return result;
+        }
+        file_names.push_back(file.name);
+    }
+    const std::vector<std::string> &names = file_names;
 
-    pid_t pid = fork();
-    if (pid == 0)
+    // argv, file names and env travel as one datagram to the zygote: the
+    // number of arguments and of files, then every string NUL-terminated
+    uint32_t counts[2] = {static_cast<uint32_t>(argv.size()), static_cast<uint32_t>(files.size())};
+    std::string packed_run(reinterpret_cast<const char *>(counts), sizeof(counts));
+    for (const auto *strings : {&argv, &names, &env})
     {
-        // Child process - set up secure environment
+        for (const auto &arg : *strings)
+        {
+            if (arg.find('\0') != std::string::npos)
+            {
+                result.exit_code = -1;
+                result.setup_failed = true;
+                return result;
+            }
+            packed_run += arg;
+            packed_run += '\0';
+        }
+    }
+    if (argv.empty() || argv[0].empty() || argv[0].size() >= PATH_MAX ||
+        argv.size() + names.size() + env.size() > kMaxArgs ||
+        packed_run.size() > kMaxArgvBytes)
+    {
+        result.exit_code = -1;
+        result.setup_failed = true;
+        return result;
+    }
+
+    // The child reads its input straight from the memfd, so nothing has to
+    // be written while its output is being drained
+    int input_fd = input.open_reader();
+    if (input_fd == -1)
+    {
+        result.exit_code = -1;
+        result.setup_failed = true;
+        return result;
+    }
 
-        // Create new namespaces for isolation
-        if (unshare(CLONE_NEWPID | CLONE_NEWNET | CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWIPC) == -1)
+    // O_CLOEXEC keeps these pipes out of children forked concurrently by
+    // other workers, which would otherwise hold the write ends open
+    if (pipe2(output_pipe, O_CLOEXEC) == -1)
+    {
+        close(input_fd);
+        result.exit_code = -1;
+        result.setup_failed = true;
+        return result;
+    }
+    if (pipe2(error_pipe, O_CLOEXEC) == -1)
+    {
+        close(input_fd);
+        close(output_pipe[0]);
+        close(output_pipe[1]);
+        result.exit_code = -1;
+        result.setup_failed = true;
+        return result;
+    }
+
+    // A pooled zygote may have died since it was forked; fall back to a
+    // fresh one once before giving up
+    Zygote zygote = take_zygote();
+    bool running = zygote.pid != -1 && start_run(zygote, packed_run, input_fd, output_pipe[1], error_pipe[1], files);
+    if (!running)
+    {
+        retire_zygote(zygote.pid, zygote.control_fd);
+        zygote = spawn_zygote();
+        running = zygote.pid != -1 && start_run(zygote, packed_run, input_fd, output_pipe[1], error_pipe[1], files);
+    }
+
+    // The zygote has its own copies of the fds now
+    close(input_fd);
+    close(output_pipe[1]);
+    close(error_pipe[1]);
+
+    if (!running)
+    {
+        retire_zygote(zygote.pid, zygote.control_fd);
+        close(output_pipe[0]);
+        close(error_pipe[0]);
+        result.exit_code = -1;
+        result.setup_failed = true;
+        return result;
+    }
+
+    // Just before exec the zygote reports the CPU time it used itself, which
+    // is not the program's. The control socket is close-on-exec, so EOF on
+    // it marks the moment the program started (or the zygote gave up). A
+    // zygote that gives up says so; one that never reported got no further.
+    long cpu_baseline_us = 0;
+    bool reported = false;
+    bool gave_up = false;
+    while (true)
+    {
+        long report;
+        ssize_t received = recv(zygote.control_fd, &report, sizeof(report), 0);
+        if (received == -1 && errno == EINTR)
         {
-            exit(127);
+            continue;
         }
+        if (received == sizeof(kSetupFailed))
+        {
+            gave_up = true;
+            continue;
+        }
+        if (received != sizeof(report))
+        {
+            break;
+        }
+        cpu_baseline_us = report;
+        reported = true;
+    }
+    close(zygote.control_fd);
+    result.setup_failed = gave_up || !reported;
+    auto exec_started = std::chrono::steady_clock::now();
+    result.setup_time = std::chrono::duration_cast<std::chrono::microseconds>(exec_started - started);
 
-        // Set up resource limits
-        struct rlimit time_limit;
-        time_limit.rlim_cur = config_.time_limit_seconds;
-        time_limit.rlim_max = config_.time_limit_seconds;
-        setrlimit(RLIMIT_CPU, &time_limit);
+    // Refill the pool only now, so forking a replacement doesn't compete
+    // with this run getting started
+    zygote_cv_.notify_all();
 
-        struct rlimit mem_limit;
-        mem_limit.rlim_cur = config_.memory_limit_mb * 1024 * 1024;
-        mem_limit.rlim_max = config_.memory_limit_mb * 1024 * 1024;
-        setrlimit(RLIMIT_AS, &mem_limit);
+    pid_t pid = zygote.pid;
+    if (cancel && !cancel->attach(pid))
+    {
+        kill(pid, SIGKILL);
+    }
 
-        // Limit file descriptors
-        struct rlimit fd_limit;
-        fd_limit.rlim_cur = 64;
-        fd_limit.rlim_max = 64;
-        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    supervise(pid, output_pipe[0], error_pipe[0], cpu_baseline_us, on_output, result);
+    close(output_pipe[0]);
+    close(error_pipe[0]);
 
-        // Limit number of processes
-        struct rlimit proc_limit;
-        proc_limit.rlim_cur = 1;
-        proc_limit.rlim_max = 1;
-        setrlimit(RLIMIT_NPROC, &proc_limit);
+    if (cancel)
+    {
+        cancel->detach();
+        result.cancelled = cancel->cancelled();
+    }
+
+    // Wait for child process
+    int status;
+    struct rusage usage = {};
+    while (wait4(pid, &status, 0, &usage) == -1 && errno == EINTR)
+    {
+    }
+    result.wall_time =
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - exec_started);
+    result.cpu_time = std::chrono::microseconds(
+        std::max(0L, to_us(usage.ru_utime) + to_us(usage.ru_stime) - cpu_baseline_us));
+    result.peak_memory_kb = static_cast<size_t>(usage.ru_maxrss);
+
+    // The cgroup's peak also counts memory the program had the kernel
+    // allocate for it, and memory.max is what actually stopped it
+    if (zygote.cgroup)
+    {
+        CgroupPool::Usage cgroup_usage = zygote.cgroup->usage();
+        if (cgroup_usage.peak_memory_kb > 0)
+        {
+            result.peak_memory_kb = cgroup_usage.peak_memory_kb;
+        }
+        if (cgroup_usage.oom_killed)
+        {
+            result.memory_exceeded = true;
+        }
+    }
+
+    // Exact figures from the kernel settle runs that ended between checks
+    if (result.cpu_time.count() > config_.time_limit_ms * 1000)
+    {
+        result.timeout = true;
+    }
+    if (result.peak_memory_kb * 1024 > config_.memory_limit_mb * 1024 * 1024)
+    {
+        result.memory_exceeded = true;
+    }
+
+    if (WIFSIGNALED(status))
+    {
+        result.signal_killed = true;
+        result.signal = WTERMSIG(status);
+        if (WTERMSIG(status) == SIGXCPU)
+        {
+            result.timeout = true;
+        }
+    }
+    else if (WIFEXITED(status))
+    {
+        result.exit_code = WEXITSTATUS(status);
+    }
+
+    return result;
+}
+
+SecureSandbox::Zygote SecureSandbox::take_zygote()
+{
+    {
+        std::lock_guard<std::mutex> lock(zygote_mutex_);
+        if (!zygotes_.empty())
+        {
+            Zygote zygote = zygotes_.front();
+            zygotes_.pop_front();
+            return zygote;
+        }
+    }
+
+    // Pool drained or disabled; pay the setup cost inline
+    return spawn_zygote();
+}
+
+SecureSandbox::Zygote SecureSandbox::spawn_zygote()
+{
+    // The zygote is born in the cgroup the program will run in
+    CgroupPool::Lease cgroup;
+    if (config_.cgroups)
+    {
+        CgroupPool::Limits limits;
+        limits.memory_bytes = config_.memory_limit_mb * 1024 * 1024;
+        limits.max_pids = config_.process_limit;
+        limits.cpu_cores = config_.cpu_cores;
+        cgroup = config_.cgroups->acquire(limits);
+        if (!cgroup)
+        {
+            return {};
+        }
+    }
+    int cgroup_fd = cgroup ? cgroup->fd() : -1;
+
+    int control[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, control) == -1)
+    {
+        return {};
+    }
+
+    bool from_factory = false;
+    {
+        std::lock_guard<std::mutex> lock(factory_mutex_);
+        if (factory_fd_ != -1)
+        {
+            int fds[2] = {control[1], cgroup_fd};
+            from_factory = send_fds(factory_fd_, fds, cgroup ? 2 : 1);
+            if (!from_factory)
+            {
+                std::cerr << "Sandbox: zygote factory is gone; forking zygotes directly" << std::endl;
+                close(factory_fd_);
+                waitpid(factory_pid_, nullptr, 0);
+                factory_fd_ = -1;
+            }
+        }
+    }
+
+    pid_t pid = -1;
+    if (!from_factory)
+    {
+        pid_t judge_pid = getpid();
+        pid = fork_into_cgroup(cgroup_fd);
+        if (pid == 0)
+        {
+            zygote_main(control[1], judge_pid);
+        }
+    }
+
+    close(control[1]);
+    if (!from_factory && pid == -1)
+    {
+        close(control[0]);
+        return {};
+    }
+
+    // Only hand out zygotes that finished their setup. The ready message
+    // carries the zygote's pid, which we don't otherwise know when the
+    // factory forked it.
+    pid_t ready_pid = -1;
+    ssize_t received;
+    do
+    {
+        received = recv(control[0], &ready_pid, sizeof(ready_pid), 0);
+    } while (received == -1 && errno == EINTR);
+    if (received != sizeof(ready_pid) || (!from_factory && ready_pid != pid))
+    {
+        retire_zygote(pid, control[0]);
+        return {};
+    }
+    return {ready_pid, control[0], std::move(cgroup)};
+}
+
+void SecureSandbox::start_factory()
+{
+    // Orphaned zygotes have to be reparented to us rather than init,
+    // or we could not wait4() for them
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1)
+    {
+        std::cerr << "Sandbox: cannot become a subreaper; forking zygotes directly" << std::endl;
+        return;
+    }
+
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) == -1)
+    {
+        return;
+    }
+
+    pid_t judge_pid = getpid();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        factory_main(sockets[1], judge_pid);
+    }
+
+    close(sockets[1]);
+    if (pid == -1)
+    {
+        close(sockets[0]);
+        return;
+    }
+    factory_pid_ = pid;
+    factory_fd_ = sockets[0];
+}
 
-        // Change to restricted user if specified
-        if (!config_.user.empty())
+void SecureSandbox::factory_main(int request_fd, pid_t judge_pid)
+{
+    // Forked from a multi-threaded process: only async-signal-safe calls
+    if (!keep_only(request_fd))
+    {
+        _exit(kSetupFailedStatus);
+    }
+
+    // Each request carries the control socket for one new zygote, and the
+    // cgroup to start it in if there is one
+    while (true)
+    {
+        int fds[2];
+        size_t count = receive_fds(3, fds);
+        if (count == 0)
         {
-            struct passwd *pw = getpwnam(config_.user.c_str());
-            if (pw)
+            _exit(0);
+        }
+        int control_fd = fds[0];
+        int cgroup_fd = count == 2 ? fds[1] : -1;
+
+        // Fork twice so the zygote is orphaned and lands with the judge
+        pid_t middle = fork();
+        if (middle == 0)
+        {
+            if (fork_into_cgroup(cgroup_fd) == 0)
             {
-                setgid(pw->pw_gid);
-                setuid(pw->pw_uid);
+                zygote_main(control_fd, judge_pid);
             }
+            _exit(0);
+        }
+        close(control_fd);
+        if (cgroup_fd != -1)
+        {
+            close(cgroup_fd);
         }
+        if (middle > 0)
+        {
+            waitpid(middle, nullptr, 0);
+        }
+    }
+}
 
-        // Set up seccomp filter
-        setup_seccomp_filter();
+void SecureSandbox::zygote_main(int control_fd, pid_t judge_pid)
+{
+    // Runs in a child forked from a multi-threaded process: only
+    // async-signal-safe calls from here on.
 
-        // Disable core dumps
-        prctl(PR_SET_DUMPABLE, 0);
+    // Keep nothing from the judge but the control socket. A zygote can wait
+    // a long time, and inherited copies of other runs' pipes would keep
+    // those runs from ever seeing EOF.
+    if (!keep_only(control_fd))
+    {
+        _exit(kSetupFailedStatus);
+    }
 
-        // Set up pipes
-        dup2(input_pipe[0], STDIN_FILENO);
-        dup2(output_pipe[1], STDOUT_FILENO);
-        dup2(error_pipe[1], STDERR_FILENO);
+    // Create new namespaces for isolation
+    if (unshare(CLONE_NEWPID | CLONE_NEWNET | CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWIPC) == -1)
+    {
+        abandon_run();
+    }
 
-        close(input_pipe[0]);
-        close(input_pipe[1]);
-        close(output_pipe[0]);
-        close(output_pipe[1]);
-        close(error_pipe[0]);
-        close(error_pipe[1]);
+    // Into the shared root, with a /tmp of our own
+    if (config_.root && !enter_root())
+    {
+        abandon_run();
+    }
+
+    place_on_cpus();
+
+    // The judge ignores SIGPIPE; the program should not inherit that
+    signal(SIGPIPE, SIG_DFL);
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    sigprocmask(SIG_SETMASK, &no_signals, nullptr);
 
-        // Execute the program
-        execl(executable_path.c_str(), executable_path.c_str(), (char *)NULL);
-        exit(127);
+    // From the factory, we are the judge's child only once the middle
+    // process has exited
+    for (int i = 0; getppid() != judge_pid; i++)
+    {
+        if (i == 10000)
+        {
+            abandon_run();
+        }
+        struct timespec pause = {0, 100 * 1000};
+        nanosleep(&pause, nullptr);
     }
-    else if (pid > 0)
+
+    // A warm interpreter reports ready and takes the run itself. It is
+    // started once the limits below are in place, just as a program is.
+    const bool warm = !zygote_argv_.empty();
+    char packed_run[kMaxArgvBytes + 1];
+    char *args[kMaxArgs + 2];
+    char **envp = nullptr;
+    int stdio[3];
+    if (!warm)
     {
-        // Parent process
-        close(input_pipe[0]);
-        close(output_pipe[1]);
-        close(error_pipe[1]);
+        pid_t self = getpid();
+        if (send(3, &self, sizeof(self), MSG_NOSIGNAL) != sizeof(self))
+        {
+            _exit(0);
+        }
 
-        // Send input
-        write(input_pipe[1], input.c_str(), input.length());
-        close(input_pipe[1]);
+        // Wait for a run: its argv, files and env, with stdin, stdout,
+        // stderr and the files attached
+        char control[CMSG_SPACE((3 + kMaxRunFiles) * sizeof(int))];
+        struct iovec iov = {packed_run, sizeof(packed_run)};
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
 
-        // Read output
-        char buffer[4096];
-        ssize_t count;
-        while ((count = read(output_pipe[0], buffer, sizeof(buffer) - 1)) > 0)
+        ssize_t received;
+        do
+        {
+            received = recvmsg(3, &msg, MSG_CMSG_CLOEXEC);
+        } while (received == -1 && errno == EINTR);
+        if (received <= 0)
         {
-            buffer[count] = '\0';
-            result.output += buffer;
+            // The sandbox was destroyed or the judge exited
+            _exit(0);
         }
-        close(output_pipe[0]);
+        uint32_t counts[2];
+        if (static_cast<size_t>(received) > kMaxArgvBytes || static_cast<size_t>(received) <= sizeof(counts) ||
+            (msg.msg_flags & MSG_TRUNC) || packed_run[received - 1] != '\0')
+        {
+            abandon_run();
+        }
+        memcpy(counts, packed_run, sizeof(counts));
+        const uint32_t argc = counts[0];
+        const uint32_t file_count = counts[1];
 
-        // Read error output
-        while ((count = read(error_pipe[0], buffer, sizeof(buffer) - 1)) > 0)
+        size_t count = 0;
+        for (ssize_t i = sizeof(counts); i < received && count < kMaxArgs; i += strlen(packed_run + i) + 1)
         {
-            buffer[count] = '\0';
-            result.error += buffer;
+            args[count++] = packed_run + i;
         }
-        close(error_pipe[0]);
+        if (argc == 0 || argc > count || file_count > kMaxRunFiles || file_count > count - argc)
+        {
+            abandon_run();
+        }
+
+        // Both lists end in nullptr; the environment follows argv's, in
+        // place of the file names
+        const char *names[kMaxRunFiles];
+        memcpy(names, args + argc, file_count * sizeof(char *));
+        memmove(args + argc + 1, args + argc + file_count, (count - argc - file_count) * sizeof(char *));
+        args[argc] = nullptr;
+        args[count - file_count + 1] = nullptr;
+        envp = args + argc + 1;
 
-        // Wait for child process
-        int status;
-        waitpid(pid, &status, 0);
+        int fds[3 + kMaxRunFiles];
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN((3 + file_count) * sizeof(int)))
+        {
+            abandon_run();
+        }
+        memcpy(fds, CMSG_DATA(cmsg), (3 + file_count) * sizeof(int));
+        memcpy(stdio, fds, sizeof(stdio));
 
-        if (WIFSIGNALED(status))
+        // Still root, and the /tmp is this run's alone
+        for (uint32_t i = 0; i < file_count; i++)
         {
-            result.signal_killed = true;
-            result.signal = WTERMSIG(status);
-            if (WTERMSIG(status) == SIGXCPU)
+            if (!copy_to_tmp(names[i], fds[3 + i]))
             {
-                result.timeout = true;
+                abandon_run();
             }
+            close(fds[3 + i]);
+        }
+    }
+
+    // Set up resource limits. The judge enforces CPU time to the
+    // millisecond; RLIMIT_CPU is only a backstop a second later, with the
+    // soft limit below the hard one so that it raises SIGXCPU.
+    struct rlimit time_limit;
+    time_limit.rlim_cur = (config_.time_limit_ms + 999) / 1000 + 1;
+    time_limit.rlim_max = time_limit.rlim_cur + 1;
+    if (setrlimit(RLIMIT_CPU, &time_limit) == -1)
+    {
+        abandon_run();
+    }
+
+    // In a cgroup, memory.max holds the program to what it actually uses.
+    // Otherwise memory is judged on peak RSS, and address space gets room
+    // for the mappings a program reserves but never touches.
+    if (!config_.cgroups)
+    {
+        struct rlimit mem_limit;
+        mem_limit.rlim_cur = 2 * config_.memory_limit_mb * 1024 * 1024;
+        mem_limit.rlim_max = 2 * config_.memory_limit_mb * 1024 * 1024;
+        if (setrlimit(RLIMIT_AS, &mem_limit) == -1)
+        {
+            abandon_run();
+        }
+    }
+
+    // Limit file descriptors
+    struct rlimit fd_limit;
+    fd_limit.rlim_cur = 64;
+    fd_limit.rlim_max = 64;
+    if (setrlimit(RLIMIT_NOFILE, &fd_limit) == -1)
+    {
+        abandon_run();
+    }
+
+    // RLIMIT_NPROC counts every process of the sandbox user, not just this
+    // run's, so only pids.max can bound a run. Without a cgroup it is still
+    // the backstop against a fork bomb where forking is allowed at all.
+    if (!config_.cgroups && config_.syscalls == SyscallProfile::Compiler)
+    {
+        struct rlimit proc_limit;
+        proc_limit.rlim_cur = config_.process_limit;
+        proc_limit.rlim_max = config_.process_limit;
+        if (setrlimit(RLIMIT_NPROC, &proc_limit) == -1)
+        {
+            abandon_run();
+        }
+    }
+
+    // Change to restricted user if specified; never run as the judge, nor
+    // with the judge's supplementary groups
+    if (run_uid_ != static_cast<uid_t>(-1) &&
+        (setgroups(0, nullptr) == -1 || setgid(run_gid_) == -1 || setuid(run_uid_) == -1))
+    {
+        abandon_run();
+    }
+
+    // Received fds are O_CLOEXEC and disappear at exec
+    for (int i = 0; !warm && i < 3; i++)
+    {
+        if (dup2(stdio[i], i) == -1)
+        {
+            abandon_run();
+        }
+    }
+
+    // Disable core dumps
+    prctl(PR_SET_DUMPABLE, 0);
+
+    // Last chance to talk to the judge: the filter below forbids sendto.
+    // A warm interpreter keeps the socket across exec for its run.
+    if (!warm)
+    {
+        struct rusage self_usage;
+        getrusage(RUSAGE_SELF, &self_usage);
+        long cpu_us = to_us(self_usage.ru_utime) + to_us(self_usage.ru_stime);
+        send(3, &cpu_us, sizeof(cpu_us), MSG_NOSIGNAL);
+    }
+    else if (fcntl(3, F_SETFD, 0) == -1)
+    {
+        abandon_run();
+    }
+
+    // The filter lets only this path through execve. Install it; never
+    // run unfiltered.
+    const char *path = warm ? zygote_argv_[0] : args[0];
+    char *exec_path = seccomp_exec_path();
+    size_t path_size = strlen(path) + 1;
+    if (path_size > kSeccompExecPathSize)
+    {
+        abandon_run();
+    }
+    memcpy(exec_path, path, path_size);
+    if (!install_seccomp_program(*seccomp_program_))
+    {
+        abandon_run();
+    }
+
+    // Execute the program
+    if (warm)
+    {
+        execve(exec_path, zygote_argv_.data(), zygote_envp_.data());
+    }
+    else if (config_.syscalls == SyscallProfile::Compiler)
+    {
+        // The first process forked in the new pid namespace is its init,
+        // and none can be forked there once it exits. So the compiler runs
+        // as init in a child, and whatever it leaves behind goes with it.
+        // Its CPU time is then only known from wait4() when it ends.
+        pid_t child = fork();
+        if (child == 0)
+        {
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            execve(exec_path, args, envp);
+            abandon_run();
         }
-        else if (WIFEXITED(status))
+        if (child == -1)
         {
-            result.exit_code = WEXITSTATUS(status);
+            abandon_run();
         }
+        close(3);
+        int status = 0;
+        while (waitpid(child, &status, 0) == -1 && errno == EINTR)
+        {
+        }
+        _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 127);
     }
     else
     {
-        result.exit_code = -1;
+        execve(exec_path, args, envp);
     }
+    abandon_run();
+}
 
-    return result;
+void SecureSandbox::place_on_cpus()
+{
+    // Inherited by the program, which can't change either: its syscall
+    // filter allows neither. Left as is if the kernel refuses; the run is
+    // timed less steadily then, but judged the same.
+    if (CPU_COUNT(&run_cpus_) > 0)
+    {
+        sched_setaffinity(0, sizeof(run_cpus_), &run_cpus_);
+    }
+    if (run_nodes_ != 0)
+    {
+        syscall(SYS_set_mempolicy, MPOL_PREFERRED, &run_nodes_, 8 * sizeof(run_nodes_) + 1);
+    }
+}
+
+bool SecureSandbox::enter_root()
+{
+    // Nothing mounted from here on reaches the host, and all of it goes
+    // away with this mount namespace
+    if (mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) != 0 ||
+        mount("tmpfs", root_tmp_.c_str(), "tmpfs", MS_NOSUID | MS_NODEV, root_tmp_options_.c_str()) != 0)
+    {
+        return false;
+    }
+    for (const auto &dir : root_dirs_)
+    {
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            return false;
+        }
+    }
+    for (const auto &bind : root_binds_)
+    {
+        unsigned long flags = MS_BIND | MS_REMOUNT | MS_NOSUID | MS_NODEV | (bind.writable ? 0 : MS_RDONLY);
+        if (mount(bind.source.c_str(), bind.target.c_str(), nullptr, MS_BIND | MS_REC, nullptr) != 0 ||
+            mount(nullptr, bind.target.c_str(), nullptr, flags, nullptr) != 0)
+        {
+            return false;
+        }
+    }
+    return chroot(config_.root->path().c_str()) == 0 && chdir("/") == 0;
+}
+
+bool SecureSandbox::start_run(const Zygote &zygote, const std::string &packed_run, int input_fd, int output_fd,
+                              int error_fd, const std::vector<RunFile> &files)
+{
+    // Count only the program, not the zygote's own setup
+    if (zygote.cgroup)
+    {
+        zygote.cgroup->reset_usage();
+    }
+
+    int fds[3 + kMaxRunFiles] = {input_fd, output_fd, error_fd};
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        fds[3 + i] = files[i].fd;
+    }
+    size_t fds_size = (3 + files.size()) * sizeof(int);
+    char control[CMSG_SPACE(sizeof(fds))] = {};
+    struct iovec iov = {const_cast<char *>(packed_run.data()), packed_run.size()};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(fds_size);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fds_size);
+    memcpy(CMSG_DATA(cmsg), fds, fds_size);
+
+    ssize_t sent;
+    do
+    {
+        sent = sendmsg(zygote.control_fd, &msg, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    return sent == static_cast<ssize_t>(packed_run.size());
+}
+
+void SecureSandbox::prefork_loop()
+{
+    std::unique_lock<std::mutex> lock(zygote_mutex_);
+    while (true)
+    {
+        zygote_cv_.wait(lock, [this]
+                        { return stopping_ || zygotes_.size() < config_.prefork_count; });
+        if (stopping_)
+        {
+            return;
+        }
+
+        lock.unlock();
+        Zygote zygote = spawn_zygote();
+        lock.lock();
+
+        if (zygote.pid == -1)
+        {
+            // Out of processes or memory; don't spin
+            zygote_cv_.wait_for(lock, std::chrono::milliseconds(100), [this]
+                                { return stopping_; });
+            continue;
+        }
+        zygotes_.push_back(zygote);
+    }
 }
 
-void SecureSandbox::cleanup()
+void SecureSandbox::supervise(pid_t pid, int out_fd, int err_fd, long cpu_baseline_us, const OutputSink &on_output,
+                              SandboxResult &result)
 {
-    // Clean up sandbox directory
-    if (!sandbox_root_.empty())
+    // Drain stdout and stderr together so a child blocked on a full stderr
+    // pipe can't stall us while we wait for stdout to close
+    static constexpr size_t kStderrLimit = 64 * 1024;
+    if (!on_output)
     {
-        std::filesystem::remove_all(sandbox_root_);
+        result.output.reserve(std::min(config_.output_limit_bytes, kOutputReserveBytes));
     }
+    size_t output_bytes = 0;
+
+    // Time limits are enforced from here: RLIMIT_CPU only has whole seconds
+    // and never fires for a program that blocks or sleeps
+    const long cpu_limit_us = config_.time_limit_ms * 1000;
+    const long wall_limit_ms =
+        config_.wall_time_limit_ms > 0 ? config_.wall_time_limit_ms : 2 * config_.time_limit_ms + 1000;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(wall_limit_ms);
+
+    clockid_t cpu_clock;
+    bool have_cpu_clock = clock_getcpuclockid(pid, &cpu_clock) == 0;
 
-    // Clean up cgroup
-    std::string cgroup_path = "/sys/fs/cgroup/memory/sandbox_" + std::to_string(getpid());
-    rmdir(cgroup_path.c_str());
+    // Readable once the child exits, which also catches a program that
+    // closed its output and kept running
+    int pidfd = -1;
+#ifdef SYS_pidfd_open
+    pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#endif
+
+    struct pollfd fds[3] = {{out_fd, POLLIN, 0}, {err_fd, POLLIN, 0}, {pidfd, POLLIN, 0}};
+    int open_pipes = 2;
+    bool exited = false;
+    bool stopped = false;
+    char buffer[64 * 1024];
+
+    while (!stopped && (!exited || open_pipes > 0))
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline)
+        {
+            // After an exit only a leaked pipe can be left; just stop reading
+            if (!exited)
+            {
+                result.timeout = true;
+                kill(pid, SIGKILL);
+            }
+            break;
+        }
+        long wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1;
+
+        struct timespec cpu;
+        if (!exited && have_cpu_clock && clock_gettime(cpu_clock, &cpu) == 0)
+        {
+            long used_us = cpu.tv_sec * 1000000L + cpu.tv_nsec / 1000 - cpu_baseline_us;
+            if (used_us >= cpu_limit_us)
+            {
+                result.timeout = true;
+                kill(pid, SIGKILL);
+                break;
+            }
+
+            // A single-threaded program can't use CPU faster than the wall
+            // clock runs, so waking when the rest could have run out is exact
+            wait_ms = std::min(wait_ms, (cpu_limit_us - used_us + 999) / 1000);
+        }
+
+        if (pidfd == -1 && !exited && open_pipes == 0)
+        {
+            // No pidfd on this kernel: look for the exit without reaping
+            siginfo_t info = {};
+            if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pid)
+            {
+                break;
+            }
+            wait_ms = std::min(wait_ms, 10L);
+        }
+
+        if (poll(fds, 3, static_cast<int>(wait_ms)) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            kill(pid, SIGKILL);
+            break;
+        }
+
+        if (fds[2].fd != -1 && (fds[2].revents & (POLLIN | POLLHUP | POLLERR)))
+        {
+            // Keep reading; the pipes may still hold the last of the output
+            exited = true;
+            fds[2].fd = -1;
+        }
+
+        for (int i = 0; i < 2; i++)
+        {
+            struct pollfd &pfd = fds[i];
+            if (pfd.fd < 0 || !(pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+            {
+                continue;
+            }
+
+            ssize_t count = read(pfd.fd, buffer, sizeof(buffer));
+            if (count == -1 && (errno == EINTR || errno == EAGAIN))
+            {
+                continue;
+            }
+            if (count <= 0)
+            {
+                pfd.fd = -1;
+                open_pipes--;
+                continue;
+            }
+
+            if (i == 0)
+            {
+                if (output_bytes + count > config_.output_limit_bytes)
+                {
+                    // Stop a runaway printer now rather than buffer all of it
+                    result.output_limit_exceeded = true;
+                    kill(pid, SIGKILL);
+                    stopped = true;
+                    break;
+                }
+                output_bytes += count;
+
+                if (!on_output)
+                {
+                    result.output.append(buffer, count);
+                }
+                else if (!on_output(buffer, count))
+                {
+                    // The verdict is already known; no point letting it run on
+                    result.output_rejected = true;
+                    kill(pid, SIGKILL);
+                    stopped = true;
+                    break;
+                }
+            }
+            else if (result.error.size() < kStderrLimit)
+            {
+                // stderr is diagnostics only; keep the head and discard the rest
+                result.error.append(buffer, std::min<size_t>(count, kStderrLimit - result.error.size()));
+            }
+        }
+    }
+
+    if (pidfd != -1)
+    {
+        close(pidfd);
+    }
 }
\ No newline at end of file
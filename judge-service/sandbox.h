@@ -1,21 +1,86 @@
 #ifndef SANDBOX_H
 #define SANDBOX_H
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <string>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sched.h>
+#include <sys/types.h>
+
+#include "cgroup_pool.h"
+#include "input_file.h"
+#include "language.h"
+#include "sandbox_root.h"
+#include "seccomp_profile.h"
+
+// Lets another thread kill a run that is in progress, e.g. when an earlier
+// test of the same submission has already failed.
+class CancellationToken
+{
+public:
+    void cancel();
+    bool cancelled() const;
+
+private:
+    friend class SecureSandbox;
+
+    // Returns false if the token was cancelled before the run started.
+    bool attach(pid_t pid);
+    void detach();
+
+    mutable std::mutex mutex_;
+    pid_t pid_ = -1;
+    bool cancelled_ = false;
+};
 
 class SecureSandbox
 {
 public:
     struct SandboxConfig
     {
-        std::string chroot_dir;
         std::string user;
         std::string group;
         size_t memory_limit_mb = 256;
-        int time_limit_seconds = 2;
+        long time_limit_ms = 2000;     // CPU time
+        long wall_time_limit_ms = 0;   // 0 means twice the CPU limit plus a second
+        size_t output_limit_bytes = 64 * 1024 * 1024;
         bool enable_network = false;
         bool enable_filesystem_write = false;
+        // Warm, already-isolated processes kept ready to become the next
+        // run. 0 spawns one on demand for every run.
+        size_t prefork_count = 2;
+        // Each run gets a cgroup from here with memory_limit_mb as
+        // memory.max. Without one, memory is only bounded by RLIMIT_AS.
+        std::shared_ptr<CgroupPool> cgroups;
+        size_t process_limit = 1; // pids.max, counting threads
+        unsigned cpu_cores = 1;   // cpu.max
+        // Programs see only this environment, never the judge's
+        std::vector<std::string> environment{"PATH=/usr/bin:/bin", "LANG=C.UTF-8"};
+        // Allowed syscalls when there is no language, e.g. Compiler for the
+        // compile sandboxes. A language brings its own.
+        SyscallProfile syscalls = SyscallProfile::Native;
+        // Runtime programs run on: the command around them, a multiplier
+        // on the time limits, the syscalls allowed and any warm start.
+        // nullptr runs native executables as they are.
+        std::shared_ptr<const LanguageProfile> language;
+        // Programs are chrooted into this, with a tmpfs /tmp of up to
+        // memory_limit_mb of their own. Of the host they see the system
+        // directories and these, at the same paths: where their binaries
+        // are and, for a compiler, where it writes. Listed directories are
+        // created if missing. nullptr leaves programs in the host's tree.
+        std::shared_ptr<SandboxRoot> root;
+        std::vector<std::string> read_only_paths;
+        std::vector<std::string> writable_paths;
+        // Programs run only on these CPUs and take memory from numa_node
+        // first. Empty leaves them on whatever CPUs the judge may use.
+        std::vector<int> cpus;
+        int numa_node = -1;
     };
 
     struct SandboxResult
@@ -23,26 +88,154 @@ public:
         int exit_code;
         bool timeout;
         bool memory_exceeded;
+        bool output_limit_exceeded;
+        bool output_rejected;
         bool signal_killed;
+        bool cancelled;
+        // The program never got to run, e.g. no zygote, pipe or cgroup
+        // slot could be had or its exec failed. The judge's fault, so
+        // nothing else in the result says anything about the program.
+        bool setup_failed;
         int signal;
         std::string output;
         std::string error;
+        // Time from execute() being called until the program was handed to
+        // a sandboxed process to exec
+        std::chrono::microseconds setup_time;
+        // Measured from exec until the program was reaped
+        std::chrono::microseconds cpu_time;
+        std::chrono::microseconds wall_time;
+        size_t peak_memory_kb;
+    };
+
+    // Receives stdout as it is read instead of it being buffered in
+    // SandboxResult::output. Returning false kills the child and marks the
+    // result output_rejected.
+    using OutputSink = std::function<bool(const char *data, size_t size)>;
+
+    // A file the program finds in its /tmp, copied there from fd before it
+    // starts. name is a plain file name, not a path.
+    struct RunFile
+    {
+        std::string name;
+        int fd;
     };
 
+    // Bounds on the argv, environment and file names of a run together,
+    // which reach the zygote as one datagram
+    static constexpr size_t kMaxArgvBytes = 32 * 1024;
+    static constexpr size_t kMaxArgs = 256;
+    static constexpr size_t kMaxRunFiles = 4;
+
+    // Throws if config.user doesn't exist, rather than run programs as
+    // the judge
     SecureSandbox(const SandboxConfig &config);
     ~SecureSandbox();
 
-    SandboxResult execute(const std::string &executable_path, const std::string &input);
+    // Safe to call concurrently on the same instance. If cancel is given,
+    // cancelling it kills the child and the result is marked cancelled.
+    // The program runs through the language's run command, if any.
+    SandboxResult execute(const std::string &executable_path, const InputFile &input,
+                          CancellationToken *cancel = nullptr, const OutputSink &on_output = {});
+
+    // Runs argv[0] with these arguments and environment ("NAME=value"
+    // entries), e.g. a compiler. argv[0] must be an absolute path; argv and
+    // env together are capped at kMaxArgvBytes and kMaxArgs.
+    SandboxResult execute(const std::vector<std::string> &argv, const std::vector<std::string> &env,
+                          const InputFile &input, CancellationToken *cancel = nullptr,
+                          const OutputSink &on_output = {});
+
+    // Same, in the configured environment
+    SandboxResult execute(const std::vector<std::string> &argv, const InputFile &input,
+                          CancellationToken *cancel = nullptr, const OutputSink &on_output = {});
+
+    // Same, with files in the program's /tmp, e.g. what a checker is to
+    // read. Only a sandbox with a root has a /tmp of each run's own, so
+    // without one the run fails setup; so does one on a warm interpreter.
+    SandboxResult execute(const std::vector<std::string> &argv, const InputFile &input,
+                          const std::vector<RunFile> &files, CancellationToken *cancel = nullptr,
+                          const OutputSink &on_output = {});
+
+    // Convenience overload that stages input in a temporary InputFile.
+    SandboxResult execute(const std::string &executable_path, const std::string &input,
+                          CancellationToken *cancel = nullptr, const OutputSink &on_output = {});
 
 private:
+    // A forked child that has already unshared its namespaces and waits on
+    // control_fd for the program to exec and the fds to run it with. With
+    // cgroups it was started inside its own slot and keeps it for the run.
+    struct Zygote
+    {
+        pid_t pid = -1;
+        int control_fd = -1;
+        CgroupPool::Lease cgroup;
+    };
+
+    // Up-front capacity for captured stdout; most outputs fit without regrowth
+    static constexpr size_t kOutputReserveBytes = 1024 * 1024;
+
+    // A directory of the host bound into the root
+    struct RootBind
+    {
+        std::string source;
+        std::string target;
+        bool writable;
+    };
+
     SandboxConfig config_;
-    std::string sandbox_root_;
+    uid_t run_uid_ = static_cast<uid_t>(-1);
+    gid_t run_gid_ = static_cast<gid_t>(-1);
+
+    // Shared by every sandbox of the profile; a zygote only has to hand
+    // it to the kernel
+    const std::vector<sock_filter> *seccomp_program_ = nullptr;
+
+    // The language's zygote_command and the configured environment, ready
+    // for execve in a forked child
+    std::vector<std::string> zygote_command_;
+    std::vector<char *> zygote_argv_;
+    std::vector<char *> zygote_envp_;
+
+    // What a zygote mounts on entering the root, worked out up front: the
+    // mount points to create once /tmp is empty, in order, then the binds
+    std::string root_tmp_;
+    std::string root_tmp_options_;
+    std::vector<std::string> root_dirs_;
+    std::vector<RootBind> root_binds_;
+
+    // config_.cpus and numa_node, as a zygote hands them to the kernel
+    cpu_set_t run_cpus_;
+    unsigned long run_nodes_ = 0;
+
+    std::mutex zygote_mutex_;
+    std::condition_variable zygote_cv_;
+    std::deque<Zygote> zygotes_;
+    std::thread prefork_thread_;
+    bool stopping_ = false;
+
+    // Zygotes are forked by this small helper, started before the judge
+    // has grown, and reparented to us. Forked straight from a large judge
+    // they would inherit its RSS, and wait4() would report that as the
+    // program's peak memory.
+    pid_t factory_pid_ = -1;
+    int factory_fd_ = -1;
+    std::mutex factory_mutex_;
 
-    bool setup_chroot_environment();
-    bool setup_namespaces();
-    bool setup_seccomp_filter();
-    bool setup_cgroups();
-    void cleanup();
+    SandboxResult run(const std::vector<std::string> &argv, const std::vector<std::string> &env,
+                      const InputFile &input, const std::vector<RunFile> &files, CancellationToken *cancel,
+                      const OutputSink &on_output);
+    void supervise(pid_t pid, int out_fd, int err_fd, long cpu_baseline_us, const OutputSink &on_output,
+                   SandboxResult &result);
+    void start_factory();
+    [[noreturn]] void factory_main(int request_fd, pid_t judge_pid);
+    Zygote take_zygote();
+    Zygote spawn_zygote();
+    [[noreturn]] void zygote_main(int control_fd, pid_t judge_pid);
+    bool enter_root();
+    void place_on_cpus();
+    bool start_run(const Zygote &zygote, const std::string &packed_run, int input_fd, int output_fd, int error_fd,
+                   const std::vector<RunFile> &files);
+    void prefork_loop();
 };
 
 #endif // SANDBOX_H
\ No newline at end of file
@@ -0,0 +1,140 @@
+#include "sandbox_root.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    // Programs, their libraries and what those read at startup: the
+    // dynamic loader's cache, alternatives links, JDK configuration
+    const char *const kSystemDirs[] = {"/usr", "/bin", "/sbin", "/lib", "/lib32", "/lib64", "/libx32", "/etc"};
+
+    const char *const kDevices[] = {"/dev/null", "/dev/zero", "/dev/full", "/dev/random", "/dev/urandom"};
+
+    // Flags the source mount has that a remount must keep, or it fails
+    // with EPERM inside a container
+    unsigned long locked_flags(const std::string &path)
+    {
+        struct statvfs info;
+        if (statvfs(path.c_str(), &info) != 0)
+        {
+            return 0;
+        }
+        unsigned long flags = 0;
+        if (info.f_flag & ST_NODEV)
+            flags |= MS_NODEV;
+        if (info.f_flag & ST_NOEXEC)
+            flags |= MS_NOEXEC;
+        if (info.f_flag & ST_NOSUID)
+            flags |= MS_NOSUID;
+        return flags;
+    }
+}
+
+std::shared_ptr<SandboxRoot> SandboxRoot::create(const std::string &path)
+{
+    std::shared_ptr<SandboxRoot> root(new SandboxRoot(path));
+
+    std::error_code ec;
+    fs::create_directories(path + "/tmp", ec);
+    fs::create_directories(path + "/dev", ec);
+    if (ec || chmod(path.c_str(), 0755) != 0)
+    {
+        throw std::runtime_error("cannot create " + path + ": " + (ec ? ec.message() : strerror(errno)));
+    }
+
+    for (const char *dir : kSystemDirs)
+    {
+        // Merged /usr: /bin and friends are links into it, and stay links
+        std::string target = path + dir;
+        char link[PATH_MAX];
+        ssize_t length = readlink(dir, link, sizeof(link) - 1);
+        if (length > 0)
+        {
+            link[length] = '\0';
+            if (!fs::is_symlink(target, ec))
+            {
+                fs::remove(target, ec);
+                if (symlink(link, target.c_str()) != 0)
+                {
+                    throw std::runtime_error("cannot create " + target + ": " + strerror(errno));
+                }
+            }
+            continue;
+        }
+        if (!fs::is_directory(dir, ec))
+        {
+            continue;
+        }
+        if (!root->bind(dir, false))
+        {
+            throw std::runtime_error("cannot bind " + std::string(dir) + " into " + path + ": " + strerror(errno));
+        }
+    }
+
+    for (const char *device : kDevices)
+    {
+        if (access(device, F_OK) == 0 && !root->bind(device, true))
+        {
+            throw std::runtime_error("cannot bind " + std::string(device) + " into " + path + ": " + strerror(errno));
+        }
+    }
+    return root;
+}
+
+SandboxRoot::SandboxRoot(std::string path) : path_(std::move(path))
+{
+}
+
+SandboxRoot::~SandboxRoot()
+{
+    for (auto it = mounts_.rbegin(); it != mounts_.rend(); ++it)
+    {
+        umount2(it->c_str(), MNT_DETACH);
+    }
+}
+
+bool SandboxRoot::bind(const std::string &source, bool is_file)
+{
+    std::string target = path_ + source;
+
+    // Whatever an earlier judge mounted here is replaced
+    while (umount2(target.c_str(), MNT_DETACH) == 0)
+    {
+    }
+
+    if (is_file)
+    {
+        int fd = open(target.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1)
+        {
+            return false;
+        }
+        close(fd);
+    }
+    else if (mkdir(target.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        return false;
+    }
+
+    // A bind ignores MS_RDONLY; it takes a remount. Devices need exec'ing
+    // nothing, directories need no device nodes.
+    unsigned long flags = MS_BIND | MS_REMOUNT | MS_RDONLY | MS_NOSUID | (is_file ? MS_NOEXEC : MS_NODEV);
+    if (mount(source.c_str(), target.c_str(), nullptr, MS_BIND | MS_REC, nullptr) != 0)
+    {
+        return false;
+    }
+    mounts_.push_back(target);
+    return mount(nullptr, target.c_str(), nullptr, flags | locked_flags(source), nullptr) == 0;
+}
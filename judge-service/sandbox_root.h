@@ -0,0 +1,42 @@
+#ifndef SANDBOX_ROOT_H
+#define SANDBOX_ROOT_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// The root filesystem sandboxed programs run in: the host's system
+// directories bound read-only and a /dev with only the harmless devices,
+// nothing else. It is built once and shared by every sandbox. A zygote
+// enters it from its own mount namespace, on a fresh tmpfs /tmp, so what a
+// run writes goes away with the namespace and there is nothing to reset.
+//
+// There is no /proc: a pid namespace's own procfs could only be mounted
+// from inside it, and the host's would show the judge.
+class SandboxRoot
+{
+public:
+    // Builds the tree at path, taking over one an earlier judge left
+    // there. Throws std::runtime_error if it can't bind mount, which needs
+    // CAP_SYS_ADMIN.
+    static std::shared_ptr<SandboxRoot> create(const std::string &path);
+
+    // Unmounts the system directories; the empty tree stays for the next
+    // judge
+    ~SandboxRoot();
+
+    SandboxRoot(const SandboxRoot &) = delete;
+    SandboxRoot &operator=(const SandboxRoot &) = delete;
+
+    const std::string &path() const { return path_; }
+
+private:
+    explicit SandboxRoot(std::string path);
+
+    bool bind(const std::string &source, bool is_file);
+
+    std::string path_;
+    std::vector<std::string> mounts_;
+};
+
+#endif // SANDBOX_ROOT_H
@@ -0,0 +1,235 @@
+#include "scheduler.h"
+
+#include <algorithm>
+#include <iterator>
+#include <sstream>
+
+namespace
+{
+    // Weight of the newest judgement in a problem's expected cost
+    constexpr double kCostSmoothing = 0.3;
+}
+
+Scheduler::Scheduler(std::vector<std::string> lanes, std::chrono::milliseconds default_cost)
+    : default_cost_(default_cost), lanes_(std::max<size_t>(lanes.size(), 1))
+{
+    for (size_t i = 0; i < lanes.size(); i++)
+    {
+        lanes_[i].stats.name = std::move(lanes[i]);
+    }
+}
+
+std::optional<Scheduler::Job> Scheduler::parse(size_t lane, const std::string &entry)
+{
+    Job job;
+    job.lane = lane;
+    job.entry = entry;
+    job.enqueued = Clock::now();
+
+    std::istringstream fields(entry);
+    std::string id, user, problem, enqueued_ms, attempts;
+    std::getline(fields, id, ':');
+    std::getline(fields, user, ':');
+    std::getline(fields, problem, ':');
+    std::getline(fields, enqueued_ms, ':');
+    std::getline(fields, attempts, ':');
+
+    try
+    {
+        size_t used = 0;
+        job.submission_id = std::stoi(id, &used);
+        if (used != id.size())
+        {
+            return std::nullopt;
+        }
+        job.user = user;
+        if (!problem.empty())
+        {
+            job.problem_id = std::stoi(problem);
+        }
+        if (!enqueued_ms.empty())
+        {
+            job.enqueued = Clock::time_point(std::chrono::milliseconds(std::stoll(enqueued_ms)));
+        }
+        if (!attempts.empty())
+        {
+            job.attempts = std::stoi(attempts);
+        }
+    }
+    catch (const std::exception &)
+    {
+        return std::nullopt;
+    }
+    return job;
+}
+
+std::string Scheduler::format(const Job &job)
+{
+    auto enqueued_ms = std::chrono::duration_cast<std::chrono::milliseconds>(job.enqueued.time_since_epoch());
+    return std::to_string(job.submission_id) + ":" + job.user + ":" + std::to_string(job.problem_id) + ":" +
+           std::to_string(enqueued_ms.count()) + ":" + std::to_string(job.attempts);
+}
+
+size_t Scheduler::pending(size_t lane) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return lane < lanes_.size() ? lanes_[lane].pending.size() : 0;
+}
+
+void Scheduler::add(Job job)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    job.lane = std::min(job.lane, lanes_.size() - 1);
+    lanes_[job.lane].pending.push_back(std::move(job));
+}
+
+double Scheduler::expected_cost_locked(int problem_id) const
+{
+    auto it = problem_cost_ms_.find(problem_id);
+    return it != problem_cost_ms_.end() ? it->second : static_cast<double>(default_cost_.count());
+}
+
+std::optional<Scheduler::Job> Scheduler::next()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto lane_it = std::find_if(lanes_.begin(), lanes_.end(), [](const Lane &lane)
+                                { return !lane.pending.empty(); });
+    if (lane_it == lanes_.end())
+    {
+        return std::nullopt;
+    }
+    Lane &lane = *lane_it;
+
+    // A user's next job starts where their last one finished, or at the
+    // lane's clock if they have been idle. The earliest finish wins, which
+    // favours both users who have had little and jobs that are cheap;
+    // ties keep arrival order.
+    size_t best = 0;
+    double best_start = 0;
+    double best_finish = 0;
+    for (size_t i = 0; i < lane.pending.size(); i++)
+    {
+        const Job &job = lane.pending[i];
+        auto user = lane.user_time.find(job.user);
+        double start = std::max(lane.clock, user != lane.user_time.end() ? user->second : 0.0);
+        double finish = start + expected_cost_locked(job.problem_id);
+        if (i == 0 || finish < best_finish)
+        {
+            best = i;
+            best_start = start;
+            best_finish = finish;
+        }
+    }
+
+    Job job = std::move(lane.pending[best]);
+    lane.pending.erase(lane.pending.begin() + best);
+    lane.clock = best_start;
+    lane.user_time[job.user] = best_finish;
+
+    // Anyone at or behind the clock would restart from it anyway
+    for (auto it = lane.user_time.begin(); it != lane.user_time.end();)
+    {
+        it = it->second <= lane.clock ? lane.user_time.erase(it) : std::next(it);
+    }
+
+    auto wait = std::max(std::chrono::milliseconds(0),
+                         std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - job.enqueued));
+    lane.stats.started++;
+    lane.stats.total_wait += wait;
+    lane.stats.max_wait = std::max(lane.stats.max_wait, wait);
+
+    in_flight_.emplace(job.submission_id, job);
+    return job;
+}
+
+std::optional<Scheduler::Job> Scheduler::finish(int submission_id)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto range = in_flight_.equal_range(submission_id);
+    if (range.first == range.second)
+    {
+        return std::nullopt;
+    }
+    auto oldest = std::min_element(range.first, range.second, [](const auto &a, const auto &b)
+                                   { return a.second.enqueued < b.second.enqueued; });
+    Job job = std::move(oldest->second);
+    in_flight_.erase(oldest);
+
+    LaneStats &stats = lanes_[job.lane].stats;
+    stats.finished++;
+    stats.total_latency += std::max(std::chrono::milliseconds(0),
+                                    std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - job.enqueued));
+    return job;
+}
+
+int Scheduler::record_failure(int submission_id)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto range = in_flight_.equal_range(submission_id);
+    if (range.first == range.second)
+    {
+        return 0;
+    }
+    auto oldest = std::min_element(range.first, range.second, [](const auto &a, const auto &b)
+                                   { return a.second.enqueued < b.second.enqueued; });
+    return ++oldest->second.attempts;
+}
+
+void Scheduler::record_cost(int problem_id, std::chrono::milliseconds cost)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = problem_cost_ms_.find(problem_id);
+    if (it == problem_cost_ms_.end())
+    {
+        problem_cost_ms_.emplace(problem_id, static_cast<double>(cost.count()));
+    }
+    else
+    {
+        it->second += kCostSmoothing * (static_cast<double>(cost.count()) - it->second);
+    }
+}
+
+std::chrono::milliseconds Scheduler::expected_work() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    double total = 0;
+    for (const auto &lane : lanes_)
+    {
+        for (const auto &job : lane.pending)
+            total += expected_cost_locked(job.problem_id);
+    }
+    for (const auto &entry : in_flight_)
+        total += expected_cost_locked(entry.second.problem_id);
+    return std::chrono::milliseconds(static_cast<long long>(total));
+}
+
+std::vector<Scheduler::Job> Scheduler::shed(std::chrono::milliseconds excess)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<Job> shed;
+    double remaining = static_cast<double>(excess.count());
+    for (auto lane = lanes_.rbegin(); lane != lanes_.rend() && remaining > 0; ++lane)
+    {
+        while (!lane->pending.empty() && remaining > 0)
+        {
+            auto latest = std::max_element(lane->pending.begin(), lane->pending.end(), [](const Job &a, const Job &b)
+                                           { return a.enqueued < b.enqueued; });
+            remaining -= expected_cost_locked(latest->problem_id);
+            shed.push_back(std::move(*latest));
+            lane->pending.erase(latest);
+        }
+    }
+    return shed;
+}
+
+std::vector<Scheduler::LaneStats> Scheduler::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<LaneStats> result;
+    for (const auto &lane : lanes_)
+    {
+        result.push_back(lane.stats);
+        result.back().pending = lane.pending.size();
+    }
+    return result;
+}
@@ -0,0 +1,112 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Decides which queued submission a pod judges next. Lanes are served in
+// strict priority order, so a bulk rejudge never delays live contest work.
+// Within a lane, users get fair shares of judge time (start-time fair
+// queueing), and of equally entitled submissions the one expected to be
+// cheapest goes first. Expected cost is learned per problem from earlier
+// judgements. Thread-safe.
+class Scheduler
+{
+public:
+    using Clock = std::chrono::system_clock;
+
+    struct Job
+    {
+        int submission_id = 0;
+        size_t lane = 0;
+        std::string user;   // fair-share key; empty for anonymous entries
+        int problem_id = 0; // 0 if the entry didn't say
+        Clock::time_point enqueued;
+        std::string entry; // as it sits in the queue, for acking it
+        int attempts = 0;  // failed tries at it so far, on any pod
+    };
+
+    // Counters since startup
+    struct LaneStats
+    {
+        std::string name;
+        size_t pending = 0;
+        uint64_t started = 0;
+        uint64_t finished = 0;
+        std::chrono::milliseconds total_wait{0};    // enqueued until started
+        std::chrono::milliseconds max_wait{0};
+        std::chrono::milliseconds total_latency{0}; // enqueued until finished
+    };
+
+    // lanes are named in priority order, highest first
+    explicit Scheduler(std::vector<std::string> lanes,
+                       std::chrono::milliseconds default_cost = std::chrono::milliseconds(1000));
+
+    Scheduler(const Scheduler &) = delete;
+    Scheduler &operator=(const Scheduler &) = delete;
+
+    // Parses a queue entry: "<id>" or
+    // "<id>:<user>:<problem>:<enqueued unix ms>[:<attempts>]". Entries
+    // without a timestamp count as enqueued now.
+    static std::optional<Job> parse(size_t lane, const std::string &entry);
+
+    // The queue entry that puts job back with its attempts so far
+    static std::string format(const Job &job);
+
+    size_t lane_count() const { return lanes_.size(); }
+    size_t pending(size_t lane) const;
+
+    void add(Job job);
+
+    // Removes and returns the job to run next, or nullopt if none is
+    // pending. The job is in flight until finish() is called for it.
+    std::optional<Job> next();
+
+    // Ends the oldest in-flight job for submission_id and returns it
+    std::optional<Job> finish(int submission_id);
+
+    // Counts a failed try at the oldest in-flight job for submission_id
+    // and returns its attempts so far, 0 if none is in flight
+    int record_failure(int submission_id);
+
+    // Feeds how long judging a submission of problem_id took into its
+    // expected cost
+    void record_cost(int problem_id, std::chrono::milliseconds cost);
+
+    // Expected judging time of every job pending or in flight
+    std::chrono::milliseconds expected_work() const;
+
+    // Removes pending jobs, lowest lane and latest arrival first, until
+    // their expected cost reaches excess, and returns them. For handing
+    // work back to the queue when this pod has taken on too much.
+    std::vector<Job> shed(std::chrono::milliseconds excess);
+
+    std::vector<LaneStats> stats() const;
+
+private:
+    struct Lane
+    {
+        std::vector<Job> pending;
+        // Per-user virtual time: judge time a user has been given so far,
+        // in milliseconds of expected cost
+        std::unordered_map<std::string, double> user_time;
+        double clock = 0; // start tag of the job picked last
+        LaneStats stats;
+    };
+
+    double expected_cost_locked(int problem_id) const;
+
+    const std::chrono::milliseconds default_cost_;
+    mutable std::mutex mutex_;
+    std::vector<Lane> lanes_;
+    std::unordered_map<int, double> problem_cost_ms_;
+    std::unordered_multimap<int, Job> in_flight_;
+};
+
+#endif // SCHEDULER_H
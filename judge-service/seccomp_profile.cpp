@@ -0,0 +1,179 @@
+#include "seccomp_profile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <seccomp.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+#include <linux/seccomp.h>
+
+#include <map>
+#include <mutex>
+
+namespace
+{
+    // Every profile: starting a dynamically linked program, memory, time,
+    // signals and standard streams
+    const std::vector<int> kBaseSyscalls{
+        SCMP_SYS(read), SCMP_SYS(write), SCMP_SYS(readv), SCMP_SYS(writev), SCMP_SYS(pread64), SCMP_SYS(lseek),
+        SCMP_SYS(close), SCMP_SYS(fstat), SCMP_SYS(newfstatat), SCMP_SYS(statx), SCMP_SYS(access),
+        SCMP_SYS(faccessat), SCMP_SYS(faccessat2), SCMP_SYS(readlink), SCMP_SYS(readlinkat), SCMP_SYS(getcwd),
+        SCMP_SYS(fcntl), SCMP_SYS(ioctl), SCMP_SYS(brk), SCMP_SYS(mmap), SCMP_SYS(munmap), SCMP_SYS(mprotect),
+        SCMP_SYS(mremap), SCMP_SYS(madvise), SCMP_SYS(arch_prctl), SCMP_SYS(set_tid_address),
+        SCMP_SYS(set_robust_list), SCMP_SYS(rseq), SCMP_SYS(prlimit64), SCMP_SYS(getrandom), SCMP_SYS(uname),
+        SCMP_SYS(sysinfo), SCMP_SYS(getpid), SCMP_SYS(gettid), SCMP_SYS(getuid), SCMP_SYS(geteuid),
+        SCMP_SYS(getgid), SCMP_SYS(getegid), SCMP_SYS(rt_sigaction), SCMP_SYS(rt_sigprocmask),
+        SCMP_SYS(rt_sigreturn), SCMP_SYS(sigaltstack), SCMP_SYS(clock_gettime), SCMP_SYS(clock_getres),
+        SCMP_SYS(gettimeofday), SCMP_SYS(time), SCMP_SYS(nanosleep), SCMP_SYS(clock_nanosleep),
+        SCMP_SYS(sched_yield), SCMP_SYS(sched_getaffinity), SCMP_SYS(getrusage), SCMP_SYS(times), SCMP_SYS(futex),
+        SCMP_SYS(exit), SCMP_SYS(exit_group)};
+
+    // Imports list directories; a warm interpreter takes its run over the
+    // control socket itself. Python's socket module probes for epoll when
+    // it is imported.
+    const std::vector<int> kInterpreterSyscalls{SCMP_SYS(getdents64), SCMP_SYS(dup), SCMP_SYS(dup2), SCMP_SYS(dup3),
+                                                SCMP_SYS(recvmsg), SCMP_SYS(sendto), SCMP_SYS(getsockname),
+                                                SCMP_SYS(epoll_create1)};
+
+    // Starting, naming and signalling threads
+    const std::vector<int> kThreadSyscalls{SCMP_SYS(tgkill), SCMP_SYS(prctl), SCMP_SYS(membarrier)};
+
+    // A compiler driver runs the compiler proper, assembler and linker as
+    // child processes, which write temporary files and the output
+    const std::vector<int> kCompilerSyscalls{
+        SCMP_SYS(fork), SCMP_SYS(vfork), SCMP_SYS(wait4), SCMP_SYS(waitid), SCMP_SYS(pipe), SCMP_SYS(pipe2),
+        SCMP_SYS(getppid), SCMP_SYS(getpgrp), SCMP_SYS(stat), SCMP_SYS(lstat), SCMP_SYS(unlink), SCMP_SYS(unlinkat),
+        SCMP_SYS(rename), SCMP_SYS(renameat), SCMP_SYS(renameat2), SCMP_SYS(mkdir), SCMP_SYS(mkdirat),
+        SCMP_SYS(rmdir), SCMP_SYS(chmod), SCMP_SYS(fchmod), SCMP_SYS(fchmodat), SCMP_SYS(umask),
+        SCMP_SYS(ftruncate), SCMP_SYS(fallocate), SCMP_SYS(fadvise64), SCMP_SYS(pwrite64), SCMP_SYS(fsync)};
+
+    char exec_path[kSeccompExecPathSize];
+
+    bool add_rules(scmp_filter_ctx ctx, SyscallProfile profile)
+    {
+        std::vector<int> allowed = kBaseSyscalls;
+        const bool compiler = profile == SyscallProfile::Compiler;
+        if (profile == SyscallProfile::Interpreter || profile == SyscallProfile::Jvm || compiler)
+        {
+            allowed.insert(allowed.end(), kInterpreterSyscalls.begin(), kInterpreterSyscalls.end());
+        }
+        if (profile == SyscallProfile::Jvm || compiler)
+        {
+            allowed.insert(allowed.end(), kThreadSyscalls.begin(), kThreadSyscalls.end());
+        }
+        if (compiler)
+        {
+            allowed.insert(allowed.end(), kCompilerSyscalls.begin(), kCompilerSyscalls.end());
+            allowed.insert(allowed.end(), {SCMP_SYS(clone), SCMP_SYS(clone3), SCMP_SYS(execve), SCMP_SYS(openat)});
+        }
+        for (int syscall : allowed)
+        {
+            if (seccomp_rule_add(ctx, SCMP_ACT_ALLOW, syscall, 0) < 0)
+            {
+                return false;
+            }
+        }
+        if (compiler)
+        {
+            return true;
+        }
+
+        // Only the program the sandbox starts, and files only for reading.
+        // The filter sees execve's path pointer, not the string behind it.
+        // Once exec'd, the program has an address space of its own, where
+        // it can map and fill that address and exec some other file of the
+        // root. The filter, namespaces and user stay the same for that one.
+        if (seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(execve), 1,
+                             SCMP_A0(SCMP_CMP_EQ, reinterpret_cast<scmp_datum_t>(exec_path))) < 0 ||
+            seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(openat), 1,
+                             SCMP_A2(SCMP_CMP_MASKED_EQ, O_ACCMODE | O_CREAT | O_TRUNC, O_RDONLY)) < 0)
+        {
+            return false;
+        }
+
+        // Threads, but no new processes. clone3 hides its flags from the
+        // filter; ENOSYS makes glibc fall back to clone.
+        return profile != SyscallProfile::Jvm ||
+               (seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(clone), 1,
+                                 SCMP_A0(SCMP_CMP_MASKED_EQ, CLONE_THREAD, CLONE_THREAD)) == 0 &&
+                seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(clone3), 0) == 0);
+    }
+
+    std::vector<sock_filter> build(SyscallProfile profile)
+    {
+        // Anything not allowed kills the whole process, not just the thread
+        scmp_filter_ctx ctx = seccomp_init(SCMP_ACT_KILL_PROCESS);
+        if (!ctx)
+        {
+            return {};
+        }
+
+        // Syscalls are found by a binary search instead of comparing against
+        // every rule in turn. A libseccomp too old for that builds the
+        // linear filter, which works all the same.
+        seccomp_attr_set(ctx, SCMP_FLTATR_CTL_OPTIMIZE, 2);
+
+        int fd = -1;
+        bool ok = add_rules(ctx, profile);
+        if (ok)
+        {
+            fd = memfd_create("seccomp_bpf", MFD_CLOEXEC);
+            ok = fd != -1 && seccomp_export_bpf(ctx, fd) == 0;
+        }
+        seccomp_release(ctx);
+
+        std::vector<sock_filter> program;
+        if (ok)
+        {
+            off_t size = lseek(fd, 0, SEEK_END);
+            ok = size > 0 && size % sizeof(sock_filter) == 0;
+            if (ok)
+            {
+                program.resize(size / sizeof(sock_filter));
+                ok = pread(fd, program.data(), size, 0) == size;
+            }
+        }
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        if (!ok)
+        {
+            program.clear();
+        }
+        return program;
+    }
+}
+
+const std::vector<sock_filter> &seccomp_program(SyscallProfile profile)
+{
+    static std::mutex mutex;
+    static std::map<SyscallProfile, std::vector<sock_filter>> programs;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = programs.find(profile);
+    if (it == programs.end())
+    {
+        it = programs.emplace(profile, build(profile)).first;
+    }
+    return it->second;
+}
+
+char *seccomp_exec_path()
+{
+    return exec_path;
+}
+
+bool install_seccomp_program(const std::vector<sock_filter> &program)
+{
+    if (program.empty())
+    {
+        return false;
+    }
+    struct sock_fprog fprog;
+    fprog.len = static_cast<unsigned short>(program.size());
+    fprog.filter = const_cast<sock_filter *>(program.data());
+    return prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0 && prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &fprog) == 0;
+}
@@ -0,0 +1,42 @@
+#ifndef SECCOMP_PROFILE_H
+#define SECCOMP_PROFILE_H
+
+#include <cstddef>
+#include <vector>
+#include <limits.h>
+#include <linux/filter.h>
+
+// What a program is allowed to ask of the kernel, by kind of program. Each
+// builds on what a dynamically linked glibc program needs to start, read
+// its input, write its output and exit.
+enum class SyscallProfile
+{
+    Native,
+    Interpreter, // also lists directories and takes a warm run over its socket
+    Jvm,         // also starts threads
+    Compiler,    // also starts processes and writes files
+    Checker,     // a custom checker, reading the files it is given
+};
+
+// Size of the buffer behind seccomp_exec_path()
+constexpr size_t kSeccompExecPathSize = PATH_MAX;
+
+// The profile's filter as raw BPF, exported by libseccomp on first use in a
+// binary-tree layout and shared from then on. Thread-safe; empty if the
+// filter could not be built. Call it before forking the child that installs
+// it.
+const std::vector<sock_filter> &seccomp_program(SyscallProfile profile);
+
+// A filtered process may execve only the path at this very address, which
+// is how a sandbox starts its program, unless it is a compiler. A forked
+// child copies the path there before it installs the filter; each child
+// has its own copy of the buffer. Only the address is checked, so this
+// pins the first exec, not what the program may exec afterwards.
+char *seccomp_exec_path();
+
+// Sets no_new_privs and installs program on the calling thread. Only makes
+// system calls, so it is safe in a child forked from a multi-threaded
+// process.
+bool install_seccomp_program(const std::vector<sock_filter> &program);
+
+#endif // SECCOMP_PROFILE_H
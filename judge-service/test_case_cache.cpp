@@ -0,0 +1,141 @@
+#include "test_case_cache.h"
+
+#include <algorithm>
+#include <cstring>
+
+void OutputArena::add(TestCase &test_case, const char *data, size_t size)
+{
+    // An output larger than a whole buffer gets one of its own
+    if (size > capacity_ - used_)
+    {
+        capacity_ = std::max(size, std::min(kMaxBufferBytes, std::max(kFirstBufferBytes, 2 * capacity_)));
+        buffer_.reset(new char[capacity_]);
+        used_ = 0;
+    }
+    char *copy = buffer_.get() + used_;
+    std::memcpy(copy, data, size);
+    used_ += size;
+    test_case.expected_output = std::string_view(copy, size);
+    test_case.storage = buffer_;
+}
+
+TestCaseCache::TestCaseCache(size_t max_bytes) : max_bytes_(max_bytes)
+{
+}
+
+size_t TestCaseCache::size_of(const TestSet &tests)
+{
+    size_t bytes = 0;
+    for (const auto &tc : tests)
+    {
+        bytes += tc.input->size() + tc.expected_output.size();
+    }
+    return bytes;
+}
+
+TestCaseCache::Handle TestCaseCache::get(int problem_id, long version, const LoadFn &load)
+{
+    std::promise<Handle> promise;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true)
+        {
+            auto it = entries_.find(problem_id);
+            if (it != entries_.end() && it->second.version >= version)
+            {
+                lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return it->second.tests;
+            }
+
+            auto pending = loading_.find(problem_id);
+            if (pending == loading_.end() || pending->second.version < version)
+            {
+                break;
+            }
+
+            // Another worker is already loading this version
+            std::shared_future<Handle> result = pending->second.result;
+            lock.unlock();
+            Handle tests = result.get();
+            if (tests)
+            {
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return tests;
+            }
+            lock.lock();
+        }
+        loading_[problem_id] = {version, promise.get_future().share()};
+    }
+
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    Handle tests;
+    try
+    {
+        tests = std::make_shared<const TestSet>(load());
+    }
+    catch (...)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto pending = loading_.find(problem_id);
+            if (pending != loading_.end() && pending->second.version == version)
+            {
+                loading_.erase(pending);
+            }
+        }
+        promise.set_value(nullptr);
+        throw;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto pending = loading_.find(problem_id);
+        if (pending != loading_.end() && pending->second.version == version)
+        {
+            loading_.erase(pending);
+        }
+
+        // A set larger than the whole budget is used once and not kept
+        size_t bytes = size_of(*tests);
+        auto existing = entries_.find(problem_id);
+        bool newer_cached = existing != entries_.end() && existing->second.version > version;
+        if (bytes <= max_bytes_ && !newer_cached)
+        {
+            erase_locked(problem_id);
+            lru_.push_front(problem_id);
+            entries_[problem_id] = {version, tests, bytes, lru_.begin()};
+            total_bytes_ += bytes;
+            evict_locked();
+        }
+    }
+    promise.set_value(tests);
+    return tests;
+}
+
+void TestCaseCache::invalidate(int problem_id)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    erase_locked(problem_id);
+}
+
+void TestCaseCache::erase_locked(int problem_id)
+{
+    auto it = entries_.find(problem_id);
+    if (it == entries_.end())
+    {
+        return;
+    }
+    total_bytes_ -= it->second.bytes;
+    lru_.erase(it->second.lru_position);
+    entries_.erase(it);
+}
+
+void TestCaseCache::evict_locked()
+{
+    // Sets still held by a running judge stay alive through their handle
+    while (total_bytes_ > max_bytes_ && !lru_.empty())
+    {
+        erase_locked(lru_.back());
+    }
+}
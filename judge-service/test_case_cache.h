@@ -0,0 +1,107 @@
+#ifndef TEST_CASE_CACHE_H
+#define TEST_CASE_CACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "input_file.h"
+
+struct TestCase
+{
+    int id;
+    std::shared_ptr<const InputFile> input;
+    std::string_view expected_output;
+    // Keeps what expected_output points into alive, usually the
+    // OutputArena of the set; empty when the caller owns the bytes
+    std::shared_ptr<const char[]> storage;
+};
+
+using TestSet = std::vector<TestCase>;
+
+// Buffers for the expected outputs of a test set, so loading one makes a
+// few allocations rather than one per test and copies each byte once. They
+// double in size as the set grows, so its total need not be known up front,
+// e.g. while rows are still streaming in.
+class OutputArena
+{
+public:
+    // Copies data in and points expected_output and storage of test_case at
+    // the copy
+    void add(TestCase &test_case, const char *data, size_t size);
+
+private:
+    static constexpr size_t kFirstBufferBytes = 64 * 1024;
+    static constexpr size_t kMaxBufferBytes = 4 * 1024 * 1024;
+
+    std::shared_ptr<char[]> buffer_;
+    size_t capacity_ = 0;
+    size_t used_ = 0;
+};
+
+// In-memory test sets keyed by problem, shared by every worker. Entries are
+// tagged with the problem's test_version, so a bump in the database makes
+// the next lookup reload. Least recently used sets are dropped once the
+// total size of inputs and outputs passes the byte budget.
+class TestCaseCache
+{
+public:
+    // Immutable and shared; a hit hands out the cached set without copying.
+    using Handle = std::shared_ptr<const TestSet>;
+    using LoadFn = std::function<TestSet()>;
+
+    explicit TestCaseCache(size_t max_bytes);
+
+    TestCaseCache(const TestCaseCache &) = delete;
+    TestCaseCache &operator=(const TestCaseCache &) = delete;
+
+    // Returns the test set for problem_id at version, calling load on a miss
+    // or when the cached copy is older. Concurrent misses load once.
+    Handle get(int problem_id, long version, const LoadFn &load);
+
+    void invalidate(int problem_id);
+
+    // Lookups served from memory, and loads, since startup
+    uint64_t hits() const { return hits_.load(std::memory_order_relaxed); }
+    uint64_t misses() const { return misses_.load(std::memory_order_relaxed); }
+
+private:
+    struct Entry
+    {
+        long version;
+        Handle tests;
+        size_t bytes;
+        std::list<int>::iterator lru_position;
+    };
+
+    struct Loading
+    {
+        long version;
+        std::shared_future<Handle> result;
+    };
+
+    static size_t size_of(const TestSet &tests);
+    void erase_locked(int problem_id);
+    void evict_locked();
+
+    const size_t max_bytes_;
+    std::mutex mutex_;
+    std::unordered_map<int, Entry> entries_;
+    std::unordered_map<int, Loading> loading_;
+    std::list<int> lru_; // most recently used first
+    size_t total_bytes_ = 0;
+
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+};
+
+#endif // TEST_CASE_CACHE_H
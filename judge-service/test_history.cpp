@@ -0,0 +1,99 @@
+#include "test_history.h"
+
+#include <algorithm>
+#include <numeric>
+
+namespace
+{
+    // Weight kept by older runs each time a test runs again
+    constexpr double kDecay = 0.98;
+    // Weight of the newest run in a test's average run time
+    constexpr double kTimeSmoothing = 0.3;
+    // Prior of one failure in ten runs, and how much it weighs against
+    // real observations
+    constexpr double kPriorFailures = 0.5;
+    constexpr double kPriorRuns = 5;
+    // Floor on a test's cost, about what starting any program costs
+    constexpr double kMinRunMs = 1;
+}
+
+TestHistory::TestHistory(size_t max_problems) : max_problems_(std::max<size_t>(max_problems, 1)) {}
+
+std::vector<size_t> TestHistory::order(int problem_id, long version, const TestSet &tests)
+{
+    std::vector<size_t> order(tests.size());
+    std::iota(order.begin(), order.end(), 0);
+
+    std::vector<double> score(tests.size());
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = problems_.find(problem_id);
+        if (it == problems_.end() || it->second.version != version)
+        {
+            return order;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+        const auto &known = it->second.tests;
+
+        // Unknown tests are assumed to cost what the known ones do on average
+        double total_ms = 0;
+        for (const auto &entry : known)
+            total_ms += entry.second.run_ms;
+        double default_ms = known.empty() ? kMinRunMs : total_ms / known.size();
+
+        for (size_t i = 0; i < tests.size(); i++)
+        {
+            auto test = known.find(tests[i].id);
+            Stats stats = test != known.end() ? test->second : Stats{0, 0, default_ms};
+            double failure_rate = (stats.failures + kPriorFailures) / (stats.runs + kPriorRuns);
+            score[i] = failure_rate / std::max(stats.run_ms, kMinRunMs);
+        }
+    }
+
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                     { return score[a] > score[b]; });
+    return order;
+}
+
+void TestHistory::record(int problem_id, long version, int test_id, bool failed, std::chrono::microseconds run_time)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = problems_.find(problem_id);
+    if (it == problems_.end())
+    {
+        lru_.push_front(problem_id);
+        it = problems_.emplace(problem_id, Problem{version, {}, lru_.begin()}).first;
+        if (problems_.size() > max_problems_)
+        {
+            problems_.erase(lru_.back());
+            lru_.pop_back();
+        }
+    }
+    else
+    {
+        lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+    }
+
+    Problem &problem = it->second;
+    if (version < problem.version)
+    {
+        return;
+    }
+    if (version > problem.version)
+    {
+        problem.version = version;
+        problem.tests.clear();
+    }
+
+    double run_ms = run_time.count() / 1000.0;
+    auto test = problem.tests.find(test_id);
+    if (test == problem.tests.end())
+    {
+        problem.tests.emplace(test_id, Stats{1, failed ? 1.0 : 0.0, run_ms});
+        return;
+    }
+    Stats &stats = test->second;
+    stats.runs = stats.runs * kDecay + 1;
+    stats.failures = stats.failures * kDecay + (failed ? 1 : 0);
+    stats.run_ms += kTimeSmoothing * (run_ms - stats.run_ms);
+}
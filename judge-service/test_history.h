@@ -0,0 +1,56 @@
+#ifndef TEST_HISTORY_H
+#define TEST_HISTORY_H
+
+#include <chrono>
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "test_case_cache.h"
+
+// What earlier judgements learned about each test of a problem: how often
+// it rejects a submission and how long it takes to run. Used to start the
+// tests most likely to fail per millisecond first, so a doomed submission
+// is found out before the other run slots have burnt time on tests whose
+// results no longer matter. Kept for the most recently judged problems
+// only. Thread-safe.
+class TestHistory
+{
+public:
+    explicit TestHistory(size_t max_problems);
+
+    TestHistory(const TestHistory &) = delete;
+    TestHistory &operator=(const TestHistory &) = delete;
+
+    // Indices into tests in the order to start them. Tests without history
+    // keep their relative order; so does everything when nothing is known.
+    std::vector<size_t> order(int problem_id, long version, const TestSet &tests);
+
+    // Records one finished run. A new test version forgets what was
+    // learned about the old one.
+    void record(int problem_id, long version, int test_id, bool failed, std::chrono::microseconds run_time);
+
+private:
+    struct Stats
+    {
+        double runs = 0;     // decayed, so recent submissions count most
+        double failures = 0;
+        double run_ms = 0;   // moving average
+    };
+
+    struct Problem
+    {
+        long version;
+        std::unordered_map<int, Stats> tests;
+        std::list<int>::iterator lru_position;
+    };
+
+    const size_t max_problems_;
+    std::mutex mutex_;
+    std::unordered_map<int, Problem> problems_;
+    std::list<int> lru_; // most recently used first
+};
+
+#endif // TEST_HISTORY_H
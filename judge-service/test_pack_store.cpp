@@ -0,0 +1,331 @@
+#include "test_pack_store.h"
+
+#include <openssl/evp.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    constexpr char kMagic[8] = {'C', 'J', 'T', 'P', 'A', 'C', 'K', '1'};
+    constexpr size_t kDigestSize = 32; // SHA-256
+
+    // Packs never leave the node, so the layout is the host's own
+    struct PackHeader
+    {
+        char magic[8];
+        int32_t problem_id;
+        uint32_t count;
+        int64_t version;
+        uint64_t data_offset;
+        unsigned char index_digest[kDigestSize];
+    };
+
+    struct PackEntry
+    {
+        int32_t id;
+        uint32_t reserved;
+        uint64_t input_offset;
+        uint64_t input_size;
+        uint64_t output_offset;
+        uint64_t output_size;
+        unsigned char digest[kDigestSize]; // of the input, then the output
+    };
+
+    class Sha256
+    {
+    public:
+        Sha256() : ctx_(EVP_MD_CTX_new()) { EVP_DigestInit_ex(ctx_, EVP_sha256(), nullptr); }
+        ~Sha256() { EVP_MD_CTX_free(ctx_); }
+
+        Sha256(const Sha256 &) = delete;
+        Sha256 &operator=(const Sha256 &) = delete;
+
+        void update(const void *data, size_t size) { EVP_DigestUpdate(ctx_, data, size); }
+
+        void finish(unsigned char (&digest)[kDigestSize])
+        {
+            unsigned int size = 0;
+            unsigned char full[EVP_MAX_MD_SIZE];
+            EVP_DigestFinal_ex(ctx_, full, &size);
+            memcpy(digest, full, kDigestSize);
+        }
+
+    private:
+        EVP_MD_CTX *ctx_;
+    };
+
+    bool pwrite_all(int fd, const char *data, size_t size, uint64_t offset)
+    {
+        while (size > 0)
+        {
+            ssize_t n = pwrite(fd, data, size, static_cast<off_t>(offset));
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            data += n;
+            size -= static_cast<size_t>(n);
+            offset += static_cast<uint64_t>(n);
+        }
+        return true;
+    }
+
+    // Reads the input back out of its memfd into the pack
+    bool copy_input(const InputFile &input, int fd, uint64_t offset, Sha256 &digest)
+    {
+        int in = input.open_reader();
+        if (in == -1)
+        {
+            return false;
+        }
+        std::vector<char> buffer(std::min<size_t>(input.size(), 1024 * 1024));
+        size_t copied = 0;
+        bool ok = true;
+        while (ok && copied < input.size())
+        {
+            ssize_t n = read(in, buffer.data(), buffer.size());
+            if (n == -1 && errno == EINTR)
+                continue;
+            ok = n > 0 && pwrite_all(fd, buffer.data(), static_cast<size_t>(n), offset + copied);
+            if (ok)
+            {
+                digest.update(buffer.data(), static_cast<size_t>(n));
+                copied += static_cast<size_t>(n);
+            }
+        }
+        close(in);
+        return ok;
+    }
+
+    bool in_bounds(uint64_t offset, uint64_t size, uint64_t start, uint64_t end)
+    {
+        return offset >= start && offset <= end && size <= end - offset;
+    }
+
+    // Everything is checked before the first test is handed out: a pack
+    // renamed into place just before a crash may be missing its data
+    bool verify(const char *base, size_t size, int problem_id, long version)
+    {
+        PackHeader header;
+        if (size < sizeof(header))
+        {
+            return false;
+        }
+        memcpy(&header, base, sizeof(header));
+        const uint64_t index_bytes = uint64_t(header.count) * sizeof(PackEntry);
+        if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.problem_id != problem_id ||
+            header.version != version || header.data_offset != sizeof(header) + index_bytes ||
+            header.data_offset > size)
+        {
+            return false;
+        }
+
+        unsigned char digest[kDigestSize];
+        Sha256 index_sha;
+        index_sha.update(base + sizeof(header), index_bytes);
+        index_sha.finish(digest);
+        if (memcmp(digest, header.index_digest, kDigestSize) != 0)
+        {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < header.count; i++)
+        {
+            PackEntry entry;
+            memcpy(&entry, base + sizeof(header) + i * sizeof(PackEntry), sizeof(entry));
+            if (!in_bounds(entry.input_offset, entry.input_size, header.data_offset, size) ||
+                !in_bounds(entry.output_offset, entry.output_size, header.data_offset, size))
+            {
+                return false;
+            }
+            Sha256 sha;
+            sha.update(base + entry.input_offset, entry.input_size);
+            sha.update(base + entry.output_offset, entry.output_size);
+            sha.finish(digest);
+            if (memcmp(digest, entry.digest, kDigestSize) != 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+TestPackStore::TestPackStore(const std::string &directory) : directory_(directory)
+{
+    std::error_code ec;
+    fs::create_directories(directory_, ec);
+    if (ec)
+    {
+        throw std::runtime_error("Cannot create test pack directory " + directory_ + ": " + ec.message());
+    }
+
+    // Only the judges may read tests; checkers run on the host filesystem
+    fs::permissions(directory_, fs::perms::owner_all, ec);
+
+    // Half-written packs of judges that died. Another judge on the node
+    // may be writing one right now, so only old ones go.
+    auto cutoff = fs::file_time_type::clock::now() - std::chrono::hours(1);
+    for (const auto &file : fs::directory_iterator(directory_, ec))
+    {
+        if (file.path().filename().string().find(".pack.tmp") != std::string::npos &&
+            file.last_write_time(ec) < cutoff)
+        {
+            fs::remove(file.path(), ec);
+        }
+    }
+}
+
+std::string TestPackStore::pack_path(int problem_id, long version) const
+{
+    return directory_ + "/" + std::to_string(problem_id) + "-" + std::to_string(version) + ".pack";
+}
+
+std::optional<TestSet> TestPackStore::load(int problem_id, long version)
+{
+    std::string path = pack_path(problem_id, version);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return std::nullopt;
+    }
+
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(PackHeader)))
+    {
+        mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return std::nullopt;
+    }
+
+    // Unmapped once the last test pointing into it is gone
+    size_t size = st.st_size;
+    std::shared_ptr<const char[]> storage(static_cast<const char *>(mapping), [size](const char *base)
+                                          { munmap(const_cast<char *>(base), size); });
+    const char *base = storage.get();
+    if (!verify(base, size, problem_id, version))
+    {
+        std::cerr << "Test pack " << path << " is corrupt, removing it" << std::endl;
+        std::remove(path.c_str());
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return std::nullopt;
+    }
+
+    PackHeader header;
+    memcpy(&header, base, sizeof(header));
+    TestSet tests;
+    tests.reserve(header.count);
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+        PackEntry entry;
+        memcpy(&entry, base + sizeof(header) + i * sizeof(PackEntry), sizeof(entry));
+        TestCase tc;
+        tc.id = entry.id;
+        tc.input = InputFile::create(std::string_view(base + entry.input_offset, entry.input_size));
+        tc.expected_output = std::string_view(base + entry.output_offset, entry.output_size);
+        tc.storage = storage;
+        tests.push_back(std::move(tc));
+    }
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    return tests;
+}
+
+bool TestPackStore::save(int problem_id, long version, const TestSet &tests)
+{
+    // Unique across every judge sharing the directory
+    std::string final_path = pack_path(problem_id, version);
+    std::string temp_path = final_path + ".tmp" + std::to_string(getpid()) + "." + std::to_string(temp_counter_++);
+    int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    PackHeader header = {};
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.problem_id = problem_id;
+    header.count = static_cast<uint32_t>(tests.size());
+    header.version = version;
+    header.data_offset = sizeof(header) + tests.size() * sizeof(PackEntry);
+
+    // The data first, then the index and header that describe it
+    std::vector<PackEntry> index(tests.size());
+    uint64_t offset = header.data_offset;
+    bool ok = true;
+    for (size_t i = 0; ok && i < tests.size(); i++)
+    {
+        const TestCase &tc = tests[i];
+        PackEntry &entry = index[i];
+        entry.id = tc.id;
+
+        Sha256 sha;
+        entry.input_offset = offset;
+        entry.input_size = tc.input->size();
+        ok = copy_input(*tc.input, fd, offset, sha);
+        offset += entry.input_size;
+
+        entry.output_offset = offset;
+        entry.output_size = tc.expected_output.size();
+        ok = ok && pwrite_all(fd, tc.expected_output.data(), tc.expected_output.size(), offset);
+        sha.update(tc.expected_output.data(), tc.expected_output.size());
+        offset += entry.output_size;
+        sha.finish(entry.digest);
+    }
+
+    if (ok)
+    {
+        Sha256 index_sha;
+        index_sha.update(index.data(), index.size() * sizeof(PackEntry));
+        index_sha.finish(header.index_digest);
+        ok = pwrite_all(fd, reinterpret_cast<const char *>(&header), sizeof(header), 0) &&
+             pwrite_all(fd, reinterpret_cast<const char *>(index.data()), index.size() * sizeof(PackEntry),
+                        sizeof(header));
+    }
+
+    // Not synced: loading checks every byte, and the database still has them
+    ok = close(fd) == 0 && ok && std::rename(temp_path.c_str(), final_path.c_str()) == 0;
+    if (!ok)
+    {
+        std::remove(temp_path.c_str());
+        return false;
+    }
+    remove_other_versions(problem_id, fs::path(final_path).filename().string());
+    return true;
+}
+
+void TestPackStore::remove_other_versions(int problem_id, const std::string &keep_name)
+{
+    // Judges that already mapped an old pack keep reading it until they
+    // drop their tests
+    std::string prefix = std::to_string(problem_id) + "-";
+    std::error_code ec;
+    for (const auto &file : fs::directory_iterator(directory_, ec))
+    {
+        std::string name = file.path().filename().string();
+        if (name.compare(0, prefix.size(), prefix) == 0 && name.size() > 5 &&
+            name.compare(name.size() - 5, 5, ".pack") == 0 && name != keep_name)
+        {
+            fs::remove(file.path(), ec);
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef TEST_PACK_STORE_H
+#define TEST_PACK_STORE_H
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "test_case_cache.h"
+
+// Test sets on local disk, one pack file per problem version, so a judge
+// that starts cold reads them from the node rather than the database. A
+// pack is an index of every test's offsets and SHA-256 followed by the
+// data. It is written under a temporary name and renamed into place, so
+// any number of judges on the node can share the directory.
+//
+// Loading maps the pack: expected outputs are used where they lie in the
+// mapping, in the page cache every judge on the node shares, and only
+// inputs are copied into their memfds.
+class TestPackStore
+{
+public:
+    // Throws std::runtime_error if directory can't be created
+    explicit TestPackStore(const std::string &directory);
+
+    TestPackStore(const TestPackStore &) = delete;
+    TestPackStore &operator=(const TestPackStore &) = delete;
+
+    // The set for problem_id at version, or nullopt if there is no pack
+    // for it. A pack that fails its checksums is removed and reported as
+    // missing. Thread-safe.
+    std::optional<TestSet> load(int problem_id, long version);
+
+    // Writes tests as the pack for problem_id at version, then removes the
+    // packs of its other versions. The store is only a cache: returns
+    // false, leaving nothing behind, if the pack can't be written.
+    bool save(int problem_id, long version, const TestSet &tests);
+
+    // Loads served from a pack, and lookups that found none, since startup
+    uint64_t hits() const { return hits_.load(std::memory_order_relaxed); }
+    uint64_t misses() const { return misses_.load(std::memory_order_relaxed); }
+
+private:
+    std::string pack_path(int problem_id, long version) const;
+    void remove_other_versions(int problem_id, const std::string &keep_name);
+
+    const std::string directory_;
+    std::atomic<unsigned long> temp_counter_{0};
+
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+};
+
+#endif // TEST_PACK_STORE_H
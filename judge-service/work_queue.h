@@ -0,0 +1,90 @@
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+// Bounded multi-producer/multi-consumer queue used to hand work from the
+// dispatcher to the judge workers.
+template <typename T>
+class WorkQueue
+{
+public:
+    explicit WorkQueue(size_t capacity) : capacity_(capacity == 0 ? 1 : capacity) {}
+
+    // Blocks while the queue is full. Returns false once the queue is closed.
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this]
+                       { return closed_ || items_.size() < capacity_; });
+        if (closed_)
+        {
+            return false;
+        }
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Blocks while the queue is empty. Returns nullopt once closed and drained.
+    std::optional<T> pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ++waiting_consumers_;
+        idle_.notify_all();
+        not_empty_.wait(lock, [this]
+                        { return closed_ || !items_.empty(); });
+        --waiting_consumers_;
+        if (items_.empty())
+        {
+            return std::nullopt;
+        }
+        T item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return item;
+    }
+
+    // Blocks until some consumer is waiting with nothing queued for it, so the
+    // producer only takes work from upstream when it can start immediately.
+    // Returns false once the queue is closed.
+    bool wait_for_idle_consumer()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this]
+                   { return closed_ || waiting_consumers_ > items_.size(); });
+        return !closed_;
+    }
+
+    // Consumers waiting beyond the items already queued for them
+    size_t idle_consumers()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return waiting_consumers_ > items_.size() ? waiting_consumers_ - items_.size() : 0;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+        not_full_.notify_all();
+        idle_.notify_all();
+    }
+
+private:
+    const size_t capacity_;
+    std::deque<T> items_;
+    size_t waiting_consumers_ = 0;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+    std::condition_variable idle_;
+};
+
+#endif // WORK_QUEUE_H
@@ -26,6 +26,10 @@ type Problem struct {
 	Title       string `json:"title"`
 	Description string `json:"description"`
 	Difficulty  string `json:"difficulty"`
+	// Checker picks how judges accept output; empty means the judge default.
+	// "custom" compiles CheckerSource as a testlib-style checker.
+	Checker       string `json:"checker,omitempty"`
+	CheckerSource string `json:"checker_source,omitempty"`
 }
 
 type TestCase struct {
@@ -43,18 +47,25 @@ func connectDB() {
 		logger.Fatal("DATABASE_URL not set")
 	}
 	dbManager = dbutil.ConnectManagerWithRetry(logger, databaseURL, 5, 2*time.Second)
-
-	// Prepare commonly used statements for better performance
-	prepareStatements()
 }
 
+// Bumping test_version in the same statement lets judges invalidate their
+// cached copy of the problem's test cases.
+const createTestCaseSQL = `
+	WITH inserted AS (
+		INSERT INTO test_cases (problem_id, input, output) VALUES ($1, $2, $3) RETURNING id
+	), bumped AS (
+		UPDATE problems SET test_version = test_version + 1 WHERE id = $1
+	)
+	SELECT id FROM inserted`
+
 func prepareStatements() {
 	statements := map[string]string{
 		"list_problems":    `SELECT id, title, description, difficulty FROM problems ORDER BY id`,
 		"get_problem":      `SELECT id, title, description, difficulty FROM problems WHERE id = $1`,
-		"create_problem":   `INSERT INTO problems (title, description, difficulty) VALUES ($1, $2, $3) RETURNING id`,
+		"create_problem":   `INSERT INTO problems (title, description, difficulty, checker, checker_source) VALUES ($1, $2, $3, NULLIF($4, ''), NULLIF($5, '')) RETURNING id`,
 		"get_test_cases":   `SELECT id, problem_id, input, output FROM test_cases WHERE problem_id = $1 ORDER BY id`,
-		"create_test_case": `INSERT INTO test_cases (problem_id, input, output) VALUES ($1, $2, $3) RETURNING id`,
+		"create_test_case": createTestCaseSQL,
 	}
 
 	for name, query := range statements {
@@ -80,6 +91,20 @@ func createTable() {
 	}
 	logger.Info("'problems' table is ready")
 
+	// Judges compare this against their cached copy of the problem's test cases
+	addTestVersionSQL := `ALTER TABLE problems ADD COLUMN IF NOT EXISTS test_version INTEGER NOT NULL DEFAULT 0;`
+	if _, err = dbManager.GetDB().Exec(addTestVersionSQL); err != nil {
+		logger.Fatal("Failed to add 'test_version' column", zap.Error(err))
+	}
+
+	addCheckerSQL := `
+	ALTER TABLE problems
+		ADD COLUMN IF NOT EXISTS checker VARCHAR(64),
+		ADD COLUMN IF NOT EXISTS checker_source TEXT;`
+	if _, err = dbManager.GetDB().Exec(addCheckerSQL); err != nil {
+		logger.Fatal("Failed to add checker columns", zap.Error(err))
+	}
+
 	createTestCasesTableSQL := `
 	CREATE TABLE IF NOT EXISTS test_cases (
 		id SERIAL PRIMARY KEY,
@@ -196,8 +221,19 @@ func createProblem(w http.ResponseWriter, r *http.Request) {
 		return
 	}
 
+	if p.Checker == "custom" && p.CheckerSource == "" {
+		serviceErr := httpx.NewServiceError(
+			"A custom checker needs checker_source",
+			"VALIDATION_ERROR",
+			http.StatusBadRequest,
+			nil,
+		)
+		httpx.ErrorWithDetails(w, serviceErr, logger)
+		return
+	}
+
 	ctx := r.Context()
-	row := dbManager.QueryRowPrepared(ctx, "create_problem", p.Title, p.Description, p.Difficulty)
+	row := dbManager.QueryRowPrepared(ctx, "create_problem", p.Title, p.Description, p.Difficulty, p.Checker, p.CheckerSource)
 	err := row.Scan(&p.ID)
 	if err != nil {
 		serviceErr := httpx.NewServiceError(
@@ -250,6 +286,10 @@ func main() {
 	createTable()
 	defer dbManager.Close()
 
+	// Prepare commonly used statements for better performance; this must
+	// follow createTable since preparing checks the schema
+	prepareStatements()
+
 	r := chi.NewRouter()
 
 	// Add middleware
@@ -2,6 +2,7 @@ package main
 
 import (
 	"context"
+	"crypto/subtle"
 	"database/sql"
 	"encoding/json"
 	"fmt"
@@ -10,6 +11,7 @@ import (
 	"path/filepath"
 	"time"
 
+	"codejudge/common/auth"
 	"codejudge/common/dbutil"
 	"codejudge/common/env"
 	"codejudge/common/health"
@@ -28,12 +30,44 @@ var (
 	txManager *dbutil.TransactionManager
 	rdb       *redis.Client
 	ctx       = context.Background()
+
+	// Shared with the services allowed to pick a lane and user for a
+	// submission; empty means nobody is
+	internalToken string
 )
 
 type Submission struct {
 	ID         int    `json:"id"`
 	ProblemID  int    `json:"problem_id"`
 	SourceCode string `json:"source_code"`
+	Language   string `json:"language,omitempty"` // cpp (default), c, python or java
+	UserID     int    `json:"user_id,omitempty"`  // the caller's account; judges share time fairly between users
+	Lane       string `json:"lane,omitempty"`     // contest, practice (default) or rejudge; internal callers only
+}
+
+// Source file extension per language the judge accepts
+var languageExtensions = map[string]string{
+	"cpp":    "cpp",
+	"c":      "c",
+	"python": "py",
+	"java":   "java",
+}
+
+// judgeQueue returns the judge queue for a lane and the entry to push onto it
+func judgeQueue(s *Submission) (string, string) {
+	entry := fmt.Sprintf("%d:%d:%d:%d", s.ID, s.UserID, s.ProblemID, time.Now().UnixMilli())
+	switch s.Lane {
+	case "contest", "rejudge":
+		return "submission_queue:" + s.Lane, entry
+	default:
+		return "submission_queue", entry
+	}
+}
+
+// isInternal reports whether the request carries the internal service token
+func isInternal(r *http.Request) bool {
+	token := r.Header.Get("X-Internal-Token")
+	return internalToken != "" && subtle.ConstantTimeCompare([]byte(token), []byte(internalToken)) == 1
 }
 
 func connectDB() {
@@ -65,6 +99,24 @@ func createTable() {
 	if _, err := dbManager.GetDB().Exec(createTableSQL); err != nil {
 		logger.Fatal("Failed to create 'submissions' table", zap.Error(err))
 	}
+
+	// Filled in by the judge along with the verdict
+	addUsageSQL := `
+	ALTER TABLE submissions
+		ADD COLUMN IF NOT EXISTS judged_at TIMESTAMP WITH TIME ZONE,
+		ADD COLUMN IF NOT EXISTS time_ms INTEGER,
+		ADD COLUMN IF NOT EXISTS memory_kb INTEGER;`
+	if _, err := dbManager.GetDB().Exec(addUsageSQL); err != nil {
+		logger.Fatal("Failed to add usage columns", zap.Error(err))
+	}
+
+	// Submissions from before languages existed are all C++
+	addLanguageSQL := `
+	ALTER TABLE submissions
+		ADD COLUMN IF NOT EXISTS language VARCHAR(20) NOT NULL DEFAULT 'cpp';`
+	if _, err := dbManager.GetDB().Exec(addLanguageSQL); err != nil {
+		logger.Fatal("Failed to add language column", zap.Error(err))
+	}
 	logger.Info("'submissions' table is ready")
 }
 
@@ -90,14 +142,15 @@ func createSubmissionTransactional(s *Submission) error {
 	dt := dbutil.NewDistributedTransaction(submissionID, txManager, logger)
 
 	var filePath string
+	var queue, entry string
 
 	// Step 1: Database insertion with proper isolation
 	dt.AddStep(dbutil.DistributedTransactionStep{
 		Name: "database_insert",
 		Execute: func(ctx context.Context) error {
 			return txManager.ExecuteStrictTransaction(ctx, func(tx *sql.Tx) error {
-				query := "INSERT INTO submissions (problem_id, source_code) VALUES ($1, $2) RETURNING id"
-				return tx.QueryRowContext(ctx, query, s.ProblemID, s.SourceCode).Scan(&s.ID)
+				query := "INSERT INTO submissions (problem_id, source_code, language) VALUES ($1, $2, $3) RETURNING id"
+				return tx.QueryRowContext(ctx, query, s.ProblemID, s.SourceCode, s.Language).Scan(&s.ID)
 			})
 		},
 		Compensate: func(ctx context.Context) error {
@@ -118,7 +171,7 @@ func createSubmissionTransactional(s *Submission) error {
 				return fmt.Errorf("failed to create submission directory: %w", err)
 			}
 
-			filePath = filepath.Join(submissionDir, fmt.Sprintf("%d.cpp", s.ID))
+			filePath = filepath.Join(submissionDir, fmt.Sprintf("%d.%s", s.ID, languageExtensions[s.Language]))
 			if err := os.WriteFile(filePath, []byte(s.SourceCode), 0644); err != nil {
 				return fmt.Errorf("failed to write submission file: %w", err)
 			}
@@ -138,8 +191,9 @@ func createSubmissionTransactional(s *Submission) error {
 		Name: "queue_operations",
 		Execute: func(ctx context.Context) error {
 			// Use Redis pipeline for atomicity
+			queue, entry = judgeQueue(s)
 			pipe := rdb.Pipeline()
-			pipe.LPush(ctx, "submission_queue", s.ID)
+			pipe.LPush(ctx, queue, entry)
 			pipe.LPush(ctx, "plagiarism_queue", s.ID)
 
 			_, err := pipe.Exec(ctx)
@@ -151,7 +205,7 @@ func createSubmissionTransactional(s *Submission) error {
 		Compensate: func(ctx context.Context) error {
 			// Remove from queues (best effort)
 			pipe := rdb.Pipeline()
-			pipe.LRem(ctx, "submission_queue", 1, s.ID)
+			pipe.LRem(ctx, queue, 1, entry)
 			pipe.LRem(ctx, "plagiarism_queue", 1, s.ID)
 			_, err := pipe.Exec(ctx)
 			return err // Don't fail compensation if Redis cleanup fails
@@ -182,6 +236,30 @@ func createSubmission(w http.ResponseWriter, r *http.Request) {
 		return
 	}
 
+	// The public path can't choose its own lane or user: the user comes
+	// from the token, anonymous submissions share user 0
+	if !isInternal(r) {
+		if s.Lane != "" {
+			http.Error(w, "Lane can only be set by internal services", http.StatusForbidden)
+			return
+		}
+		s.UserID = 0
+		if userID, ok := auth.GetUserIDFromContext(r.Context()); ok {
+			s.UserID = userID
+		}
+	}
+	if s.Lane != "" && s.Lane != "contest" && s.Lane != "practice" && s.Lane != "rejudge" {
+		http.Error(w, "Invalid lane", http.StatusBadRequest)
+		return
+	}
+	if s.Language == "" {
+		s.Language = "cpp"
+	}
+	if _, ok := languageExtensions[s.Language]; !ok {
+		http.Error(w, "Invalid language", http.StatusBadRequest)
+		return
+	}
+
 	// Use transactional submission creation
 	if err := createSubmissionTransactional(&s); err != nil {
 		if submissionErr, ok := err.(*SubmissionError); ok {
@@ -216,6 +294,14 @@ func main() {
 	createTable()
 	defer dbManager.Close()
 
+	internalToken = env.Get("SUBMISSIONS_INTERNAL_TOKEN", "")
+	submit := http.Handler(http.HandlerFunc(createSubmission))
+	if jwtSecret := env.Get("JWT_SECRET", ""); jwtSecret != "" {
+		submit = auth.OptionalAuth([]byte(jwtSecret), logger)(submit)
+	} else {
+		logger.Warn("JWT_SECRET not set, every submission is judged as the anonymous user")
+	}
+
 	r := chi.NewRouter()
 
 	// Middleware
@@ -224,7 +310,7 @@ func main() {
 	r.Use(middleware.Timeout(60 * time.Second))
 
 	// Routes
-	r.Post("/submissions", createSubmission)
+	r.Method(http.MethodPost, "/submissions", submit)
 	r.Get("/health", health.HealthHandler())
 	r.Get("/ready", health.ReadyHandler(func(ctx context.Context) error {
 		// Check both database and Redis connectivity